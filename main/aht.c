@@ -1,123 +1,741 @@
+#include <string.h>
 #include "aht.h"
 
 const static char *TAG = "AHT20";
 
-static i2c_config_t aht20_i2c_conf = {
-    .mode = I2C_MODE_MASTER,
-    .sda_io_num = I2C_SDA,
-    .scl_io_num = I2C_SCL,
-    .sda_pullup_en = GPIO_PULLUP_ENABLE,
-    .scl_pullup_en = GPIO_PULLUP_ENABLE,
-    .master.clk_speed = 400000
-};
+// Runs in ISR context once a queued AHT20 transfer has finished on the bus
+static bool aht20_on_trans_done(i2c_master_dev_handle_t i2c_dev, const i2c_master_event_data_t *evt_data, void *arg)
+{
+    aht20_bus_t *bus = (aht20_bus_t *) arg;
+    aht20_dev_t *dev = bus->active;
+    BaseType_t woken = pdFALSE;
+
+    if (dev == NULL) {
+        return false;
+    }
+
+    dev->xfer_failed = (evt_data->event == I2C_EVENT_NACK) || bus->mux_failed;
+    dev->xfer_done_us = esp_timer_get_time();
+    dev->xfer_done = true;
+    bus->active = NULL;
+
+    if (dev->waiter) {
+        vTaskNotifyGiveFromISR(dev->waiter, &woken);
+    }
+
+    return woken == pdTRUE;
+}
+
+// Runs in ISR context once a channel select has finished; the AHT20 transfer
+// queued behind it reports the failure
+static bool tca9548a_on_trans_done(i2c_master_dev_handle_t i2c_dev, const i2c_master_event_data_t *evt_data, void *arg)
+{
+    aht20_bus_t *bus = (aht20_bus_t *) arg;
+
+    if (evt_data->event == I2C_EVENT_NACK) {
+        bus->mux_failed = true;
+    }
+
+    return false;
+}
+
+static void aht20_on_poll_timer(void *arg)
+{
+    aht20_dev_t *dev = (aht20_dev_t *) arg;
+
+    if (dev->waiter) {
+        xTaskNotifyGive(dev->waiter);
+    }
+}
+
+esp_err_t aht20_bus_init(const aht20_bus_config_t *config, aht20_bus_t *bus_out)
+{
+    const i2c_master_bus_config_t bus_conf = {
+        .i2c_port = config->i2c_port,
+        .sda_io_num = config->sda_io_num,
+        .scl_io_num = config->scl_io_num,
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = 7,
+        .trans_queue_depth = AHT20_TRANS_QUEUE_DEPTH,
+        .flags.enable_internal_pullup = true,
+    };
+    const i2c_device_config_t aht20_conf = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = AHT20_ADDR,
+        .scl_speed_hz = I2C_SPEED_HZ,
+    };
+    const i2c_device_config_t mux_conf = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = config->mux_addr,
+        .scl_speed_hz = I2C_SPEED_HZ,
+    };
+    const i2c_master_event_callbacks_t aht20_cbs = {
+        .on_trans_done = aht20_on_trans_done,
+    };
+    const i2c_master_event_callbacks_t mux_cbs = {
+        .on_trans_done = tca9548a_on_trans_done,
+    };
+
+    memset(bus_out, 0, sizeof(*bus_out));
+    bus_out->mux_channel = AHT20_NO_MUX;
+
+    ESP_RETURN_ON_ERROR(i2c_new_master_bus(&bus_conf, &bus_out->bus), TAG, "Unable to create I2C bus %d", config->i2c_port);
+    ESP_RETURN_ON_ERROR(i2c_master_bus_add_device(bus_out->bus, &aht20_conf, &bus_out->aht20), TAG, "Unable to add AHT20 to I2C bus");
+    ESP_RETURN_ON_ERROR(i2c_master_register_event_callbacks(bus_out->aht20, &aht20_cbs, bus_out), TAG, "Unable to register AHT20 callbacks");
+
+    if (config->mux_addr) {
+        ESP_RETURN_ON_ERROR(i2c_master_bus_add_device(bus_out->bus, &mux_conf, &bus_out->mux), TAG, "Unable to add TCA9548A to I2C bus");
+        ESP_RETURN_ON_ERROR(i2c_master_register_event_callbacks(bus_out->mux, &mux_cbs, bus_out), TAG, "Unable to register TCA9548A callbacks");
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t aht20_init(aht20_bus_t *bus, uint8_t mux_channel, aht20_dev_t *dev_out)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = aht20_on_poll_timer,
+        .arg = dev_out,
+        .name = "aht20_poll",
+    };
+
+    ESP_RETURN_ON_FALSE(bus && bus->aht20, ESP_ERR_INVALID_STATE, TAG, "AHT20 bus not initialized");
+    ESP_RETURN_ON_FALSE(bus->mux ? mux_channel < TCA9548A_CHANNELS : mux_channel == AHT20_NO_MUX,
+                        ESP_ERR_INVALID_ARG, TAG, "Invalid mux channel %u", mux_channel);
+
+    memset(dev_out, 0, sizeof(*dev_out));
+    dev_out->bus = bus;
+    dev_out->mux_channel = mux_channel;
+
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &dev_out->poll_timer), TAG, "Unable to create AHT20 poll timer");
+    dev_out->stats.learned_conversion_us = AHT20_CONVERSION_TYPICAL_MS * 1000;
+    dev_out->state = AHT20_STATE_IDLE;
+    return ESP_OK;
+}
 
-void aht20_i2c_setup() {
-    i2c_param_config(I2C_MASTER_PORT, &aht20_i2c_conf);
-    i2c_driver_install(I2C_MASTER_PORT, aht20_i2c_conf.mode, 0, 0, 0);
+// Takes the bus for dev and, behind a mux, queues the channel select first.
+// Returns ESP_ERR_NOT_FINISHED while another sensor on the bus has a transfer in flight.
+static esp_err_t aht20_claim_bus(aht20_dev_handle_t dev)
+{
+    aht20_bus_t *bus = dev->bus;
+    esp_err_t ret;
+
+    if (bus->active != NULL) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+
+    bus->active = dev;
+    bus->mux_failed = false;
+    dev->xfer_done = false;
+
+    if (bus->mux && bus->mux_channel != dev->mux_channel) {
+        bus->mux_tx = BIT(dev->mux_channel);
+        ret = i2c_master_transmit(bus->mux, &bus->mux_tx, 1, AHT20_XFER_TIMEOUT_MS);
+        if (ret != ESP_OK) {
+            bus->active = NULL;
+            bus->mux_channel = AHT20_NO_MUX;
+            return ret;
+        }
+        bus->mux_channel = dev->mux_channel;
+    }
+
+    return ESP_OK;
 }
 
-static esp_err_t aht20_write_reg(aht20_dev_handle_t dev, uint8_t reg_addr, uint8_t *data, uint8_t len)
+static esp_err_t aht20_write_reg(aht20_dev_handle_t dev, uint8_t reg_addr, const uint8_t *data, uint8_t len)
 {
     esp_err_t ret;
 
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    ret = i2c_master_start(cmd);
-    assert(ESP_OK == ret);
-    ret = i2c_master_write_byte(cmd, (AHT20_ADDR << 1) | I2C_MASTER_WRITE, true);
-    assert(ESP_OK == ret);
-    ret = i2c_master_write_byte(cmd, AHT20_START_MEAS, true);
-    assert(ESP_OK == ret);
-    if (len) {
-        ret = i2c_master_write(cmd, data, len, true);
-        assert(ESP_OK == ret);
-    }
-    ret = i2c_master_stop(cmd);
-    assert(ESP_OK == ret);
-    ret = i2c_master_cmd_begin(I2C_MASTER_PORT, cmd, 5000 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
+    ESP_RETURN_ON_FALSE(len < sizeof(dev->tx_buf), ESP_ERR_INVALID_SIZE, TAG, "AHT20 command too long");
 
-    return ret;
+    ret = aht20_claim_bus(dev);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // The transfer completes after this returns, so the frame has to outlive the call
+    dev->tx_buf[0] = reg_addr;
+    memcpy(&dev->tx_buf[1], data, len);
+
+    ret = i2c_master_transmit(dev->bus->aht20, dev->tx_buf, len + 1, AHT20_XFER_TIMEOUT_MS);
+    if (ret != ESP_OK) {
+        dev->bus->active = NULL;
+        return ret;
+    }
+
+    dev->xfer_deadline_us = esp_timer_get_time() + AHT20_XFER_TIMEOUT_MS * 1000LL;
+    return ESP_OK;
 }
 
-static esp_err_t aht20_read_reg(aht20_dev_handle_t dev, uint8_t *data, size_t len)
+static esp_err_t aht20_read_reg(aht20_dev_handle_t dev, size_t len)
 {
     esp_err_t ret;
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    ret = i2c_master_start(cmd);
-    assert(ESP_OK == ret);
-    ret = i2c_master_write_byte(cmd, (AHT20_ADDR << 1) | I2C_MASTER_READ, true);
-    assert(ESP_OK == ret);
-    ret = i2c_master_read(cmd, data, len, I2C_MASTER_LAST_NACK);
-    assert(ESP_OK == ret);
-    ret = i2c_master_stop(cmd);
-    assert(ESP_OK == ret);
-    ret = i2c_master_cmd_begin(I2C_MASTER_PORT, cmd, 1000 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
 
-    return ret;
+    ret = aht20_claim_bus(dev);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = i2c_master_receive(dev->bus->aht20, dev->rx_buf, len, AHT20_XFER_TIMEOUT_MS);
+    if (ret != ESP_OK) {
+        dev->bus->active = NULL;
+        return ret;
+    }
+
+    dev->xfer_deadline_us = esp_timer_get_time() + AHT20_XFER_TIMEOUT_MS * 1000LL;
+    return ESP_OK;
 }
 
-static uint8_t aht20_calc_crc(uint8_t *data, uint8_t len)
+// CRC-8, polynomial 0x31 (x^8 + x^5 + x^4 + 1), one lookup per byte
+static const uint8_t aht20_crc_table[256] = {
+    0x00, 0x31, 0x62, 0x53, 0xC4, 0xF5, 0xA6, 0x97, 0xB9, 0x88, 0xDB, 0xEA, 0x7D, 0x4C, 0x1F, 0x2E,
+    0x43, 0x72, 0x21, 0x10, 0x87, 0xB6, 0xE5, 0xD4, 0xFA, 0xCB, 0x98, 0xA9, 0x3E, 0x0F, 0x5C, 0x6D,
+    0x86, 0xB7, 0xE4, 0xD5, 0x42, 0x73, 0x20, 0x11, 0x3F, 0x0E, 0x5D, 0x6C, 0xFB, 0xCA, 0x99, 0xA8,
+    0xC5, 0xF4, 0xA7, 0x96, 0x01, 0x30, 0x63, 0x52, 0x7C, 0x4D, 0x1E, 0x2F, 0xB8, 0x89, 0xDA, 0xEB,
+    0x3D, 0x0C, 0x5F, 0x6E, 0xF9, 0xC8, 0x9B, 0xAA, 0x84, 0xB5, 0xE6, 0xD7, 0x40, 0x71, 0x22, 0x13,
+    0x7E, 0x4F, 0x1C, 0x2D, 0xBA, 0x8B, 0xD8, 0xE9, 0xC7, 0xF6, 0xA5, 0x94, 0x03, 0x32, 0x61, 0x50,
+    0xBB, 0x8A, 0xD9, 0xE8, 0x7F, 0x4E, 0x1D, 0x2C, 0x02, 0x33, 0x60, 0x51, 0xC6, 0xF7, 0xA4, 0x95,
+    0xF8, 0xC9, 0x9A, 0xAB, 0x3C, 0x0D, 0x5E, 0x6F, 0x41, 0x70, 0x23, 0x12, 0x85, 0xB4, 0xE7, 0xD6,
+    0x7A, 0x4B, 0x18, 0x29, 0xBE, 0x8F, 0xDC, 0xED, 0xC3, 0xF2, 0xA1, 0x90, 0x07, 0x36, 0x65, 0x54,
+    0x39, 0x08, 0x5B, 0x6A, 0xFD, 0xCC, 0x9F, 0xAE, 0x80, 0xB1, 0xE2, 0xD3, 0x44, 0x75, 0x26, 0x17,
+    0xFC, 0xCD, 0x9E, 0xAF, 0x38, 0x09, 0x5A, 0x6B, 0x45, 0x74, 0x27, 0x16, 0x81, 0xB0, 0xE3, 0xD2,
+    0xBF, 0x8E, 0xDD, 0xEC, 0x7B, 0x4A, 0x19, 0x28, 0x06, 0x37, 0x64, 0x55, 0xC2, 0xF3, 0xA0, 0x91,
+    0x47, 0x76, 0x25, 0x14, 0x83, 0xB2, 0xE1, 0xD0, 0xFE, 0xCF, 0x9C, 0xAD, 0x3A, 0x0B, 0x58, 0x69,
+    0x04, 0x35, 0x66, 0x57, 0xC0, 0xF1, 0xA2, 0x93, 0xBD, 0x8C, 0xDF, 0xEE, 0x79, 0x48, 0x1B, 0x2A,
+    0xC1, 0xF0, 0xA3, 0x92, 0x05, 0x34, 0x67, 0x56, 0x78, 0x49, 0x1A, 0x2B, 0xBC, 0x8D, 0xDE, 0xEF,
+    0x82, 0xB3, 0xE0, 0xD1, 0x46, 0x77, 0x24, 0x15, 0x3B, 0x0A, 0x59, 0x68, 0xFF, 0xCE, 0x9D, 0xAC,
+};
+
+static uint8_t aht20_calc_crc(const uint8_t *data, uint8_t len)
 {
-    uint8_t i;
-    uint8_t byte;
     uint8_t crc = 0xFF;
 
-    for (byte = 0; byte < len; byte++) {
-        crc ^= data[byte];
-        for (i = 8; i > 0; --i) {
-            if ((crc & 0x80) != 0) {
-                crc = (crc << 1) ^ 0x31;
-            } else {
-                crc = crc << 1;
-            }
-        }
+    for (uint8_t byte = 0; byte < len; byte++) {
+        crc = aht20_crc_table[crc ^ data[byte]];
     }
 
     return crc;
 }
 
-esp_err_t aht20_read_measures(aht20_data *data_out) {
-    i2c_cmd_handle_t cmd_handle = i2c_cmd_link_create();
+static esp_err_t aht20_validate_frame(const uint8_t *buf)
+{
+    if (!(buf[0] & BIT(AT581X_STATUS_Calibration_Enable)) ||
+            !(buf[0] & BIT(AT581X_STATUS_CRC_FLAG)) ||
+            (buf[0] & BIT(AT581X_STATUS_BUSY_INDICATION))) {
+        ESP_LOGI(TAG, "data is not ready");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    ESP_RETURN_ON_FALSE(aht20_calc_crc(buf, AHT20_DATA_LEN) == buf[AHT20_DATA_LEN], ESP_ERR_INVALID_CRC, TAG, "Error calculating AHT20 CRC");
 
-    uint8_t status;
-    uint8_t buf[7];
+    return ESP_OK;
+}
+
+static void aht20_extract_raw(const uint8_t *buf, uint32_t *raw_humidity_out, uint32_t *raw_temperature_out)
+{
     uint32_t raw_humidity;
     uint32_t raw_temperature;
 
-    ESP_RETURN_ON_FALSE(cmd_handle, ESP_ERR_INVALID_ARG, TAG, "Invalid AHT20 device handle pointer");
+    raw_humidity = buf[1];
+    raw_humidity = raw_humidity << 8;
+    raw_humidity += buf[2];
+    raw_humidity = raw_humidity << 8;
+    raw_humidity += buf[3];
+    raw_humidity = raw_humidity >> 4;
+    *raw_humidity_out = raw_humidity;
 
-    buf[0] = 0x33;
-    buf[1] = 0x00;
-    ESP_RETURN_ON_ERROR(aht20_write_reg(cmd_handle, AHT20_START_MEAS, buf, 2), TAG, "I2C read/write error");
+    raw_temperature = buf[3] & 0x0F;
+    raw_temperature = raw_temperature << 8;
+    raw_temperature += buf[4];
+    raw_temperature = raw_temperature << 8;
+    raw_temperature += buf[5];
+    *raw_temperature_out = raw_temperature;
+}
 
-    vTaskDelay(pdMS_TO_TICKS(100));
+static void aht20_convert_frame(const uint8_t *buf, aht20_data *data_out)
+{
+    uint32_t raw_humidity;
+    uint32_t raw_temperature;
 
-    ESP_RETURN_ON_ERROR(aht20_read_reg(cmd_handle, &status, 1), TAG, "I2C read/write error");
+    aht20_extract_raw(buf, &raw_humidity, &raw_temperature);
+    data_out->relative_humidity = (float)raw_humidity * 0.000095367;
+    data_out->temperature_celsius = (float)raw_temperature * 0.000190735 - 50;
+}
 
-    if ((status & BIT(AT581X_STATUS_Calibration_Enable)) &&
-            (status & BIT(AT581X_STATUS_CRC_FLAG)) &&
-            ((status & BIT(AT581X_STATUS_BUSY_INDICATION)) == 0)) {
-        ESP_RETURN_ON_ERROR(aht20_read_reg(cmd_handle, buf, 7), TAG, "I2C read/write error");
-        ESP_RETURN_ON_ERROR((aht20_calc_crc(buf, 6) != buf[6]), TAG, "Error calculating AHT20 CRC");
+// Clears a bus left hanging by a transfer that never completed: resets the
+// controller and clocks SCL until a stuck slave releases SDA
+static void aht20_recover_bus(aht20_bus_t *bus)
+{
+    esp_err_t ret;
 
-        raw_humidity = buf[1];
-        raw_humidity = raw_humidity << 8;
-        raw_humidity += buf[2];
-        raw_humidity = raw_humidity << 8;
-        raw_humidity += buf[3];
-        raw_humidity = raw_humidity >> 4;
-        data_out->relative_humidity = (float)raw_humidity * 0.000095367;
+    bus->active = NULL;
+    bus->mux_channel = AHT20_NO_MUX;
+    bus->bus_resets++;
 
-        raw_temperature = buf[3] & 0x0F;
-        raw_temperature = raw_temperature << 8;
-        raw_temperature += buf[4];
-        raw_temperature = raw_temperature << 8;
-        raw_temperature += buf[5];
-        data_out->temperature_celsius = (float)raw_temperature * 0.000190735 - 50;
-        return ESP_OK;
+    ret = i2c_master_bus_reset(bus->bus);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to reset I2C bus: %s", esp_err_to_name(ret));
+    }
+}
+
+// Ends the measurement after a failure and schedules a soft reset and
+// recalibration for the next one. The mux selection is unknown afterwards.
+static esp_err_t aht20_abort(aht20_dev_handle_t dev, esp_err_t err, const char *what)
+{
+    dev->state = AHT20_STATE_IDLE;
+    dev->needs_recovery = true;
+    dev->bus->mux_channel = AHT20_NO_MUX;
+    ESP_LOGE(TAG, "AHT20 (mux channel %u) %s", dev->mux_channel, what);
+
+    // Other sensors may be waiting for this bus; have the waiter poll them now
+    // rather than at their own backstop
+    if (dev->waiter) {
+        xTaskNotifyGive(dev->waiter);
+    }
+
+    return err;
+}
+
+// Checks the transfer queued by the current state. A transfer that has not
+// completed by its deadline has wedged the bus, which is reset so the other
+// sensors on it can carry on.
+static esp_err_t aht20_check_xfer(aht20_dev_handle_t dev, const char *nack_what)
+{
+    if (!dev->xfer_done) {
+        if (esp_timer_get_time() < dev->xfer_deadline_us) {
+            return ESP_ERR_NOT_FINISHED;
+        }
+        dev->stats.xfer_timeouts++;
+        aht20_recover_bus(dev->bus);
+        return aht20_abort(dev, ESP_ERR_TIMEOUT, "transfer timed out, bus reset");
+    }
+
+    if (dev->xfer_failed) {
+        return aht20_abort(dev, ESP_FAIL, nack_what);
+    }
+
+    return ESP_OK;
+}
+
+// Queues a command and moves to in_flight once it is on the bus
+static esp_err_t aht20_issue(aht20_dev_handle_t dev, uint8_t cmd, const uint8_t *data, uint8_t len, aht20_state_t in_flight)
+{
+    esp_err_t ret;
+
+    ret = aht20_write_reg(dev, cmd, data, len);
+    if (ret == ESP_ERR_NOT_FINISHED) {
+        return ret;
+    }
+    if (ret != ESP_OK) {
+        return aht20_abort(dev, ret, "I2C read/write error");
+    }
+
+    dev->state = in_flight;
+    return ESP_ERR_NOT_FINISHED;
+}
+
+static esp_err_t aht20_issue_trigger(aht20_dev_handle_t dev)
+{
+    static const uint8_t trigger[2] = { 0x33, 0x00 };
+
+    return aht20_issue(dev, AHT20_START_MEAS, trigger, sizeof(trigger), AHT20_STATE_TRIGGERING);
+}
+
+static esp_err_t aht20_poll_frame(aht20_dev_handle_t dev);
+
+esp_err_t aht20_start_measurement(aht20_dev_handle_t dev)
+{
+    esp_err_t ret;
+
+    ESP_RETURN_ON_FALSE(dev && dev->bus, ESP_ERR_INVALID_STATE, TAG, "AHT20 device handle not initialized");
+    ESP_RETURN_ON_FALSE(dev->state == AHT20_STATE_IDLE, ESP_ERR_INVALID_STATE, TAG, "AHT20 measurement already in flight");
+
+    dev->waiter = xTaskGetCurrentTaskHandle();
+
+    if (dev->needs_recovery) {
+        dev->stats.recoveries++;
+        dev->state = AHT20_STATE_RESET_PENDING;
     } else {
-        ESP_LOGI(TAG, "data is not ready");
+        dev->state = AHT20_STATE_TRIGGER_PENDING;
+    }
+
+    ret = aht20_poll_frame(dev);
+    return ret == ESP_ERR_NOT_FINISHED ? ESP_OK : ret;
+}
+
+// Parks the state machine until at_us and arms the wake-up timer for it
+static void aht20_schedule_wake(aht20_dev_handle_t dev, int64_t at_us, aht20_state_t state)
+{
+    int64_t delay_us = at_us - esp_timer_get_time();
+
+    dev->ready_at_us = at_us;
+    dev->state = state;
+
+    esp_timer_stop(dev->poll_timer);
+    esp_timer_start_once(dev->poll_timer, delay_us > 0 ? delay_us : 0);
+}
+
+// Schedules the next status poll
+static void aht20_schedule_poll(aht20_dev_handle_t dev, int64_t at_us)
+{
+    aht20_schedule_wake(dev, at_us, AHT20_STATE_CONVERTING);
+}
+
+// Waits out a command's settling time, then resumes at next
+static void aht20_schedule_settle(aht20_dev_handle_t dev, uint32_t settle_ms, aht20_state_t next)
+{
+    dev->settled_state = next;
+    aht20_schedule_wake(dev, dev->xfer_done_us + settle_ms * 1000LL, AHT20_STATE_SETTLING);
+}
+
+static void aht20_record_conversion(aht20_dev_handle_t dev, uint32_t conversion_us)
+{
+    aht20_conversion_stats_t *stats = &dev->stats;
+
+    stats->last_conversion_us = conversion_us;
+    stats->last_status_polls = dev->status_polls;
+    stats->status_polls += dev->status_polls;
+    stats->completed++;
+
+    if (stats->completed == 1 || conversion_us < stats->min_conversion_us) {
+        stats->min_conversion_us = conversion_us;
+    }
+    if (conversion_us > stats->max_conversion_us) {
+        stats->max_conversion_us = conversion_us;
+    }
+
+    // EMA with alpha = 1/8 tracks slow drift with temperature and supply voltage
+    stats->learned_conversion_us = stats->learned_conversion_us - (stats->learned_conversion_us >> 3) + (conversion_us >> 3);
+}
+
+// Runs the measurement state machine up to a validated frame in dev->rx_buf
+static esp_err_t aht20_poll_frame(aht20_dev_handle_t dev)
+{
+    static const uint8_t calibrate[2] = { 0x08, 0x00 };
+    esp_err_t ret;
+    int64_t first_poll_us;
+
+    switch (dev->state) {
+    case AHT20_STATE_IDLE:
+        return ESP_ERR_INVALID_STATE;
+
+    case AHT20_STATE_TRIGGER_PENDING:
+        return aht20_issue_trigger(dev);
+
+    case AHT20_STATE_TRIGGERING:
+        ret = aht20_check_xfer(dev, "did not acknowledge trigger");
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        // Sleep until just before the learned conversion time, then poll the busy bit
+        dev->trigger_done_us = dev->xfer_done_us;
+        dev->deadline_us = dev->trigger_done_us + AHT20_CONVERSION_TIMEOUT_MS * 1000LL;
+        dev->status_polls = 0;
+        first_poll_us = dev->trigger_done_us + dev->stats.learned_conversion_us - AHT20_POLL_GUARD_US;
+        aht20_schedule_poll(dev, first_poll_us);
+        return ESP_ERR_NOT_FINISHED;
+
+    case AHT20_STATE_CONVERTING:
+        if (esp_timer_get_time() < dev->ready_at_us) {
+            return ESP_ERR_NOT_FINISHED;
+        }
+        ret = aht20_read_reg(dev, 1);
+        if (ret == ESP_ERR_NOT_FINISHED) {
+            return ret;
+        }
+        if (ret != ESP_OK) {
+            return aht20_abort(dev, ret, "I2C read/write error");
+        }
+        dev->status_polls++;
+        dev->state = AHT20_STATE_POLLING;
+        return ESP_ERR_NOT_FINISHED;
+
+    case AHT20_STATE_POLLING:
+        ret = aht20_check_xfer(dev, "did not acknowledge status read");
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        if (dev->rx_buf[0] & BIT(AT581X_STATUS_BUSY_INDICATION)) {
+            if (dev->xfer_done_us >= dev->deadline_us) {
+                dev->stats.timeouts++;
+                return aht20_abort(dev, ESP_ERR_TIMEOUT, "still busy after conversion timeout");
+            }
+            aht20_schedule_poll(dev, dev->xfer_done_us + AHT20_POLL_INTERVAL_US);
+            return ESP_ERR_NOT_FINISHED;
+        }
+        aht20_record_conversion(dev, (uint32_t) (dev->xfer_done_us - dev->trigger_done_us));
+        dev->state = AHT20_STATE_READ_PENDING;
+        // fall through
+
+    case AHT20_STATE_READ_PENDING:
+        ret = aht20_read_reg(dev, AHT20_FRAME_LEN);
+        if (ret == ESP_ERR_NOT_FINISHED) {
+            return ret;
+        }
+        if (ret != ESP_OK) {
+            return aht20_abort(dev, ret, "I2C read/write error");
+        }
+        dev->state = AHT20_STATE_READING;
+        return ESP_ERR_NOT_FINISHED;
+
+    case AHT20_STATE_READING:
+        ret = aht20_check_xfer(dev, "did not acknowledge read");
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        dev->state = AHT20_STATE_IDLE;
+        ret = aht20_validate_frame(dev->rx_buf);
+        if (ret == ESP_ERR_TIMEOUT) {
+            // Busy or uncalibrated after reporting ready: start over from a reset
+            dev->needs_recovery = true;
+        }
+        return ret;
+
+    case AHT20_STATE_RESET_PENDING:
+        return aht20_issue(dev, AHT20_SOFT_RESET, NULL, 0, AHT20_STATE_RESETTING);
+
+    case AHT20_STATE_RESETTING:
+        ret = aht20_check_xfer(dev, "did not acknowledge soft reset");
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        aht20_schedule_settle(dev, AHT20_RESET_SETTLE_MS, AHT20_STATE_CALIBRATE_PENDING);
+        return ESP_ERR_NOT_FINISHED;
+
+    case AHT20_STATE_CALIBRATE_PENDING:
+        return aht20_issue(dev, AHT20_INIT_CMD, calibrate, sizeof(calibrate), AHT20_STATE_CALIBRATING);
+
+    case AHT20_STATE_CALIBRATING:
+        ret = aht20_check_xfer(dev, "did not acknowledge calibration");
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        // The calibration bit is checked again on the measurement frame
+        dev->needs_recovery = false;
+        aht20_schedule_settle(dev, AHT20_CALIBRATE_SETTLE_MS, AHT20_STATE_TRIGGER_PENDING);
         return ESP_ERR_NOT_FINISHED;
+
+    case AHT20_STATE_SETTLING:
+        if (esp_timer_get_time() < dev->ready_at_us) {
+            return ESP_ERR_NOT_FINISHED;
+        }
+        dev->state = dev->settled_state;
+        return aht20_poll_frame(dev);
+    }
+
+    return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t aht20_poll_result(aht20_dev_handle_t dev, aht20_data *data_out)
+{
+    esp_err_t ret = aht20_poll_frame(dev);
+
+    if (ret == ESP_OK) {
+        aht20_convert_frame(dev->rx_buf, data_out);
+    }
+
+    return ret;
+}
+
+static TickType_t aht20_ticks_until(int64_t at_us)
+{
+    int64_t remaining_us = at_us - esp_timer_get_time();
+
+    if (remaining_us <= 0) {
+        return 1;
+    }
+
+    return pdMS_TO_TICKS((remaining_us + 999) / 1000) + 1;
+}
+
+TickType_t aht20_ticks_until_ready(aht20_dev_handle_t dev)
+{
+    aht20_dev_t *active;
+
+    if (dev->state == AHT20_STATE_CONVERTING || dev->state == AHT20_STATE_SETTLING) {
+        // The poll timer notifies the waiter on time; this is only a backstop
+        return aht20_ticks_until(dev->ready_at_us);
+    }
+
+    // A transfer is in flight, ours or the one holding the bus. Its completion
+    // notifies the waiter; if it never comes, wake at its deadline to reset the bus.
+    active = dev->bus->active;
+    if (active) {
+        return aht20_ticks_until(active->xfer_deadline_us);
+    }
+
+    return 1;
+}
+
+void aht20_get_conversion_stats(aht20_dev_handle_t dev, aht20_conversion_stats_t *stats_out)
+{
+    *stats_out = dev->stats;
+}
+
+esp_err_t aht20_read_measures(aht20_dev_handle_t dev, aht20_data *data_out) {
+    esp_err_t ret;
+
+    ESP_RETURN_ON_ERROR(aht20_start_measurement(dev), TAG, "Unable to start AHT20 measurement");
+
+    while ((ret = aht20_poll_result(dev, data_out)) == ESP_ERR_NOT_FINISHED) {
+        ulTaskNotifyTake(pdTRUE, aht20_ticks_until_ready(dev));
     }
-}
\ No newline at end of file
+
+    return ret;
+}
+
+// Blocks until the transfer queued for dev completes or times out
+static esp_err_t aht20_wait_xfer(aht20_dev_handle_t dev)
+{
+    esp_err_t ret;
+
+    while ((ret = aht20_check_xfer(dev, "did not acknowledge")) == ESP_ERR_NOT_FINISHED) {
+        ulTaskNotifyTake(pdTRUE, aht20_ticks_until(dev->xfer_deadline_us));
+    }
+
+    return ret;
+}
+
+static esp_err_t aht20_read_status(aht20_dev_handle_t dev, uint8_t *status_out)
+{
+    ESP_RETURN_ON_ERROR(aht20_read_reg(dev, 1), TAG, "Unable to read AHT20 status");
+    ESP_RETURN_ON_ERROR(aht20_wait_xfer(dev), TAG, "AHT20 status read failed");
+
+    *status_out = dev->rx_buf[0];
+    return ESP_OK;
+}
+
+esp_err_t aht20_check_calibration(aht20_dev_handle_t dev)
+{
+    static const uint8_t calibrate[2] = { 0x08, 0x00 };
+    uint8_t status;
+
+    ESP_RETURN_ON_FALSE(dev && dev->bus, ESP_ERR_INVALID_STATE, TAG, "AHT20 device handle not initialized");
+    ESP_RETURN_ON_FALSE(dev->state == AHT20_STATE_IDLE, ESP_ERR_INVALID_STATE, TAG, "AHT20 measurement in flight");
+
+    dev->waiter = xTaskGetCurrentTaskHandle();
+
+    ESP_RETURN_ON_ERROR(aht20_read_status(dev, &status), TAG, "AHT20 not responding");
+    if (status & BIT(AT581X_STATUS_Calibration_Enable)) {
+        return ESP_OK;
+    }
+
+    ESP_LOGW(TAG, "AHT20 (mux channel %u) not calibrated, initializing", dev->mux_channel);
+    ESP_RETURN_ON_ERROR(aht20_write_reg(dev, AHT20_INIT_CMD, calibrate, sizeof(calibrate)), TAG, "Unable to send AHT20 calibration");
+    ESP_RETURN_ON_ERROR(aht20_wait_xfer(dev), TAG, "AHT20 calibration failed");
+    vTaskDelay(pdMS_TO_TICKS(AHT20_CALIBRATE_SETTLE_MS) + 1);
+
+    ESP_RETURN_ON_ERROR(aht20_read_status(dev, &status), TAG, "AHT20 not responding");
+    ESP_RETURN_ON_FALSE(status & BIT(AT581X_STATUS_Calibration_Enable), ESP_ERR_INVALID_STATE, TAG, "AHT20 did not calibrate");
+
+    return ESP_OK;
+}
+
+static esp_err_t aht20_driver_init(void *ctx)
+{
+    aht20_dev_t *dev = (aht20_dev_t *) ctx;
+
+    ESP_RETURN_ON_ERROR(aht20_init(dev->bus, dev->mux_channel, dev), TAG, "Unable to init AHT20");
+
+    // A sensor that is missing or wedged at boot stays registered and goes
+    // through recovery on its first measurement instead of failing startup
+    if (aht20_check_calibration(dev) != ESP_OK) {
+        dev->state = AHT20_STATE_IDLE;
+        dev->needs_recovery = true;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t aht20_driver_start(void *ctx)
+{
+    return aht20_start_measurement((aht20_dev_t *) ctx);
+}
+
+static esp_err_t aht20_driver_poll(void *ctx)
+{
+    return aht20_poll_frame((aht20_dev_t *) ctx);
+}
+
+static size_t aht20_driver_decode(void *ctx, sensor_record_t *records_out)
+{
+    aht20_dev_t *dev = (aht20_dev_t *) ctx;
+    aht20_data data;
+
+    aht20_convert_frame(dev->rx_buf, &data);
+
+    records_out[0] = (sensor_record_t) {
+        .channel = SENSOR_CHANNEL_TEMPERATURE,
+        .unit = SENSOR_UNIT_CELSIUS,
+        .value.f = data.temperature_celsius,
+    };
+    records_out[1] = (sensor_record_t) {
+        .channel = SENSOR_CHANNEL_HUMIDITY,
+        .unit = SENSOR_UNIT_PERCENT_RH,
+        .value.f = data.relative_humidity,
+    };
+
+    return 2;
+}
+
+static TickType_t aht20_driver_ticks_until_ready(void *ctx)
+{
+    return aht20_ticks_until_ready((aht20_dev_t *) ctx);
+}
+
+// Same order as aht20_raw_channels
+static void aht20_driver_read_raw(void *ctx, int32_t *codes_out)
+{
+    aht20_dev_t *dev = (aht20_dev_t *) ctx;
+    uint32_t raw_humidity;
+    uint32_t raw_temperature;
+
+    aht20_extract_raw(dev->rx_buf, &raw_humidity, &raw_temperature);
+    codes_out[0] = (int32_t) raw_temperature;
+    codes_out[1] = (int32_t) raw_humidity;
+}
+
+static size_t aht20_driver_read_frame(void *ctx, uint8_t *buf, size_t buf_size)
+{
+    aht20_dev_t *dev = (aht20_dev_t *) ctx;
+
+    if (buf_size < AHT20_DATA_LEN) {
+        return 0;
+    }
+
+    memcpy(buf, dev->rx_buf, AHT20_DATA_LEN);
+    return AHT20_DATA_LEN;
+}
+
+// T = code * 200 / 2^20 - 50 degC, RH = code * 100 / 2^20 %
+static const sensor_raw_channel_t aht20_raw_channels[] = {
+    {
+        .channel = SENSOR_CHANNEL_TEMPERATURE,
+        .scale = 0.000190735f,
+        .offset = -50.0f,
+        .centi_mul = 20000,
+        .centi_shift = 20,
+        .centi_offset = -5000,
+    },
+    {
+        .channel = SENSOR_CHANNEL_HUMIDITY,
+        .scale = 0.000095367f,
+        .offset = 0.0f,
+        .centi_mul = 10000,
+        .centi_shift = 20,
+        .centi_offset = 0,
+    },
+};
+
+const sensor_driver_t aht20_sensor_driver = {
+    .name = "AHT20",
+    .init = aht20_driver_init,
+    .start = aht20_driver_start,
+    .poll = aht20_driver_poll,
+    .decode = aht20_driver_decode,
+    .ticks_until_ready = aht20_driver_ticks_until_ready,
+    .read_raw = aht20_driver_read_raw,
+    .raw_channels = aht20_raw_channels,
+    .raw_channel_count = sizeof(aht20_raw_channels) / sizeof(aht20_raw_channels[0]),
+    .read_frame = aht20_driver_read_frame,
+};
@@ -2,21 +2,35 @@
 #define AHT_20
 
 #include "freertos/FreeRTOS.h"
-#include "driver/i2c.h"
-
-// TODO: Use this header instead
-// #include "driver/i2c_master.h"
-
+#include "freertos/task.h"
+#include "driver/i2c_master.h"
 #include "driver/gpio.h"
 #include "esp_bit_defs.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 #include "esp_types.h"
+#include "sensor_driver.h"
 
 #define AHT20_ADDR          0x38
 #define AHT20_START_MEAS    0XAC
-#define I2C_MASTER_PORT     I2C_NUM_0
-#define I2C_SDA             42
-#define I2C_SCL             41
+#define I2C_SPEED_HZ        400000
+
+#define AHT20_SOFT_RESET    0xBA
+#define AHT20_INIT_CMD      0xBE
+
+#define AHT20_XFER_TIMEOUT_MS   10      // Bounds the driver queue wait and each queued transfer
+#define AHT20_RESET_SETTLE_MS   20
+#define AHT20_CALIBRATE_SETTLE_MS 10
+#define AHT20_CONVERSION_TYPICAL_MS 80
+#define AHT20_CONVERSION_TIMEOUT_MS 150
+#define AHT20_POLL_GUARD_US     2000
+#define AHT20_POLL_INTERVAL_US  1000
+#define AHT20_TRANS_QUEUE_DEPTH 4
+#define AHT20_FRAME_LEN         7
+#define AHT20_DATA_LEN          6       // Status + 20-bit humidity + 20-bit temperature, before the CRC
+
+#define TCA9548A_CHANNELS   8
+#define AHT20_NO_MUX        0xFF
 
 #define AT581X_STATUS_CMP_INT               (2)
 #define AT581X_STATUS_Calibration_Enable    (3)
@@ -24,20 +38,184 @@
 #define AT581X_STATUS_MODE_STATUS           (5)
 #define AT581X_STATUS_BUSY_INDICATION       (7)
 
-typedef void *aht20_dev_handle_t;
+typedef enum {
+    AHT20_STATE_IDLE,
+    AHT20_STATE_TRIGGER_PENDING,
+    AHT20_STATE_TRIGGERING,
+    AHT20_STATE_CONVERTING,
+    AHT20_STATE_POLLING,
+    AHT20_STATE_READ_PENDING,
+    AHT20_STATE_READING,
+    AHT20_STATE_RESET_PENDING,
+    AHT20_STATE_RESETTING,
+    AHT20_STATE_CALIBRATE_PENDING,
+    AHT20_STATE_CALIBRATING,
+    AHT20_STATE_SETTLING,
+} aht20_state_t;
+
+typedef struct {
+    uint32_t last_conversion_us;
+    uint32_t last_status_polls;
+    uint32_t learned_conversion_us;
+    uint32_t min_conversion_us;
+    uint32_t max_conversion_us;
+    uint32_t completed;
+    uint32_t status_polls;
+    uint32_t timeouts;
+    uint32_t xfer_timeouts;             // Transfers that never completed and forced a bus reset
+    uint32_t recoveries;                // Soft reset + calibration sequences started
+} aht20_conversion_stats_t;
+
+typedef struct aht20_dev_t aht20_dev_t;
+
+typedef struct {
+    i2c_port_num_t i2c_port;
+    gpio_num_t     sda_io_num;
+    gpio_num_t     scl_io_num;
+    uint8_t        mux_addr;            // TCA9548A address, 0 when the bus has no mux
+} aht20_bus_config_t;
 
+/**
+ * One I2C controller. Every AHT20 answers at the same address, so all sensors
+ * behind a TCA9548A share a single driver device handle and take turns on the
+ * bus; at most one of them has a transfer in flight at a time.
+ */
 typedef struct {
-    i2c_port_t  i2c_port;
-    uint8_t     i2c_addr;
-} aht20_dev_t;
+    i2c_master_bus_handle_t bus;
+    i2c_master_dev_handle_t aht20;
+    i2c_master_dev_handle_t mux;
+    aht20_dev_t *volatile   active;
+    volatile bool           mux_failed;
+    uint8_t                 mux_channel;
+    uint8_t                 mux_tx;
+    uint32_t                bus_resets;
+} aht20_bus_t;
+
+struct aht20_dev_t {
+    aht20_bus_t             *bus;
+    uint8_t                 mux_channel;
+    aht20_state_t           state;
+    volatile bool           xfer_done;
+    volatile bool           xfer_failed;
+    volatile int64_t        xfer_done_us;
+    int64_t                 xfer_deadline_us;
+    TaskHandle_t            waiter;
+    esp_timer_handle_t      poll_timer;
+    int64_t                 trigger_done_us;
+    int64_t                 ready_at_us;
+    int64_t                 deadline_us;
+    uint32_t                status_polls;
+    aht20_state_t           settled_state;      // Where AHT20_STATE_SETTLING resumes
+    bool                    needs_recovery;
+    aht20_conversion_stats_t stats;
+    uint8_t                 tx_buf[3];
+    uint8_t                 rx_buf[AHT20_FRAME_LEN];
+};
+
+typedef aht20_dev_t *aht20_dev_handle_t;
 
 typedef struct {
     float temperature_celsius;
     float relative_humidity;
 } aht20_data;
 
-void aht20_i2c_setup();
-void check_calibration();
-esp_err_t aht20_read_measures(aht20_data *data_out);
+/**
+ * Sensor driver operations for the AHT20. The context is an aht20_dev_t whose
+ * @c bus and @c mux_channel are filled in before init is called.
+ */
+extern const sensor_driver_t aht20_sensor_driver;
+
+/**
+ * @brief Creates an I2C master bus, its shared AHT20 device handle and, if
+ * configured, the TCA9548A handle.
+ *
+ * The handles live for the lifetime of the application, so the read path
+ * never has to allocate. The bus runs in asynchronous mode: transfers are
+ * queued and completion is reported through the driver's event callback.
+ *
+ * @return ESP_OK on success, otherwise the error from the I2C driver.
+ */
+esp_err_t aht20_bus_init(const aht20_bus_config_t *config, aht20_bus_t *bus_out);
+
+/**
+ * @brief Binds an AHT20 to a bus and, when the bus has a mux, to a mux channel.
+ *
+ * @param mux_channel TCA9548A channel (0-7), or AHT20_NO_MUX.
+ */
+esp_err_t aht20_init(aht20_bus_t *bus, uint8_t mux_channel, aht20_dev_t *dev_out);
+
+/**
+ * @brief Blocking calibration check for use at startup.
+ *
+ * Reads the status byte and, if the calibration bit is clear, sends the
+ * initialization command and checks again. Every transfer is bounded by
+ * AHT20_XFER_TIMEOUT_MS.
+ *
+ * @return ESP_OK if the sensor reports itself calibrated,
+ *         ESP_ERR_INVALID_STATE if it does not, or an I2C error.
+ */
+esp_err_t aht20_check_calibration(aht20_dev_handle_t dev);
+
+/**
+ * @brief Requests a new conversion and returns immediately.
+ *
+ * The trigger is queued on the bus right away, or as soon as another sensor
+ * on the same bus releases it. The calling task receives a task notification
+ * each time a transfer or poll timer for this measurement completes.
+ *
+ * If the previous measurement failed, the sensor is first soft-reset and
+ * recalibrated. That sequence runs through the same non-blocking state
+ * machine, so it never holds up other sensors.
+ *
+ * @return ESP_OK if the measurement was started, ESP_ERR_INVALID_STATE if one
+ *         is already in flight, or an I2C error.
+ */
+esp_err_t aht20_start_measurement(aht20_dev_handle_t dev);
+
+/**
+ * @brief Advances the measurement state machine without blocking.
+ *
+ * Call repeatedly after aht20_start_measurement() until it returns something
+ * other than ESP_ERR_NOT_FINISHED.
+ *
+ * @param data_out Receives the converted reading once the frame is complete.
+ * @return ESP_OK when @p data_out holds a new reading, ESP_ERR_NOT_FINISHED
+ *         while the conversion or a transfer is still in flight,
+ *         ESP_ERR_TIMEOUT if the busy bit has not cleared by
+ *         AHT20_CONVERSION_TIMEOUT_MS or a transfer has not completed within
+ *         AHT20_XFER_TIMEOUT_MS (the bus is then reset), ESP_ERR_INVALID_CRC
+ *         on a corrupted frame, or an I2C error.
+ */
+esp_err_t aht20_poll_result(aht20_dev_handle_t dev, aht20_data *data_out);
+
+/**
+ * @brief Returns how many ticks the caller can wait before the next
+ * aht20_poll_result() call can make progress.
+ *
+ * Intended for ulTaskNotifyTake(): while a transfer is in flight the wait is
+ * cut short by the completion notification and otherwise ends at the
+ * transfer's deadline; while the sensor is converting or settling it expires
+ * when the sensor should be ready.
+ */
+TickType_t aht20_ticks_until_ready(aht20_dev_handle_t dev);
+
+/**
+ * @brief Copies the conversion-time statistics gathered so far.
+ *
+ * The first status poll is scheduled just before @c learned_conversion_us,
+ * then the busy bit is polled every AHT20_POLL_INTERVAL_US until it clears or
+ * AHT20_CONVERSION_TIMEOUT_MS expires.
+ */
+void aht20_get_conversion_stats(aht20_dev_handle_t dev, aht20_conversion_stats_t *stats_out);
+
+/**
+ * @brief Triggers a measurement and waits for temperature and humidity.
+ *
+ * Blocking wrapper around aht20_start_measurement() and aht20_poll_result().
+ *
+ * @param data_out Receives the converted reading.
+ * @return ESP_OK on success, otherwise the error from aht20_poll_result().
+ */
+esp_err_t aht20_read_measures(aht20_dev_handle_t dev, aht20_data *data_out);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,115 @@
+#include <inttypes.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "alarm.h"
+#include "sensor_set.h"
+
+const static char *TAG = "ALARM";
+
+typedef struct {
+    int32_t low_centi;
+    int32_t high_centi;
+} alarm_threshold_t;
+
+static const alarm_threshold_t thresholds[SENSOR_CHANNEL_COUNT] = {
+    [SENSOR_CHANNEL_TEMPERATURE] = { CONFIG_ALARM_TEMPERATURE_LOW_CENTI, CONFIG_ALARM_TEMPERATURE_HIGH_CENTI },
+    [SENSOR_CHANNEL_HUMIDITY] = { CONFIG_ALARM_HUMIDITY_LOW_CENTI, CONFIG_ALARM_HUMIDITY_HIGH_CENTI },
+};
+
+// Raised channels, one bit per channel, indexed by sensor ID
+static uint8_t raised[SENSOR_SET_MAX_SENSORS];
+static alarm_stats_t stats;
+
+_Static_assert(SENSOR_CHANNEL_COUNT <= 8, "Raised channels are kept in a byte per sensor");
+
+// Updates one channel's state; true if the sample matters to the alarm lane
+static bool alarm_check_channel(uint8_t sensor_id, uint8_t channel, int32_t centi)
+{
+    const alarm_threshold_t *threshold = &thresholds[channel];
+    uint8_t bit = BIT(channel);
+
+    if (!(raised[sensor_id] & bit)) {
+        if (centi < threshold->low_centi || centi > threshold->high_centi) {
+            raised[sensor_id] |= bit;
+            stats.raised++;
+            ESP_LOGW(TAG, "Sensor %u %s at %" PRId32 " is outside [%" PRId32 ", %" PRId32 "]", sensor_id,
+                     SENSOR_CHANNEL_SCHEMA[channel].key, centi, threshold->low_centi, threshold->high_centi);
+            return true;
+        }
+        return false;
+    }
+
+    if (centi >= threshold->low_centi + CONFIG_ALARM_HYSTERESIS_CENTI &&
+        centi <= threshold->high_centi - CONFIG_ALARM_HYSTERESIS_CENTI) {
+        raised[sensor_id] &= ~bit;
+        stats.cleared++;
+        ESP_LOGI(TAG, "Sensor %u %s back to %" PRId32, sensor_id, SENSOR_CHANNEL_SCHEMA[channel].key, centi);
+    }
+    return true;
+}
+
+bool alarm_check(const sensor_sample_t *sample)
+{
+    const sensor_record_t *record;
+    int32_t centi;
+    bool alarm = false;
+
+    if (sample->sensor_id >= SENSOR_SET_MAX_SENSORS) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        record = &sample->records[i];
+        if (record->channel >= SENSOR_CHANNEL_COUNT ||
+            sensor_set_record_centi(sample->sensor_id, record, &centi) != ESP_OK) {
+            continue;
+        }
+        alarm |= alarm_check_channel(sample->sensor_id, record->channel, centi);
+    }
+
+    return alarm;
+}
+
+void alarm_note_round(const sensor_sample_t *samples, size_t count, uint32_t attempts, int64_t acked_us)
+{
+    int64_t latency_us;
+
+    stats.attempts += attempts;
+    if (acked_us == 0) {
+        stats.failed_rounds++;
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        latency_us = acked_us - samples[i].acquired_us;
+
+        if (stats.delivered == 0) {
+            stats.min_latency_us = latency_us;
+            stats.max_latency_us = latency_us;
+            stats.mean_latency_us = latency_us;
+        } else {
+            if (latency_us < stats.min_latency_us) {
+                stats.min_latency_us = latency_us;
+            }
+            if (latency_us > stats.max_latency_us) {
+                stats.max_latency_us = latency_us;
+            }
+            stats.mean_latency_us += (latency_us - stats.mean_latency_us) / 8;
+        }
+        stats.last_latency_us = latency_us;
+        stats.delivered++;
+    }
+}
+
+void alarm_get_stats(alarm_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
+
+void alarm_log_stats(void)
+{
+    ESP_LOGI(TAG, "%" PRIu32 " raised, %" PRIu32 " cleared, %" PRIu32 " delivered in %" PRIu32 " attempts, %" PRIu32 " failed rounds, "
+             "latency last %" PRId64 " us, min %" PRId64 " us, max %" PRId64 " us, mean %" PRId64 " us",
+             stats.raised, stats.cleared, stats.delivered, stats.attempts, stats.failed_rounds,
+             stats.last_latency_us, stats.min_latency_us, stats.max_latency_us, stats.mean_latency_us);
+}
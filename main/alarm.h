@@ -0,0 +1,64 @@
+// alarm.h
+#ifndef ALARM_H
+#define ALARM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sensor_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t raised;                // Channels that went out of range
+    uint32_t cleared;               // Channels that came back inside their hysteresis band
+    uint32_t delivered;             // Alarm samples acknowledged by the collector
+    uint32_t attempts;              // Datagrams sent for them, retries included
+    uint32_t failed_rounds;         // Rounds that ran out of CONFIG_ALARM_MAX_ATTEMPTS
+    int64_t  last_latency_us;       // Acquisition to acknowledgement
+    int64_t  min_latency_us;
+    int64_t  max_latency_us;
+    int64_t  mean_latency_us;       // EMA, alpha = 1/8
+} alarm_stats_t;
+
+/**
+ * @brief Checks a sample against the per-channel thresholds.
+ *
+ * A channel raises when it leaves [low, high] and clears once it is back
+ * inside the band by CONFIG_ALARM_HYSTERESIS_CENTI. Every sample taken while
+ * one of its channels is raised, and the sample that clears it, is an alarm
+ * sample and should go through the alarm lane.
+ *
+ * Called from the sampling task only.
+ *
+ * @return true if @p sample is an alarm sample.
+ */
+bool alarm_check(const sensor_sample_t *sample);
+
+/**
+ * @brief Records the outcome of one alarm transmission round. Called from
+ * the sender only.
+ *
+ * @param samples The alarm samples the datagram carried.
+ * @param attempts Datagrams sent, retries included.
+ * @param acked_us esp_timer time of the acknowledgement, or 0 if none came.
+ */
+void alarm_note_round(const sensor_sample_t *samples, size_t count, uint32_t attempts, int64_t acked_us);
+
+/**
+ * @brief Copies the counters. Each one has a single writer, so this is safe
+ * from any task; the copy is not a consistent snapshot across fields.
+ */
+void alarm_get_stats(alarm_stats_t *stats_out);
+
+/**
+ * @brief Logs the counters and alarm latency.
+ */
+void alarm_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ALARM_H
@@ -1,178 +1,745 @@
-#include <socket.h>
+#include <inttypes.h>
+#include <string.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
-#include "aht.h"
-#include "cbor.h"
 #include "config.h"
 #include "constants.h"
+#include "alarm.h"
+#include "capture.h"
+#include "journal.h"
+#include "mem_budget.h"
+#ifdef CONFIG_BACKLOG_PSRAM
+#include "backlog.h"
+#endif
+#include "payload.h"
+#include "sample_ring.h"
+#include "scheduler.h"
+#include "sensor_set.h"
 #include "status_led.h"
 #include "time_sync.h"
+#include "transport.h"
 #include "wifi_manager.h"
 
-static QueueHandle_t msg_queue;
+#if defined(CONFIG_SAMPLE_RING_DROP_NEWEST)
+#define SAMPLE_RING_POLICY  SAMPLE_RING_DROP_NEWEST
+#elif defined(CONFIG_SAMPLE_RING_BLOCK)
+#define SAMPLE_RING_POLICY  SAMPLE_RING_BLOCK
+#else
+#define SAMPLE_RING_POLICY  SAMPLE_RING_OVERWRITE_OLDEST
+#endif
+
+#ifndef CONFIG_SAMPLE_RING_BLOCK_TIMEOUT_MS
+#define CONFIG_SAMPLE_RING_BLOCK_TIMEOUT_MS 0
+#endif
+
+#if defined(CONFIG_UPLINK_FORMAT_COLUMNAR)
+#define UPLINK_ENCODE_BATCH     payload_encode_columnar
+#else
+#define UPLINK_ENCODE_BATCH     payload_encode_batch
+#endif
+
+#if defined(CONFIG_UPLINK_ADAPTIVE_RTO)
+#define UPLINK_ACK_TIMEOUT_MS   TRANSPORT_TIMEOUT_ADAPTIVE
+#elif defined(CONFIG_UPLINK_ARQ)
+#define UPLINK_ACK_TIMEOUT_MS   CONFIG_UPLINK_ARQ_RTO_MS
+#else
+#define UPLINK_ACK_TIMEOUT_MS   (UDP_TIMEOUT * 1000)
+#endif
+
+#ifdef CONFIG_CAPTURE_MODE
+MEM_TASK_DEFINE(capture_task, "capture_aht20", CONFIG_CAPTURE_TASK_STACK_BYTES);
+MEM_TASK_DEFINE(capture_upload, "capture_upload", CONFIG_CAPTURE_TASK_STACK_BYTES);
+#else
+MEM_TASK_DEFINE(read_task, "read_aht20", CONFIG_READ_TASK_STACK_BYTES);
+MEM_TASK_DEFINE(sender_task, "send_data_to_server", CONFIG_SENDER_TASK_STACK_BYTES);
+#endif
+
+_Static_assert((CONFIG_SAMPLE_RING_LENGTH & (CONFIG_SAMPLE_RING_LENGTH - 1)) == 0, "SAMPLE_RING_LENGTH must be a power of two");
+static sensor_sample_t sample_slots[CONFIG_SAMPLE_RING_LENGTH];
+static sample_ring_t sample_ring;
+
+// Samples taken off the ring for the datagram being built; those that did
+// not fit stay for the next one
+static sensor_sample_t batch[CONFIG_UPLINK_MAX_BATCH_SAMPLES];
+static size_t batch_count;
+
+// Alarm samples bypass batching and the backlog in a lane of their own;
+// those taken off it stay here until acknowledged
+_Static_assert((CONFIG_ALARM_LANE_LENGTH & (CONFIG_ALARM_LANE_LENGTH - 1)) == 0, "ALARM_LANE_LENGTH must be a power of two");
+static sensor_sample_t alarm_slots[CONFIG_ALARM_LANE_LENGTH];
+static sample_ring_t alarm_lane;
+static sensor_sample_t alarm_batch[CONFIG_ALARM_LANE_LENGTH];
+static size_t alarm_count;
+static int64_t alarm_retry_at_us;
+
+// Stored batch being replayed
+static sensor_sample_t replay_batch[CONFIG_UPLINK_MAX_BATCH_SAMPLES];
 static int wifi_connect_retries;
 
 void read_aht20(void *pvParameters)
 {
-    aht20_data recorded_data = {0};
+    sensor_sample_t samples[SENSOR_SET_MAX_SENSORS];
+    size_t sample_count;
+    scheduler_stats_t stats;
+    sample_ring_stats_t ring_stats;
+    journal_stats_t journal_stats;
+#ifdef CONFIG_BACKLOG_PSRAM
+    backlog_stats_t backlog_stats;
+#endif
 
-    while (1) {
-        // Read AHT20
-        if (aht20_read_measures(&recorded_data) == 0)
+    ESP_ERROR_CHECK(scheduler_start(READ_SENSOR_SECONDS * 1000000ULL));
+
+    while (1)
+    {
+        // Released on exact period boundaries, however long the last batch took
+        scheduler_wait(NULL);
+
+        // Trigger every sensor, then collect the batch as the conversions finish
+        if (sensor_set_acquire(samples, SENSOR_SET_MAX_SENSORS, &sample_count) == ESP_OK)
         {
-            if (xQueueSend(msg_queue, (void *) &recorded_data, 10) != pdTRUE)
+            for (size_t i = 0; i < sample_count; i++)
             {
-                ESP_LOGE(TAG, "Unable to add measurement to queue.");
+                if (alarm_check(&samples[i]))
+                {
+                    if (sample_ring_push(&alarm_lane, &samples[i]) != ESP_OK)
+                    {
+                        ESP_LOGE(TAG, "Unable to add alarm from sensor %u to its lane.", samples[i].sensor_id);
+                    }
+                }
+                else if (sample_ring_push(&sample_ring, &samples[i]) != ESP_OK)
+                {
+                    ESP_LOGE(TAG, "Unable to add measurement from sensor %u to queue.", samples[i].sensor_id);
+                }
             }
         }
         else
         {
-            ESP_LOGE(TAG, "Unable to acquire reading from AHT20.");
+            ESP_LOGE(TAG, "Unable to acquire readings from sensors.");
         }
 
-        // Wait before reading AHT20 again
-        vTaskDelay((1000 * READ_SENSOR_SECONDS) / portTICK_PERIOD_MS);
+        scheduler_get_stats(&stats);
+        if (stats.periods % JITTER_REPORT_PERIODS == 0)
+        {
+            scheduler_log_stats();
+            sample_ring_get_stats(&sample_ring, &ring_stats);
+            ESP_LOGI(TAG, "Sample ring: %" PRIu32 " queued, high water %" PRIu32 ", %" PRIu32 " dropped, %" PRIu32 " overwritten.",
+                     sample_ring_count(&sample_ring), ring_stats.high_water, ring_stats.dropped, ring_stats.overwritten);
+            sample_ring_get_stats(&alarm_lane, &ring_stats);
+            ESP_LOGI(TAG, "Alarm lane: %" PRIu32 " queued, high water %" PRIu32 ", %" PRIu32 " overwritten.",
+                     sample_ring_count(&alarm_lane), ring_stats.high_water, ring_stats.overwritten);
+            alarm_log_stats();
+#ifdef CONFIG_BACKLOG_PSRAM
+            if (backlog_ready())
+            {
+                backlog_get_stats(&backlog_stats);
+                ESP_LOGI(TAG, "PSRAM backlog: %" PRIu32 " sample(s), %" PRIu32 "/%" PRIu32 " bytes (%" PRIu32 "%%), high water %" PRIu32 ", %" PRIu32 " spilled to flash, %" PRIu32 " dropped.",
+                         backlog_stats.samples, backlog_stats.used_bytes, backlog_stats.capacity_bytes,
+                         (uint32_t) ((uint64_t) backlog_stats.used_bytes * 100 / backlog_stats.capacity_bytes),
+                         backlog_stats.high_water_bytes, backlog_stats.spilled_samples, backlog_stats.dropped_samples);
+            }
+#endif
+            if (journal_ready())
+            {
+                journal_get_stats(&journal_stats);
+                ESP_LOGI(TAG, "Journal: %" PRIu32 " record(s) / %" PRIu32 " sample(s) pending, %" PRIu32 " dropped, %" PRIu32 " erases.",
+                         journal_stats.pending_records, journal_stats.pending_samples, journal_stats.dropped_records, journal_stats.erases);
+            }
+        }
     }
 }
 
-void send_data_to_server(void *pvParameter)
+#ifdef CONFIG_CAPTURE_MODE
+void capture_aht20(void *pvParameters)
 {
-    aht20_data recorded_data;
-    CborEncoder encoder;
-    CborEncoder map_encoder;
-    uint8_t cbor_buffer[MAX_CBOR_BUFFER_SIZE];
-    char ack_buffer[16];
-    size_t encoded_size;
+    size_t frame_count;
 
-    int socketfd;
-    struct sockaddr_in server_addr;
-    struct sockaddr_in local_addr;
-    struct timeval tv;
+    // Back to back: each round takes one conversion time, nothing is decoded
+    while (1)
+    {
+        if (sensor_set_capture(&frame_count) != ESP_OK)
+        {
+            vTaskDelay(1);
+        }
+    }
+}
+#endif
 
-    int udp_attempts;
-    bool udp_sent;
+// Decides whether the queued samples should go out now: a batch has filled
+// or the oldest sample hit its latency deadline.
+// The deadline is armed when samples first show up.
+static bool uplink_send_due(int64_t *deadline_us)
+{
+    uint32_t queued = sample_ring_count(&sample_ring);
+    int64_t now_us = esp_timer_get_time();
 
-    time_t now;
+    if (queued == 0)
+    {
+        *deadline_us = 0;
+        return false;
+    }
 
-    tv.tv_sec = UDP_TIMEOUT;
-    tv.tv_usec = 0;
+    if (*deadline_us == 0)
+    {
+        *deadline_us = now_us + CONFIG_UPLINK_MAX_LATENCY_MS * 1000LL;
+    }
 
-    // Create UDP socket
-    if ((socketfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    return queued >= CONFIG_UPLINK_BATCH_SAMPLES || now_us >= *deadline_us;
+}
+
+static void uplink_fill_batch(void)
+{
+    while (batch_count < CONFIG_UPLINK_MAX_BATCH_SAMPLES && sample_ring_pop(&sample_ring, &batch[batch_count]))
     {
-        ESP_LOGE(TAG, "Unable to establish socket connection.");
-        exit(EXIT_FAILURE);
+        batch_count++;
     }
+}
 
-    // Set socket timeout
-    setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, (const char *) &tv, sizeof(tv));
+static void uplink_consume_batch(size_t count)
+{
+    memmove(batch, &batch[count], (batch_count - count) * sizeof(batch[0]));
+    batch_count -= count;
+}
 
-    // Zero out structs
-    memset(&server_addr, 0, sizeof(server_addr));
-    memset(&local_addr, 0, sizeof(local_addr));
+static TickType_t uplink_wait_ticks(int64_t deadline_us)
+{
+    int64_t remaining_us;
 
-    // Configure server IP information
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(UDP_SERVER_IP);
-    server_addr.sin_port = htons(UDP_SERVER_PORT);
+    if (deadline_us == 0)
+    {
+        return portMAX_DELAY;
+    }
 
-    // Configure client (local) IP information
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_addr.s_addr = INADDR_ANY;
-    local_addr.sin_port = htons(9999);
+    remaining_us = deadline_us - esp_timer_get_time();
+    return remaining_us > 0 ? pdMS_TO_TICKS((remaining_us + 999) / 1000) + 1 : 0;
+}
 
-    bind(socketfd, (struct sockaddr *) &local_addr, sizeof(local_addr));
+// Sends every pending alarm sample, ahead of anything else and with its own
+// retry policy. Undelivered alarms stay at the front and are retried after
+// CONFIG_ALARM_RETRY_MS; they are never moved to the backlog.
+static void uplink_send_alarms(void)
+{
+    uint8_t *buf;
+    size_t buf_size;
+    size_t encoded_size;
+    size_t encoded_count;
+    int attempts;
+    bool sent;
 
-    while (1)
+    while (alarm_count < CONFIG_ALARM_LANE_LENGTH && sample_ring_pop(&alarm_lane, &alarm_batch[alarm_count]))
     {
-        if (xQueueReceive(msg_queue, (void *) &recorded_data, 0) == pdTRUE)
+        alarm_count++;
+    }
+
+    while (alarm_count > 0 && esp_timer_get_time() >= alarm_retry_at_us)
+    {
+        if ((buf = transport_buffer(&buf_size)) == NULL)
+        {
+            return;
+        }
+
+        if (UPLINK_ENCODE_BATCH(alarm_batch, alarm_count, time_sync_epoch_offset_us(), buf, buf_size,
+                                &encoded_size, &encoded_count) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to encode alarm from sensor %u.", alarm_batch[0].sensor_id);
+            encoded_count = 1;
+        }
+        else
         {
-            // Turn LED on
-            // led_strip_set_pixel_hsv(led_strip, 0, 300, 255, 20);
-            // led_strip_refresh(led_strip);
             status_led_on(&COLOR_INFO_READ_SENSOR);
-            vTaskDelay(100 / portTICK_PERIOD_MS);
+            sent = transport_send(encoded_size, encoded_count,
+                                  CONFIG_ALARM_MAX_ATTEMPTS, CONFIG_ALARM_ACK_TIMEOUT_MS, &attempts);
+            status_led_off();
+
+            alarm_note_round(alarm_batch, encoded_count, attempts, sent ? esp_timer_get_time() : 0);
+            if (!sent)
+            {
+                alarm_retry_at_us = esp_timer_get_time() + CONFIG_ALARM_RETRY_MS * 1000LL;
+                return;
+            }
+        }
+
+        memmove(alarm_batch, &alarm_batch[encoded_count], (alarm_count - encoded_count) * sizeof(alarm_batch[0]));
+        alarm_count -= encoded_count;
+    }
+}
+
+// Unsent samples go to PSRAM when there is a backlog there, else straight to
+// flash; the backlog spills its oldest chunks to flash when it fills up.
+// epoch_offset_us is what the samples were encoded with: 0 for samples that
+// came out of storage and already carry wall-clock time.
+static void uplink_store(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us)
+{
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+
+#ifdef CONFIG_BACKLOG_PSRAM
+    if (backlog_ready())
+    {
+        ret = backlog_append(samples, count, epoch_offset_us);
+    }
+    else
+#endif
+    if (journal_ready())
+    {
+        ret = journal_append(samples, count, epoch_offset_us);
+    }
+
+    if (ret == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Kept %u sample(s) for replay.", (unsigned) count);
+    }
+}
+
+static uint32_t uplink_stored(void)
+{
+#ifdef CONFIG_BACKLOG_PSRAM
+    return journal_pending() + backlog_pending();
+#else
+    return journal_pending();
+#endif
+}
+
+// Flash holds the oldest samples, so it is drained before PSRAM
+static esp_err_t uplink_stored_peek(size_t *count_out, bool *from_journal, uint32_t *id_out)
+{
+    *from_journal = journal_pending() > 0;
+    if (*from_journal)
+    {
+        return journal_peek(replay_batch, count_out, id_out);
+    }
+#ifdef CONFIG_BACKLOG_PSRAM
+    return backlog_peek(replay_batch, count_out, id_out);
+#else
+    return ESP_ERR_NOT_FOUND;
+#endif
+}
+
+static void uplink_stored_consume(bool from_journal, uint32_t id)
+{
+    if (from_journal)
+    {
+        journal_consume(id);
+        return;
+    }
+#ifdef CONFIG_BACKLOG_PSRAM
+    backlog_consume(id);
+#endif
+}
+
+#ifdef CONFIG_UPLINK_ARQ
+// Tag of live datagrams; replayed ones carry their index in replays[]
+#define UPLINK_LIVE     UINT32_MAX
+
+// A stored batch whose datagrams are in the window. It stays stored until
+// all of them are acknowledged, so a reset or a datagram given up on only
+// ever means sending it again.
+typedef struct
+{
+    bool used;
+    bool from_journal;
+    bool carved;                    // Every datagram was built
+    bool failed;                    // One was given up on: keep the batch
+    uint32_t id;
+    unsigned in_flight;
+} uplink_replay_t;
+
+// Every batch but the one being carved has a datagram in flight
+static uplink_replay_t replays[CONFIG_UPLINK_ARQ_WINDOW];
+static bool replay_from_journal;
+static uplink_replay_t *replay;             // Being carved into datagrams
+static size_t replay_count;                 // Samples of it in replay_batch
+static size_t replay_done;                  // Of those, already in datagrams
+
+// The batch after the last one taken out, moving on from flash to PSRAM.
+// With none in flight it starts over from the oldest, which picks up again
+// any batch left behind by a datagram that was given up on.
+static esp_err_t uplink_stored_peek_next(size_t *count_out, uplink_replay_t *entry)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+
+    for (int i = 0; i < CONFIG_UPLINK_ARQ_WINDOW; i++)
+    {
+        if (replays[i].used && &replays[i] != entry)
+        {
+            ret = ESP_OK;
+        }
+    }
+    if (ret != ESP_OK)
+    {
+        ret = uplink_stored_peek(count_out, &replay_from_journal, &entry->id);
+        entry->from_journal = replay_from_journal;
+        return ret;
+    }
+
+    if (replay_from_journal)
+    {
+        ret = journal_peek_next(replay_batch, count_out, &entry->id);
+        if (ret != ESP_ERR_NOT_FOUND)
+        {
+            entry->from_journal = true;
+            return ret;
+        }
+        replay_from_journal = false;
+#ifdef CONFIG_BACKLOG_PSRAM
+        ret = backlog_peek(replay_batch, count_out, &entry->id);
+#endif
+    }
+#ifdef CONFIG_BACKLOG_PSRAM
+    else
+    {
+        ret = backlog_peek_next(replay_batch, count_out, &entry->id);
+    }
+#endif
+
+    entry->from_journal = false;
+    return ret;
+}
+
+static void uplink_replay_retire(uplink_replay_t *entry)
+{
+    if (!entry->carved || entry->in_flight > 0)
+    {
+        return;
+    }
+
+    if (!entry->failed)
+    {
+        uplink_stored_consume(entry->from_journal, entry->id);
+    }
+    entry->used = false;
+}
+
+// Live samples the window gave up on are stored for replay; replayed ones
+// already are, and only their batch's bookkeeping changes
+static void uplink_on_done(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                           uint32_t tag, bool acked)
+{
+    if (tag == UPLINK_LIVE)
+    {
+        if (!acked)
+        {
+            uplink_store(samples, count, epoch_offset_us);
+        }
+        return;
+    }
 
-            // Clear buffer for CBOR object
-            memset(cbor_buffer, 0, sizeof(cbor_buffer));
-            memset(ack_buffer, 0, sizeof(ack_buffer));
+    replays[tag].in_flight--;
+    replays[tag].failed |= !acked;
+    uplink_replay_retire(&replays[tag]);
+}
 
-            // Get time for current recording
-            now = time(NULL);
+// Ends the carving of the current batch, early if it @p failed
+static void uplink_replay_carved(bool failed)
+{
+    replay->carved = true;
+    replay->failed |= failed;
+    uplink_replay_retire(replay);
+    replay = NULL;
+}
 
-            // Initialize CBOR encoders
-            cbor_encoder_init(&encoder, cbor_buffer, sizeof(cbor_buffer), 0);
-            cbor_encoder_create_map(&encoder, &map_encoder, 3);
+// Sends stored batches while fewer than CONFIG_UPLINK_ARQ_WINDOW datagrams
+// are in flight, leaving the spare slot to alarms. A batch that does not fit
+// is carved on into datagrams by the next call. Several batches can be in
+// flight at once; each is retired only once every datagram carved from it
+// is acknowledged, so a power cut or a give-up meanwhile resends it rather
+// than losing it.
+static bool uplink_replay(void)
+{
+    uint8_t *buf;
+    size_t buf_size;
+    size_t encoded_size;
+    size_t encoded_count;
+    uint32_t tag;
 
-            // Create map -- temp_c:float
-            cbor_encode_text_stringz(&map_encoder, "temp_c");
-            cbor_encode_float(&map_encoder, recorded_data.temperature_celsius);  
+    while (transport_link_up() && transport_in_flight() < CONFIG_UPLINK_ARQ_WINDOW)
+    {
+        if (replay == NULL)
+        {
+            for (tag = 0; replays[tag].used; tag++)
+            {
+            }
+            replay = &replays[tag];
+            *replay = (uplink_replay_t) { .used = true };
 
-            // Create map -- hmd:float
-            cbor_encode_text_stringz(&map_encoder, "hmd");
-            cbor_encode_float(&map_encoder, recorded_data.relative_humidity);
+            if (uplink_stored_peek_next(&replay_count, replay) != ESP_OK)
+            {
+                replay->used = false;
+                replay = NULL;
+                break;
+            }
 
-            // Create map -- time:uint64_t
-            cbor_encode_text_stringz(&map_encoder, "time");
-            cbor_encode_uint(&map_encoder, now);
+            ESP_LOGI(TAG, "Replaying %u stored sample(s), %" PRIu32 " batch(es) left.", (unsigned) replay_count, uplink_stored());
+            replay_done = 0;
+        }
 
-            // Close CBOR container
-            cbor_encoder_close_container(&encoder, &map_encoder);
+        if ((buf = transport_buffer(&buf_size)) == NULL)
+        {
+            uplink_replay_carved(true);
+            return false;
+        }
 
-            // Get buffer size
-            encoded_size = cbor_encoder_get_buffer_size(&encoder, cbor_buffer);
+        // Stored samples already carry wall-clock time
+        if (UPLINK_ENCODE_BATCH(&replay_batch[replay_done], replay_count - replay_done, 0, buf, buf_size,
+                                &encoded_size, &encoded_count) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to encode stored sample from sensor %u.", replay_batch[replay_done].sensor_id);
+            encoded_count = 1;
+        }
+        else
+        {
+            // Counted first: the MQTT backend may resolve it before returning
+            replay->in_flight++;
+            transport_submit(encoded_size, &replay_batch[replay_done], encoded_count, 0, (uint32_t) (replay - replays),
+                             UDP_MAX_ATTEMPTS, UPLINK_ACK_TIMEOUT_MS);
+        }
 
-            udp_attempts = 0;
-            udp_sent = false;
+        replay_done += encoded_count;
+        if (replay_done == replay_count)
+        {
+            uplink_replay_carved(false);
+        }
+    }
 
-            if (connect(socketfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) >= 0)
+    // The link went down while a batch was going out: it stays stored and
+    // goes out again in full
+    if (replay != NULL && !transport_link_up())
+    {
+        uplink_replay_carved(true);
+    }
+
+    return transport_link_up();
+}
+#else
+// Sends the oldest stored batch, split over as many datagrams as it takes.
+// The batch is only retired once every part was acknowledged, so a failure
+// part way through resends the earlier parts next time.
+static bool uplink_replay(void)
+{
+    uint8_t *buf;
+    size_t buf_size;
+    size_t count;
+    size_t encoded_size;
+    size_t encoded_count;
+    bool from_journal;
+    uint32_t id;
+
+    if (uplink_stored_peek(&count, &from_journal, &id) != ESP_OK)
+    {
+        return true;
+    }
+
+    ESP_LOGI(TAG, "Replaying %u stored sample(s), %" PRIu32 " batch(es) left.", (unsigned) count, uplink_stored());
+
+    for (size_t done = 0; done < count; done += encoded_count)
+    {
+        if ((buf = transport_buffer(&buf_size)) == NULL)
+        {
+            return false;
+        }
+
+        // Stored samples already carry wall-clock time
+        if (UPLINK_ENCODE_BATCH(&replay_batch[done], count - done, 0, buf, buf_size,
+                                &encoded_size, &encoded_count) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Unable to encode stored sample from sensor %u.", replay_batch[done].sensor_id);
+            encoded_count = 1;
+            continue;
+        }
+
+        if (!transport_send(encoded_size, encoded_count, UDP_MAX_ATTEMPTS, UPLINK_ACK_TIMEOUT_MS, NULL))
+        {
+            return false;
+        }
+    }
+
+    uplink_stored_consume(from_journal, id);
+    return true;
+}
+#endif
+
+void send_data_to_server(void *pvParameter)
+{
+    uint8_t *buf;
+    size_t buf_size;
+    size_t encoded_size;
+    size_t encoded_count;
+    int64_t epoch_offset_us;
+    esp_err_t ret;
+
+    bool link_up = true;
+    int64_t deadline_us = 0;
+    int64_t replay_at_us = 0;
+    int64_t report_at_us;
+    TickType_t wait_ticks;
+    TickType_t due_ticks;
+
+#ifdef CONFIG_UPLINK_ARQ
+    if (transport_open(uplink_on_done) != ESP_OK)
+#else
+    if (transport_open(NULL) != ESP_OK)
+#endif
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // The transport allocated its client, session or socket last: whatever
+    // the heap loses from here on is runtime churn, not setup
+    mem_budget_mark_steady();
+    report_at_us = esp_timer_get_time() + STATS_REPORT_SECONDS * 1000000LL;
+
+    while (1)
+    {
+        // Sleep until the sampling task reports something worth sending,
+        // until the oldest queued sample's latency deadline, until the next
+        // stored batch may be replayed, or until undelivered alarms are due
+        wait_ticks = uplink_wait_ticks(deadline_us);
+        if (alarm_count > 0)
+        {
+            due_ticks = uplink_wait_ticks(alarm_retry_at_us > 0 ? alarm_retry_at_us : 1);
+            if (due_ticks < wait_ticks)
+            {
+                wait_ticks = due_ticks;
+            }
+        }
+        if (link_up && uplink_stored() > 0)
+        {
+            // A zero deadline means "none" to uplink_wait_ticks(), not "now"
+            due_ticks = uplink_wait_ticks(replay_at_us > 0 ? replay_at_us : 1);
+            if (due_ticks < wait_ticks)
+            {
+                wait_ticks = due_ticks;
+            }
+        }
+#ifdef CONFIG_UPLINK_ARQ
+        // ...or until a datagram in the window is due for a resend
+        if (transport_in_flight() > 0)
+        {
+            due_ticks = uplink_wait_ticks(transport_next_deadline_us());
+#ifdef CONFIG_UPLINK_TRANSPORT_SOCKET
+            // Socket ACKs do not wake the sender, so they are polled for
+            if (due_ticks > pdMS_TO_TICKS(CONFIG_UPLINK_ARQ_ACK_POLL_MS) + 1)
+            {
+                due_ticks = pdMS_TO_TICKS(CONFIG_UPLINK_ARQ_ACK_POLL_MS) + 1;
+            }
+#endif
+            if (due_ticks < wait_ticks)
+            {
+                wait_ticks = due_ticks;
+            }
+        }
+#endif
+        // ...or until the transport's next report
+        due_ticks = uplink_wait_ticks(report_at_us);
+        if (due_ticks < wait_ticks)
+        {
+            wait_ticks = due_ticks;
+        }
+        ulTaskNotifyTakeIndexed(SAMPLE_RING_WAKE_NOTIFY_INDEX, pdTRUE, wait_ticks);
+
+        // The transport's state belongs to this task, so it reports from here
+        if (esp_timer_get_time() >= report_at_us)
+        {
+            transport_log_stats();
+            report_at_us = esp_timer_get_time() + STATS_REPORT_SECONDS * 1000000LL;
+        }
+
+#ifdef CONFIG_UPLINK_ARQ
+        transport_service(0);
+        link_up = transport_link_up();
+#endif
+
+        uplink_send_alarms();
+
+        // Samples left over when the window filled up are due already
+        if (uplink_send_due(&deadline_us) || batch_count > 0)
+        {
+            uplink_fill_batch();
+
+            while (batch_count > 0)
             {
-                while (!udp_sent && udp_attempts < UDP_MAX_ATTEMPTS)
+                // An alarm raised mid-drain does not wait for the rest of it
+                uplink_send_alarms();
+
+#ifdef CONFIG_UPLINK_ARQ
+                // The rest goes once the window slides; waiting for it in
+                // transport_buffer() would take the slot kept for alarms
+                if (transport_in_flight() >= CONFIG_UPLINK_ARQ_WINDOW)
                 {
-                    ESP_LOGI(TAG, "Sending message...");
-                    [[maybe_unused]] size_t bytes_sent = sendto(socketfd, cbor_buffer, encoded_size, 0, (struct sockaddr *) &server_addr, sizeof(server_addr));
-                    udp_attempts++;
+                    break;
+                }
+#endif
 
-                    ssize_t s_bytes_received = recvfrom(socketfd, ack_buffer, sizeof(cbor_buffer), 0, NULL, NULL);
-                    if (s_bytes_received > 0)
-                    {
-                        ack_buffer[s_bytes_received] = '\0';
-                        if (strcmp(ack_buffer, "ACK") == 0)
-                        {
-                            udp_sent = true;
-                            ESP_LOGI(TAG, "ACK received. Data sent successfully.");
-                        }
-                    }
-                    else
-                    {
-                        ESP_LOGI(TAG, "No ACK received. Resending data...");
-                    }
+                // Turn LED on
+                // led_strip_set_pixel_hsv(led_strip, 0, 300, 255, 20);
+                // led_strip_refresh(led_strip);
+                status_led_on(&COLOR_INFO_READ_SENSOR);
+
+                if ((buf = transport_buffer(&buf_size)) == NULL)
+                {
+                    ESP_LOGE(TAG, "No buffer for the next datagram.");
+                    status_led_off();
+                    break;
                 }
 
-                if (!udp_sent)
+                // Pack as many samples as fit in one datagram, each with the
+                // wall-clock time at which it was taken. Samples kept for
+                // replay are stamped with the same offset, so a resend
+                // carries the same timestamps.
+                epoch_offset_us = time_sync_epoch_offset_us();
+                ret = UPLINK_ENCODE_BATCH(batch, batch_count, epoch_offset_us, buf, buf_size,
+                                          &encoded_size, &encoded_count);
+                if (ret != ESP_OK)
                 {
-                    ESP_LOGI(TAG, "Failed to send data after %d attempts.", udp_attempts);
+                    ESP_LOGE(TAG, "Unable to encode sample from sensor %u.", batch[0].sensor_id);
+                    uplink_consume_batch(1);
+                    status_led_off();
+                    continue;
                 }
-            }
-            else
-            {
-                ESP_LOGI(TAG, "UDP connection failed.");
+
+#ifdef CONFIG_UPLINK_ARQ
+                // The window keeps the samples and returns them to
+                // uplink_store() if they are never acknowledged
+                transport_submit(encoded_size, batch, encoded_count, epoch_offset_us, UPLINK_LIVE,
+                                 UDP_MAX_ATTEMPTS, UPLINK_ACK_TIMEOUT_MS);
+                link_up = transport_link_up();
+#else
+                link_up = transport_send(encoded_size, encoded_count,
+                                         UDP_MAX_ATTEMPTS, UPLINK_ACK_TIMEOUT_MS, NULL);
+
+                // Keep what the collector did not acknowledge for later
+                if (!link_up)
+                {
+                    uplink_store(batch, encoded_count, epoch_offset_us);
+                }
+#endif
+
+                uplink_consume_batch(encoded_count);
+                uplink_fill_batch();
+
+                // Turn LED off
+                // led_strip_clear(led_strip);
+                status_led_off();
             }
 
-            // Turn LED off
-            // led_strip_clear(led_strip);
-            status_led_off();
+            deadline_us = 0;
         }
 
-        vTaskDelay((1000 * SEND_DATA_SECONDS) / portTICK_PERIOD_MS);
+        // Drain the backlog only while the collector answers, live samples
+        // are not piling up, and the replay interval has passed
+        if (link_up && uplink_stored() > 0 && esp_timer_get_time() >= replay_at_us &&
+            sample_ring_count(&sample_ring) < CONFIG_UPLINK_BATCH_SAMPLES)
+        {
+            status_led_on(&COLOR_INFO_READ_SENSOR);
+            link_up = uplink_replay();
+            replay_at_us = esp_timer_get_time() + CONFIG_JOURNAL_REPLAY_INTERVAL_MS * 1000LL;
+            status_led_off();
+        }
     }
-
-    close(socketfd);
 }
 
 void app_main(void)
@@ -188,12 +755,20 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
-    // Initialize queue
-    msg_queue = xQueueCreate(QUEUE_LENGTH, sizeof(aht20_data));
+    // Initialize sample ring
+    ESP_ERROR_CHECK(sample_ring_init(&sample_ring, sample_slots, CONFIG_SAMPLE_RING_LENGTH, SAMPLE_RING_POLICY,
+                                     pdMS_TO_TICKS(CONFIG_SAMPLE_RING_BLOCK_TIMEOUT_MS)));
+    ESP_ERROR_CHECK(sample_ring_init(&alarm_lane, alarm_slots, CONFIG_ALARM_LANE_LENGTH, SAMPLE_RING_OVERWRITE_OLDEST, 0));
 
     // Initialize services
     configure_led();
-    aht20_i2c_setup();
+    ESP_ERROR_CHECK(sensor_set_init());
+#ifdef CONFIG_AHT20_HEAP_TRACE_SELFTEST
+    sensor_set_heap_selftest(CONFIG_AHT20_HEAP_TRACE_SELFTEST_BATCHES);
+#endif
+#ifdef CONFIG_PAYLOAD_BENCHMARK
+    payload_benchmark(CONFIG_PAYLOAD_BENCHMARK_ITERATIONS);
+#endif
     ESP_ERROR_CHECK(wifi_manager_start());
     ESP_ERROR_CHECK(esp_netif_init());
 
@@ -203,26 +778,36 @@ void app_main(void)
     // Set date and time
     sync_time();
 
-    xTaskCreatePinnedToCore(read_aht20, 
-                            "read_aht20", 
-                            5000, 
-                            NULL, 
-                            1, 
-                            NULL, 
-                            CORE_0
-                        );
-
-    xTaskCreatePinnedToCore(send_data_to_server, 
-                            "send_data_to_server", 
-                            5000, 
-                            NULL, 
-                            1, 
-                            NULL,
-                            CORE_1
-                        );
+#ifdef CONFIG_CAPTURE_MODE
+    ESP_ERROR_CHECK(capture_init());
+
+    ESP_ERROR_CHECK(mem_task_start(&capture_task, capture_aht20, 1, CORE_0));
+    ESP_ERROR_CHECK(mem_task_start(&capture_upload, capture_upload_task, 1, CORE_1));
+#else
+    // Samples the collector does not acknowledge are kept here and replayed
+    if (journal_init() != ESP_OK)
+    {
+        ESP_LOGW(TAG, "No store-and-forward journal. Unsent samples will be dropped.");
+    }
+#ifdef CONFIG_BACKLOG_PSRAM
+    if (backlog_init() != ESP_OK)
+    {
+        ESP_LOGW(TAG, "No PSRAM backlog. Unsent samples go straight to the journal.");
+    }
+#endif
+
+    // The sender goes first so the sampling task can wake it from its first push
+    ESP_ERROR_CHECK(mem_task_start(&sender_task, send_data_to_server, 1, CORE_1));
+    sample_ring_set_consumer(&sample_ring, sender_task.handle, CONFIG_UPLINK_BATCH_SAMPLES);
+    sample_ring_set_consumer(&alarm_lane, sender_task.handle, 1);
+
+    ESP_ERROR_CHECK(mem_task_start(&read_task, read_aht20, 1, CORE_0));
+#endif
 
+    // Runs in every mode, capture included, so stacks are always measured
     while (1) 
     {
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        vTaskDelay(pdMS_TO_TICKS(STATS_REPORT_SECONDS * 1000));
+        mem_budget_log();
     }
 }
@@ -0,0 +1,334 @@
+#include <inttypes.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "backlog.h"
+#include "journal.h"
+#include "payload.h"
+#include "sample_codec.h"
+
+const static char *TAG = "BACKLOG";
+
+#define BACKLOG_CHUNK_MAX       SAMPLE_CODEC_MAX_SIZE(CONFIG_UPLINK_MAX_BATCH_SAMPLES)
+#define BACKLOG_WRAP            0       // Length marking the end of the data before a wrap
+
+typedef struct {
+    uint16_t len;                   // Encoded bytes after this prefix
+    uint16_t samples;
+    uint8_t  consumed;              // Sent, waiting for the chunks before it to go too
+} backlog_prefix_t;
+
+#define BACKLOG_PREFIX_SIZE     sizeof(backlog_prefix_t)
+
+_Static_assert(BACKLOG_CHUNK_MAX <= UINT16_MAX, "Chunk lengths are 16-bit");
+
+#ifdef CONFIG_STATIC_MEMORY
+static EXT_RAM_BSS_ATTR uint8_t storage_bss[CONFIG_BACKLOG_PSRAM_KB * 1024];
+#endif
+
+static uint8_t *storage;            // PSRAM
+static uint32_t capacity;
+static uint32_t head;               // Next write offset
+static uint32_t tail;               // Oldest chunk
+static uint32_t tail_id;            // Chunks are numbered in append order
+static uint32_t cursor;             // Where backlog_peek_next() carries on
+static uint32_t cursor_id;
+static uint32_t held;               // Consumed chunks not released yet
+static backlog_stats_t stats;
+
+// Internal RAM scratch, so encoding never reads back from PSRAM
+static uint8_t chunk[BACKLOG_CHUNK_MAX];
+static sample_codec_row_t rows[CONFIG_UPLINK_MAX_BATCH_SAMPLES];
+static sensor_sample_t spill[CONFIG_UPLINK_MAX_BATCH_SAMPLES];
+
+esp_err_t backlog_init(void)
+{
+    capacity = CONFIG_BACKLOG_PSRAM_KB * 1024;
+#ifdef CONFIG_STATIC_MEMORY
+    storage = storage_bss;
+#else
+    storage = heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#endif
+    ESP_RETURN_ON_FALSE(storage != NULL, ESP_ERR_NO_MEM, TAG, "Unable to allocate %" PRIu32 " KB of PSRAM", capacity / 1024);
+
+    head = 0;
+    tail = 0;
+    tail_id = 0;
+    cursor = 0;
+    cursor_id = 0;
+    held = 0;
+    stats = (backlog_stats_t) {
+        .capacity_bytes = capacity,
+    };
+
+    ESP_LOGI(TAG, "%" PRIu32 " KB PSRAM backlog", capacity / 1024);
+    return ESP_OK;
+}
+
+bool backlog_ready(void)
+{
+    return storage != NULL;
+}
+
+static backlog_prefix_t backlog_read_prefix(uint32_t offset)
+{
+    backlog_prefix_t prefix;
+
+    memcpy(&prefix, &storage[offset], sizeof(prefix));
+    return prefix;
+}
+
+// Where the chunk at @p offset really starts: the start of the buffer if a
+// wrap marker, or too little room for one, is there instead
+static uint32_t backlog_chunk_at(uint32_t offset)
+{
+    if (capacity - offset < BACKLOG_PREFIX_SIZE || backlog_read_prefix(offset).len == BACKLOG_WRAP) {
+        return 0;
+    }
+    return offset;
+}
+
+// Finds the oldest chunk, following a wrap marker if there is one
+static backlog_prefix_t backlog_tail_prefix(void)
+{
+    if (backlog_chunk_at(tail) != tail) {
+        stats.used_bytes -= capacity - tail;
+        tail = 0;
+    }
+    return backlog_read_prefix(tail);
+}
+
+static void backlog_release_tail(backlog_prefix_t prefix)
+{
+    tail += BACKLOG_PREFIX_SIZE + prefix.len;
+    tail_id++;
+    stats.used_bytes -= BACKLOG_PREFIX_SIZE + prefix.len;
+    stats.chunks--;
+    stats.samples -= prefix.samples;
+    if (prefix.consumed) {
+        held--;
+    }
+
+    if (stats.chunks == 0) {
+        head = 0;
+        tail = 0;
+        stats.used_bytes = 0;
+    }
+
+    // The cursor never falls behind the tail
+    if ((int32_t) (cursor_id - tail_id) <= 0) {
+        cursor = tail;
+        cursor_id = tail_id;
+    }
+}
+
+// Releases consumed chunks from the tail, up to the first one still pending
+static void backlog_release_consumed(void)
+{
+    backlog_prefix_t prefix;
+
+    while (stats.chunks > 0 && (prefix = backlog_tail_prefix()).consumed) {
+        backlog_release_tail(prefix);
+    }
+}
+
+static esp_err_t backlog_decode(uint32_t offset, backlog_prefix_t prefix, sensor_sample_t *samples, size_t *count_out)
+{
+    sample_codec_params_t params;
+
+    if (prefix.len > BACKLOG_CHUNK_MAX || offset + BACKLOG_PREFIX_SIZE + prefix.len > capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Decoded straight from PSRAM: an append may be spilling while its own
+    // chunk is still waiting in the scratch buffer
+    if (sample_codec_decode(&storage[offset + BACKLOG_PREFIX_SIZE], prefix.len, &params, rows, CONFIG_UPLINK_MAX_BATCH_SAMPLES, count_out) != SAMPLE_CODEC_OK) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    payload_columnar_samples(&params, rows, *count_out, samples);
+    return ESP_OK;
+}
+
+static void backlog_mark_consumed(uint32_t offset)
+{
+    backlog_prefix_t prefix = backlog_read_prefix(offset);
+
+    if (!prefix.consumed) {
+        prefix.consumed = 1;
+        memcpy(&storage[offset], &prefix, sizeof(prefix));
+        held++;
+    }
+}
+
+// Moves the oldest chunk to the flash journal, or drops it without one
+static void backlog_spill_oldest(void)
+{
+    backlog_prefix_t prefix = backlog_tail_prefix();
+    size_t count;
+
+    if (backlog_decode(tail, prefix, spill, &count) == ESP_OK && journal_ready() &&
+        journal_append(spill, count, 0) == ESP_OK) {
+        stats.spilled_samples += prefix.samples;
+    } else {
+        stats.dropped_samples += prefix.samples;
+    }
+
+    backlog_release_tail(prefix);
+    backlog_release_consumed();
+}
+
+// Reserves room for a chunk, returning its offset, or -1 if the ring is full
+static int32_t backlog_reserve(uint32_t need)
+{
+    bool wrapped = stats.chunks > 0 && head <= tail;
+
+    if (wrapped) {
+        return tail - head >= need ? (int32_t) head : -1;
+    }
+
+    if (capacity - head >= need) {
+        return head;
+    }
+
+    if (tail >= need) {
+        // Mark the end so the reader skips to the start
+        if (capacity - head >= BACKLOG_PREFIX_SIZE) {
+            memset(&storage[head], 0, BACKLOG_PREFIX_SIZE);
+        }
+        stats.used_bytes += capacity - head;
+        head = 0;
+        return 0;
+    }
+
+    return -1;
+}
+
+esp_err_t backlog_append(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us)
+{
+    sample_codec_params_t params;
+    backlog_prefix_t prefix;
+    size_t n;
+    size_t len;
+    int32_t offset;
+
+    ESP_RETURN_ON_FALSE(storage != NULL, ESP_ERR_INVALID_STATE, TAG, "Backlog disabled");
+    ESP_RETURN_ON_FALSE(count > 0 && count <= CONFIG_UPLINK_MAX_BATCH_SAMPLES, ESP_ERR_INVALID_ARG, TAG, "Bad chunk size");
+
+    // Samples that switch value format part way start a new chunk
+    for (size_t done = 0; done < count; done += n) {
+        n = payload_columnar_rows(&samples[done], count - done, epoch_offset_us, &params, rows);
+        if (sample_codec_encode(&params, rows, n, chunk, sizeof(chunk), &len) != SAMPLE_CODEC_OK) {
+            stats.dropped_samples += n;
+            continue;
+        }
+
+        while ((offset = backlog_reserve(BACKLOG_PREFIX_SIZE + len)) < 0 && stats.chunks > 0) {
+            backlog_spill_oldest();
+        }
+        if (offset < 0) {
+            stats.dropped_samples += n;
+            continue;
+        }
+
+        prefix = (backlog_prefix_t) {
+            .len = len,
+            .samples = n,
+        };
+        memcpy(&storage[offset], &prefix, sizeof(prefix));
+        memcpy(&storage[offset + BACKLOG_PREFIX_SIZE], chunk, len);
+        head = offset + BACKLOG_PREFIX_SIZE + len;
+
+        stats.used_bytes += BACKLOG_PREFIX_SIZE + len;
+        stats.chunks++;
+        stats.samples += n;
+        if (stats.used_bytes > stats.high_water_bytes) {
+            stats.high_water_bytes = stats.used_bytes;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t backlog_peek(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out)
+{
+    backlog_prefix_t prefix;
+
+    while (storage != NULL && stats.chunks > 0) {
+        prefix = backlog_tail_prefix();
+        if (backlog_decode(tail, prefix, samples, count_out) == ESP_OK) {
+            *id_out = tail_id;
+            cursor = tail + BACKLOG_PREFIX_SIZE + prefix.len;
+            cursor_id = tail_id + 1;
+            return ESP_OK;
+        }
+        ESP_LOGW(TAG, "Undecodable chunk, dropping %u sample(s)", prefix.samples);
+        stats.dropped_samples += prefix.samples;
+        backlog_release_tail(prefix);
+        backlog_release_consumed();
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t backlog_peek_next(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out)
+{
+    backlog_prefix_t prefix;
+    uint32_t offset;
+
+    while (storage != NULL && cursor_id - tail_id < stats.chunks) {
+        offset = backlog_chunk_at(cursor);
+        prefix = backlog_read_prefix(offset);
+        cursor = offset + BACKLOG_PREFIX_SIZE + prefix.len;
+        cursor_id++;
+
+        if (prefix.consumed) {
+            continue;
+        }
+        if (backlog_decode(offset, prefix, samples, count_out) == ESP_OK) {
+            *id_out = cursor_id - 1;
+            return ESP_OK;
+        }
+
+        // Released once it reaches the tail
+        ESP_LOGW(TAG, "Undecodable chunk, dropping %u sample(s)", prefix.samples);
+        stats.dropped_samples += prefix.samples;
+        backlog_mark_consumed(offset);
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+void backlog_consume(uint32_t id)
+{
+    backlog_prefix_t prefix;
+    uint32_t offset;
+
+    // Chunks before the tail were spilled or dropped meanwhile
+    if (storage == NULL || id - tail_id >= stats.chunks) {
+        return;
+    }
+
+    prefix = backlog_tail_prefix();
+    offset = tail;
+    for (uint32_t i = tail_id; i != id; i++) {
+        offset = backlog_chunk_at(offset + BACKLOG_PREFIX_SIZE + prefix.len);
+        prefix = backlog_read_prefix(offset);
+    }
+
+    backlog_mark_consumed(offset);
+    backlog_release_consumed();
+}
+
+uint32_t backlog_pending(void)
+{
+    return stats.chunks - held;
+}
+
+void backlog_get_stats(backlog_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
@@ -0,0 +1,105 @@
+// backlog.h
+#ifndef BACKLOG_H
+#define BACKLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sensor_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t capacity_bytes;
+    uint32_t used_bytes;            // Including the unused end of the buffer after a wrap
+    uint32_t high_water_bytes;
+    uint32_t chunks;
+    uint32_t samples;
+    uint32_t spilled_samples;       // Moved to the flash journal because PSRAM was full
+    uint32_t dropped_samples;       // Lost because neither tier had room
+} backlog_stats_t;
+
+/**
+ * PSRAM tier for samples the collector did not acknowledge, in front of the
+ * flash journal.
+ *
+ * Each batch is stored as a columnar chunk (see sample_codec.h) behind a
+ * length and sample count, back to back in one large PSRAM buffer used as a
+ * ring.
+ * The read and write offsets and all counters stay in internal RAM, and
+ * appends only write to PSRAM sequentially, so an append never waits on a
+ * PSRAM read. When the buffer is full the oldest chunks are moved to the
+ * journal, which keeps replay order: journal first, then PSRAM.
+ *
+ * Samples come back with one record per channel and wall-clock acquired_us.
+ * Not thread-safe: only the sender task uses it.
+ */
+
+/**
+ * @brief Allocates the PSRAM buffer, CONFIG_BACKLOG_PSRAM_KB in size.
+ *
+ * @return ESP_OK, or ESP_ERR_NO_MEM if PSRAM is missing or too small.
+ */
+esp_err_t backlog_init(void);
+
+/**
+ * @brief Returns true if backlog_init() succeeded.
+ */
+bool backlog_ready(void);
+
+/**
+ * @brief Stores samples, moving the oldest chunks to the journal if needed.
+ *
+ * @param epoch_offset_us Added to acquired_us, as for journal_append().
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if @p count is 0 or over
+ *         CONFIG_UPLINK_MAX_BATCH_SAMPLES, or ESP_ERR_INVALID_STATE if the
+ *         backlog is disabled.
+ */
+esp_err_t backlog_append(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us);
+
+/**
+ * @brief Decodes the oldest chunk. Calling it again without
+ * backlog_consume() returns the same chunk.
+ *
+ * @param samples Receives up to CONFIG_UPLINK_MAX_BATCH_SAMPLES samples.
+ * @param id_out Receives the chunk's ID, for backlog_consume().
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if the backlog is empty.
+ */
+esp_err_t backlog_peek(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out);
+
+/**
+ * @brief Decodes the pending chunk after the one the last backlog_peek() or
+ * backlog_peek_next() returned, so several chunks can be in flight before
+ * any is consumed. Chunks appended meanwhile are found too.
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if there is no later chunk.
+ */
+esp_err_t backlog_peek_next(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out);
+
+/**
+ * @brief Drops a chunk, in any order. A chunk consumed ahead of older ones
+ * keeps its space until they go too. IDs of chunks already spilled to the
+ * journal are ignored: their samples are replayed from there.
+ */
+void backlog_consume(uint32_t id);
+
+/**
+ * @brief Returns the number of chunks waiting to be replayed, consumed ones
+ * excluded.
+ */
+uint32_t backlog_pending(void);
+
+/**
+ * @brief Copies the occupancy counters. Meant for periodic reports from any
+ * task; the copy is not a consistent snapshot across fields.
+ */
+void backlog_get_stats(backlog_stats_t *stats_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BACKLOG_H
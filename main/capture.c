@@ -0,0 +1,194 @@
+#include <socket.h>
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "config.h"
+#include "capture.h"
+#include "mem_budget.h"
+
+const static char *TAG = "CAPTURE";
+
+// Static builds link the ring into PSRAM when .bss may live there, and
+// settle for the internal size otherwise
+#if defined(CONFIG_STATIC_MEMORY) && defined(CONFIG_SPIRAM_ALLOW_BSS_SEG_EXTERNAL_MEMORY)
+static EXT_RAM_BSS_ATTR capture_record_t ring_bss[CONFIG_CAPTURE_BUFFER_KB * 1024 / sizeof(capture_record_t)];
+#elif defined(CONFIG_STATIC_MEMORY)
+static capture_record_t ring_bss[CONFIG_CAPTURE_BUFFER_INTERNAL_KB * 1024 / sizeof(capture_record_t)];
+#endif
+
+static capture_record_t *ring;
+static size_t ring_capacity;
+static size_t ring_head;            // Next slot to write
+static size_t ring_tail;            // Next slot to upload
+static size_t ring_count;
+static uint32_t dropped;
+static uint32_t chunk_seq;
+static int64_t start_us;
+static int64_t start_epoch_us;
+static portMUX_TYPE ring_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t chunk_buf[CONFIG_CAPTURE_CHUNK_BYTES];
+
+esp_err_t capture_init(void)
+{
+    size_t size = CONFIG_CAPTURE_BUFFER_KB * 1024;
+    struct timeval tv;
+
+#ifdef CONFIG_STATIC_MEMORY
+    ring = ring_bss;
+    size = sizeof(ring_bss);
+#else
+    ring = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!ring) {
+        size = CONFIG_CAPTURE_BUFFER_INTERNAL_KB * 1024;
+        ring = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+#endif
+    ESP_RETURN_ON_FALSE(ring, ESP_ERR_NO_MEM, TAG, "Unable to allocate capture ring");
+
+    ring_capacity = size / sizeof(capture_record_t);
+    ring_head = 0;
+    ring_tail = 0;
+    ring_count = 0;
+    dropped = 0;
+    chunk_seq = 0;
+
+    gettimeofday(&tv, NULL);
+    start_us = esp_timer_get_time();
+    start_epoch_us = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+    ESP_LOGI(TAG, "Capture ring: %u records (%u KB, %s)", (unsigned) ring_capacity, (unsigned) (size / 1024),
+             esp_ptr_external_ram(ring) ? "PSRAM" : "internal RAM");
+    return ESP_OK;
+}
+
+esp_err_t capture_append(uint8_t sensor_id, int64_t acquired_us, const uint8_t *frame, size_t len)
+{
+    capture_record_t *record;
+
+    taskENTER_CRITICAL(&ring_lock);
+    if (ring_count == ring_capacity) {
+        dropped++;
+        taskEXIT_CRITICAL(&ring_lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    record = &ring[ring_head];
+    record->offset_us = (uint32_t) (acquired_us - start_us);
+    record->sensor_id = sensor_id;
+    memset(record->frame, 0, CAPTURE_FRAME_LEN);
+    memcpy(record->frame, frame, len < CAPTURE_FRAME_LEN ? len : CAPTURE_FRAME_LEN);
+
+    ring_head = (ring_head + 1) % ring_capacity;
+    ring_count++;
+    taskEXIT_CRITICAL(&ring_lock);
+
+    return ESP_OK;
+}
+
+size_t capture_pending(void)
+{
+    size_t count;
+
+    taskENTER_CRITICAL(&ring_lock);
+    count = ring_count;
+    taskEXIT_CRITICAL(&ring_lock);
+
+    return count;
+}
+
+esp_err_t capture_read_chunk(uint8_t *buf, size_t buf_size, size_t *len_out)
+{
+    capture_chunk_header_t header;
+    size_t max_records;
+    size_t count;
+    size_t first;
+
+    ESP_RETURN_ON_FALSE(buf_size >= sizeof(header) + sizeof(capture_record_t), ESP_ERR_INVALID_SIZE, TAG, "Chunk buffer too small");
+    max_records = (buf_size - sizeof(header)) / sizeof(capture_record_t);
+    if (max_records > UINT16_MAX) {
+        max_records = UINT16_MAX;
+    }
+
+    // Copy out under the lock; with the writer on the other core the ring
+    // must not move underneath the memcpy
+    taskENTER_CRITICAL(&ring_lock);
+    count = ring_count < max_records ? ring_count : max_records;
+    if (count == 0) {
+        taskEXIT_CRITICAL(&ring_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    first = ring_capacity - ring_tail;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(buf + sizeof(header), &ring[ring_tail], first * sizeof(capture_record_t));
+    memcpy(buf + sizeof(header) + first * sizeof(capture_record_t), ring, (count - first) * sizeof(capture_record_t));
+
+    ring_tail = (ring_tail + count) % ring_capacity;
+    ring_count -= count;
+    header.dropped = dropped;
+    taskEXIT_CRITICAL(&ring_lock);
+
+    header.magic = CAPTURE_MAGIC;
+    header.seq = chunk_seq++;
+    header.start_epoch_us = start_epoch_us;
+    header.record_count = count;
+    header.record_len = sizeof(capture_record_t);
+    header.frame_len = CAPTURE_FRAME_LEN;
+    memcpy(buf, &header, sizeof(header));
+
+    *len_out = sizeof(header) + count * sizeof(capture_record_t);
+    return ESP_OK;
+}
+
+void capture_upload_task(void *pvParameters)
+{
+    const size_t chunk_records = (sizeof(chunk_buf) - sizeof(capture_chunk_header_t)) / sizeof(capture_record_t);
+    struct sockaddr_in server_addr;
+    int64_t last_flush_us = esp_timer_get_time();
+    size_t len;
+    int socketfd;
+
+    if ((socketfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        ESP_LOGE(TAG, "Unable to create capture socket.");
+        vTaskDelete(NULL);
+        return;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(UDP_SERVER_IP);
+    server_addr.sin_port = htons(CONFIG_CAPTURE_UDP_PORT);
+
+    // Nothing is allocated after the socket
+    mem_budget_mark_steady();
+
+    while (1) {
+        // Only ship partial chunks once the flush interval has passed
+        if (capture_pending() < chunk_records &&
+                esp_timer_get_time() - last_flush_us < CONFIG_CAPTURE_FLUSH_MS * 1000) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        while (capture_read_chunk(chunk_buf, sizeof(chunk_buf), &len) == ESP_OK) {
+            if (sendto(socketfd, chunk_buf, len, 0, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+                ESP_LOGW(TAG, "Unable to send capture chunk (errno %d)", errno);
+            }
+
+            if (capture_pending() < chunk_records) {
+                break;
+            }
+        }
+        last_flush_us = esp_timer_get_time();
+    }
+}
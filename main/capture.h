@@ -0,0 +1,87 @@
+// capture.h
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Raw-frame capture for characterization runs. Sensors are sampled as fast as
+ * they convert, each validated frame is stored undecoded with a compact
+ * timestamp, and the ring is shipped to the host in large UDP chunks.
+ * tools/capture_decode.py turns the chunks back into a timestamped series.
+ *
+ * Wire format (little-endian): a capture_chunk_header_t followed by
+ * record_count capture_record_t, each record_len bytes long.
+ */
+
+#define CAPTURE_MAGIC       0x31434841  // "AHC1"
+#define CAPTURE_FRAME_LEN   6
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t seq;               // Chunk number, lets the host spot lost datagrams
+    int64_t  start_epoch_us;    // Wall-clock time at capture start
+    uint32_t dropped;           // Records lost to a full ring since capture start
+    uint16_t record_count;
+    uint8_t  record_len;
+    uint8_t  frame_len;
+} capture_chunk_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t offset_us;         // Since capture start; wraps after ~71 minutes
+    uint8_t  sensor_id;
+    uint8_t  frame[CAPTURE_FRAME_LEN];
+} capture_record_t;
+
+/**
+ * @brief Allocates the capture ring and marks the start of the capture.
+ *
+ * The ring is CONFIG_CAPTURE_BUFFER_KB, taken from PSRAM when the board has
+ * it. Otherwise it falls back to CONFIG_CAPTURE_BUFFER_INTERNAL_KB of
+ * internal RAM.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if neither allocation succeeded.
+ */
+esp_err_t capture_init(void);
+
+/**
+ * @brief Stores one frame. Safe to call while the upload task drains the ring.
+ *
+ * @param sensor_id Sensor the frame came from.
+ * @param acquired_us esp_timer time at which the frame was read.
+ * @param frame Frame bytes; anything past CAPTURE_FRAME_LEN is ignored.
+ * @return ESP_OK, or ESP_ERR_NO_MEM if the ring is full and the frame was dropped.
+ */
+esp_err_t capture_append(uint8_t sensor_id, int64_t acquired_us, const uint8_t *frame, size_t len);
+
+/**
+ * @brief Returns the number of records waiting to be uploaded.
+ */
+size_t capture_pending(void);
+
+/**
+ * @brief Moves as many records as fit in @p buf out of the ring, behind a
+ * chunk header.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if the ring is empty, or
+ *         ESP_ERR_INVALID_SIZE if @p buf cannot hold a header and one record.
+ */
+esp_err_t capture_read_chunk(uint8_t *buf, size_t buf_size, size_t *len_out);
+
+/**
+ * @brief Task that streams full chunks to UDP_SERVER_IP:CONFIG_CAPTURE_UDP_PORT,
+ * flushing partial ones every CONFIG_CAPTURE_FLUSH_MS.
+ */
+void capture_upload_task(void *pvParameters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CAPTURE_H
@@ -9,9 +9,10 @@
 #define SNTP_SERVER             "your_sntp_server"
 #define UDP_SERVER_IP           "your_server_ip_address"
 #define UDP_SERVER_PORT         0
+#define MQTT_BROKER_URI         "mqtt://your_broker:1883"
+#define DTLS_PSK_HEX            "your_pre_shared_key_in_hex"
 #define TIMEZONE                "your_timezone_string"
 #define READ_SENSOR_SECONDS     0
-#define SEND_DATA_SECONDS       0
 #define MAX_CBOR_BUFFER_SIZE    0
 
 #endif
\ No newline at end of file
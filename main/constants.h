@@ -7,10 +7,11 @@
 
 extern const uint8_t     CORE_0;
 extern const uint8_t     CORE_1;
-extern const uint8_t     QUEUE_LENGTH;
 extern const uint8_t     TASK_PRIORITY;
 extern const uint8_t     UDP_MAX_ATTEMPTS;
 extern const uint8_t     UDP_TIMEOUT;
+extern const uint16_t    JITTER_REPORT_PERIODS;
+extern const uint16_t    STATS_REPORT_SECONDS;
 extern const uint8_t     WIFI_MAX_RETRY;
 extern const uint32_t    WIFI_CONNECTED_BIT;
 extern const uint32_t    WIFI_FAIL_BIT;
@@ -0,0 +1,378 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <socket.h>
+#include "esp_check.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "mbedtls/ssl.h"
+#include "sdkconfig.h"
+#include "config.h"
+#include "dtls_session.h"
+
+const static char *TAG = "DTLS";
+
+#define DTLS_SESSION_PSK_MAX            32
+#define DTLS_SESSION_HANDSHAKE_MIN_MS   500
+
+// What mbedtls' timer callbacks arm: a retransmission and a give-up time
+typedef struct {
+    int64_t intermediate_us;
+    int64_t final_us;               // 0: cancelled
+} dtls_session_timer_t;
+
+static const int ciphersuites[] = {
+#ifdef CONFIG_UPLINK_DTLS_AES_128_CCM_8
+    MBEDTLS_TLS_PSK_WITH_AES_128_CCM_8,
+#else
+    MBEDTLS_TLS_PSK_WITH_AES_128_GCM_SHA256,
+#endif
+    0,
+};
+
+static int socket_fd = -1;
+static mbedtls_ssl_config conf;
+static mbedtls_ssl_context ssl;
+static mbedtls_ssl_session saved;   // Offered back on the next handshake
+static bool saved_valid;
+static bool established;
+static int64_t last_rx_us;          // Last authenticated record, or the handshake
+static int64_t handshake_at_us;     // End of the last attempt, 0 before the first
+static dtls_session_timer_t timer;
+static uint32_t read_timeout_ms;    // For records once the handshake is over
+static uint32_t socket_timeout_ms = UINT32_MAX;
+static uint32_t io_cycles;          // Spent in socket calls since the last reset
+static bool send_failed;
+static uint8_t psk[DTLS_SESSION_PSK_MAX];
+static size_t psk_len;
+static char identity[24];
+static dtls_session_stats_t stats;
+
+// The hardware RNG is a true RNG while the radio is on
+static int dtls_session_random(void *ctx, unsigned char *out, size_t len)
+{
+    esp_fill_random(out, len);
+    return 0;
+}
+
+static void dtls_session_set_timer(void *ctx, uint32_t intermediate_ms, uint32_t final_ms)
+{
+    dtls_session_timer_t *t = ctx;
+    int64_t now = esp_timer_get_time();
+
+    t->intermediate_us = now + intermediate_ms * 1000LL;
+    t->final_us = final_ms == 0 ? 0 : now + final_ms * 1000LL;
+}
+
+static int dtls_session_get_timer(void *ctx)
+{
+    dtls_session_timer_t *t = ctx;
+    int64_t now;
+
+    if (t->final_us == 0) {
+        return -1;
+    }
+
+    now = esp_timer_get_time();
+    if (now >= t->final_us) {
+        return 2;
+    }
+    return now >= t->intermediate_us ? 1 : 0;
+}
+
+// A datagram the stack refuses counts as sent and lost: reporting the error
+// would leave the record pending in mbedtls, to go out ahead of the next one
+static int dtls_session_bio_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    uint32_t start = esp_cpu_get_cycle_count();
+
+    if (send(socket_fd, buf, len, 0) < 0) {
+        ESP_LOGD(TAG, "send() failed: errno %d", errno);
+        send_failed = true;
+    }
+
+    io_cycles += esp_cpu_get_cycle_count() - start;
+    return (int) len;
+}
+
+static int dtls_session_bio_recv(void *ctx, unsigned char *buf, size_t len, uint32_t timeout_ms)
+{
+    struct timeval tv = { 0 };
+    uint32_t start = esp_cpu_get_cycle_count();
+    ssize_t received;
+
+    // mbedtls passes its retransmission timer during the handshake
+    if (mbedtls_ssl_is_handshake_over(&ssl)) {
+        timeout_ms = read_timeout_ms;
+    }
+
+    // A zero SO_RCVTIMEO would block forever
+    if (timeout_ms == 0) {
+        received = recv(socket_fd, buf, len, MSG_DONTWAIT);
+    } else {
+        if (timeout_ms != socket_timeout_ms) {
+            if (timeout_ms != UINT32_MAX) {
+                tv.tv_sec = timeout_ms / 1000;
+                tv.tv_usec = (timeout_ms % 1000) * 1000;
+            }
+            setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char *) &tv, sizeof(tv));
+            socket_timeout_ms = timeout_ms;
+        }
+        received = recv(socket_fd, buf, len, 0);
+    }
+
+    io_cycles += esp_cpu_get_cycle_count() - start;
+    if (received >= 0) {
+        return (int) received;
+    }
+
+    // Other errors, such as a reported ICMP unreachable, are retried: only
+    // mbedtls' timer decides when the collector stayed silent too long
+    if (timeout_ms != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return MBEDTLS_ERR_SSL_TIMEOUT;
+    }
+    return MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+static int dtls_session_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool dtls_session_parse_psk(const char *hex)
+{
+    size_t digits = strlen(hex);
+    int high;
+    int low;
+
+    if (digits == 0 || digits % 2 != 0 || digits / 2 > sizeof(psk)) {
+        return false;
+    }
+
+    for (psk_len = 0; psk_len < digits / 2; psk_len++) {
+        high = dtls_session_hex_digit(hex[2 * psk_len]);
+        low = dtls_session_hex_digit(hex[2 * psk_len + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        psk[psk_len] = (uint8_t) (high << 4 | low);
+    }
+    return true;
+}
+
+static void dtls_session_note_cycles(uint32_t *mean, uint32_t count, uint32_t cycles)
+{
+    if (count == 1) {
+        *mean = cycles;
+    } else {
+        *mean = (uint32_t) ((int32_t) *mean + ((int32_t) (cycles - *mean) / 16));
+    }
+}
+
+// Resuming reuses the master secret; a full handshake derives a new one
+static bool dtls_session_is_resumption(const mbedtls_ssl_session *session)
+{
+    return saved_valid
+           && memcmp(session->MBEDTLS_PRIVATE(master), saved.MBEDTLS_PRIVATE(master), sizeof(saved.MBEDTLS_PRIVATE(master))) == 0;
+}
+
+static esp_err_t dtls_session_handshake(void)
+{
+    mbedtls_ssl_session session;
+    unsigned char peer_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX];
+    int cid_enabled = MBEDTLS_SSL_CID_DISABLED;
+    int64_t start_us = esp_timer_get_time();
+    bool resumed;
+    int ret;
+
+    established = false;
+
+    mbedtls_ssl_session_reset(&ssl);
+    if (saved_valid && mbedtls_ssl_set_session(&ssl, &saved) != 0) {
+        mbedtls_ssl_session_free(&saved);
+        saved_valid = false;
+    }
+
+    do {
+        ret = mbedtls_ssl_handshake(&ssl);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    handshake_at_us = esp_timer_get_time();
+    stats.last_handshake_ms = (uint32_t) ((handshake_at_us - start_us) / 1000);
+    if (ret != 0) {
+        stats.failed_handshakes++;
+        ESP_LOGW(TAG, "Handshake failed after %" PRIu32 " ms (-0x%04x).", stats.last_handshake_ms, (unsigned) -ret);
+        return ESP_FAIL;
+    }
+
+    mbedtls_ssl_session_init(&session);
+    if (mbedtls_ssl_get_session(&ssl, &session) == 0) {
+        resumed = dtls_session_is_resumption(&session);
+        mbedtls_ssl_session_free(&saved);
+        saved = session;
+        saved_valid = true;
+    } else {
+        resumed = false;
+        mbedtls_ssl_session_free(&session);
+    }
+
+    if (resumed) {
+        stats.resumed_handshakes++;
+    } else {
+        stats.full_handshakes++;
+    }
+    stats.expansion = mbedtls_ssl_get_record_expansion(&ssl);
+    if (mbedtls_ssl_get_peer_cid(&ssl, &cid_enabled, peer_cid, &stats.peer_cid_len) != 0 || cid_enabled != MBEDTLS_SSL_CID_ENABLED) {
+        stats.peer_cid_len = 0;
+    }
+
+    ESP_LOGI(TAG, "%s handshake in %" PRIu32 " ms, %s, CID %u bytes, %d bytes per record.",
+             resumed ? "Abbreviated" : "Full", stats.last_handshake_ms, mbedtls_ssl_get_ciphersuite(&ssl),
+             (unsigned) stats.peer_cid_len, stats.expansion);
+
+    established = true;
+    last_rx_us = handshake_at_us;
+    return ESP_OK;
+}
+
+esp_err_t dtls_session_open(int socketfd)
+{
+    uint8_t mac[6];
+    int ret;
+
+    socket_fd = socketfd;
+
+    ESP_RETURN_ON_FALSE(dtls_session_parse_psk(DTLS_PSK_HEX), ESP_ERR_INVALID_ARG, TAG, "DTLS_PSK_HEX must be 1 to %d bytes in hex", DTLS_SESSION_PSK_MAX);
+    ESP_RETURN_ON_ERROR(esp_read_mac(mac, ESP_MAC_WIFI_STA), TAG, "Unable to read the device ID");
+    snprintf(identity, sizeof(identity), "sensor-%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_ssl_init(&ssl);
+    mbedtls_ssl_session_init(&saved);
+
+    ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_DATAGRAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    ESP_RETURN_ON_FALSE(ret == 0, ESP_FAIL, TAG, "Unable to set up DTLS configuration (-0x%04x)", (unsigned) -ret);
+
+    mbedtls_ssl_conf_rng(&conf, dtls_session_random, NULL);
+    mbedtls_ssl_conf_ciphersuites(&conf, ciphersuites);
+    mbedtls_ssl_conf_handshake_timeout(&conf, DTLS_SESSION_HANDSHAKE_MIN_MS, CONFIG_UPLINK_DTLS_HANDSHAKE_TIMEOUT_MS);
+    mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+    ret = mbedtls_ssl_conf_psk(&conf, psk, psk_len, (const unsigned char *) identity, strlen(identity));
+    ESP_RETURN_ON_FALSE(ret == 0, ESP_FAIL, TAG, "Unable to set the PSK (-0x%04x)", (unsigned) -ret);
+
+    // The device's own CID is empty: only the collector needs one to find
+    // the session
+    ret = mbedtls_ssl_conf_cid(&conf, 0, MBEDTLS_SSL_UNEXPECTED_CID_IGNORE);
+    ESP_RETURN_ON_FALSE(ret == 0, ESP_FAIL, TAG, "Unable to configure connection IDs (-0x%04x)", (unsigned) -ret);
+
+    ret = mbedtls_ssl_setup(&ssl, &conf);
+    ESP_RETURN_ON_FALSE(ret == 0, ESP_ERR_NO_MEM, TAG, "Unable to set up DTLS context (-0x%04x)", (unsigned) -ret);
+
+    ret = mbedtls_ssl_set_cid(&ssl, MBEDTLS_SSL_CID_ENABLED, NULL, 0);
+    ESP_RETURN_ON_FALSE(ret == 0, ESP_FAIL, TAG, "Unable to request a connection ID (-0x%04x)", (unsigned) -ret);
+
+    mbedtls_ssl_set_mtu(&ssl, CONFIG_UPLINK_MTU_BYTES);
+    mbedtls_ssl_set_timer_cb(&ssl, &timer, dtls_session_set_timer, dtls_session_get_timer);
+    mbedtls_ssl_set_bio(&ssl, NULL, dtls_session_bio_send, NULL, dtls_session_bio_recv);
+
+    ESP_LOGI(TAG, "PSK identity %s.", identity);
+    return ESP_OK;
+}
+
+bool dtls_session_send(const uint8_t *buf, size_t len)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t interval_us = CONFIG_UPLINK_DTLS_RESUME_AFTER_MS * 1000LL;
+    uint32_t start;
+    uint32_t cycles;
+    int ret;
+
+    // A silent collector may have dropped the session; find out with a
+    // resumption, at most once per interval
+    if ((!established || now - last_rx_us >= interval_us) && (handshake_at_us == 0 || now - handshake_at_us >= interval_us)) {
+        dtls_session_handshake();
+    }
+    if (!established) {
+        return false;
+    }
+
+    io_cycles = 0;
+    send_failed = false;
+    start = esp_cpu_get_cycle_count();
+    ret = mbedtls_ssl_write(&ssl, buf, len);
+    cycles = esp_cpu_get_cycle_count() - start - io_cycles;
+
+    if (ret < 0) {
+        ESP_LOGW(TAG, "Unable to send record (-0x%04x).", (unsigned) -ret);
+        established = false;
+        return false;
+    }
+
+    stats.records_out++;
+    dtls_session_note_cycles(&stats.encrypt_cycles, stats.records_out, cycles);
+    return !send_failed;
+}
+
+ssize_t dtls_session_receive(uint8_t *buf, size_t size, uint32_t timeout_ms)
+{
+    uint32_t start;
+    uint32_t cycles;
+    int ret;
+
+    read_timeout_ms = timeout_ms;
+
+    // Nothing can be authenticated without a session: wait as asked and
+    // drop whatever arrives
+    if (!established) {
+        dtls_session_bio_recv(NULL, buf, size, timeout_ms);
+        return -1;
+    }
+
+    io_cycles = 0;
+    start = esp_cpu_get_cycle_count();
+    ret = mbedtls_ssl_read(&ssl, buf, size);
+    cycles = esp_cpu_get_cycle_count() - start - io_cycles;
+
+    if (ret > 0) {
+        stats.records_in++;
+        dtls_session_note_cycles(&stats.decrypt_cycles, stats.records_in, cycles);
+        last_rx_us = esp_timer_get_time();
+        return ret;
+    }
+
+    // Alerts arrive encrypted, so only the collector can end the session
+    if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE) {
+        ESP_LOGW(TAG, "Session closed by the collector (-0x%04x).", (unsigned) -ret);
+        established = false;
+    } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_TIMEOUT) {
+        ESP_LOGD(TAG, "Unable to read record (-0x%04x).", (unsigned) -ret);
+    }
+    return -1;
+}
+
+void dtls_session_get_stats(dtls_session_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
+
+void dtls_session_log_stats(void)
+{
+    ESP_LOGI(TAG, "%s: %" PRIu32 " full, %" PRIu32 " abbreviated, %" PRIu32 " failed handshakes (last %" PRIu32 " ms), CID %u bytes, %d bytes per record, %" PRIu32 " records out at %" PRIu32 " cycles, %" PRIu32 " in at %" PRIu32 " cycles",
+             established ? "Established" : "No session", stats.full_handshakes, stats.resumed_handshakes, stats.failed_handshakes,
+             stats.last_handshake_ms, (unsigned) stats.peer_cid_len, stats.expansion,
+             stats.records_out, stats.encrypt_cycles, stats.records_in, stats.decrypt_cycles);
+}
@@ -0,0 +1,100 @@
+// dtls_session.h
+#ifndef DTLS_SESSION_H
+#define DTLS_SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * DTLS 1.2 client over the socket transport's connected UDP socket
+ * (CONFIG_UPLINK_DTLS), on the vendored mbedtls with the AES and SHA
+ * accelerators.
+ *
+ * - Authentication is a pre-shared key (DTLS_PSK_HEX in config.h) under the
+ *   identity "sensor-" plus the device ID in hex, so the collector looks up
+ *   the key per device.
+ * - The client asks for an RFC 9146 connection ID. Records then carry the
+ *   collector's CID, which identifies the session instead of the source
+ *   address: a NAT rebinding or a Wi-Fi reconnect with a new address goes on
+ *   with the same keys and no handshake.
+ * - The session is kept after every handshake. A new handshake offers it
+ *   back, with the collector's RFC 5077 ticket when it issued one, and the
+ *   collector resumes it in one round trip with no key exchange.
+ *
+ * The handshake runs inside dtls_session_send(), which blocks for it. It
+ * starts when there is no session yet, after the collector closed it, or
+ * when nothing authenticated has arrived for
+ * CONFIG_UPLINK_DTLS_RESUME_AFTER_MS; a failed one is not retried before that
+ * interval either.
+ */
+
+/**
+ * Largest record overhead: header with the longest CID the collector may
+ * pick, the inner content type plus padding, explicit nonce and tag.
+ */
+#if defined(CONFIG_UPLINK_DTLS_AES_128_CCM_8)
+#define DTLS_SESSION_TAG_SIZE       8
+#else
+#define DTLS_SESSION_TAG_SIZE       16
+#endif
+#define DTLS_SESSION_OVERHEAD       (13 + CONFIG_MBEDTLS_SSL_CID_OUT_LEN_MAX + CONFIG_MBEDTLS_SSL_CID_PADDING_GRANULARITY + 8 + DTLS_SESSION_TAG_SIZE)
+
+typedef struct {
+    uint32_t full_handshakes;
+    uint32_t resumed_handshakes;    // Abbreviated, from a kept session
+    uint32_t failed_handshakes;
+    uint32_t last_handshake_ms;
+    uint32_t records_out;
+    uint32_t records_in;
+    uint32_t encrypt_cycles;        // Per record, EMA with alpha = 1/16, socket call excluded
+    uint32_t decrypt_cycles;        // Same, for authenticated records received
+    int      expansion;             // Bytes added per record; 0 before the first handshake
+    size_t   peer_cid_len;          // 0 if the collector did not accept a CID
+} dtls_session_stats_t;
+
+/**
+ * @brief Sets up the DTLS context on a connected UDP socket. Does not
+ * handshake yet.
+ */
+esp_err_t dtls_session_open(int socketfd);
+
+/**
+ * @brief Encrypts @p len bytes into one record and sends it, handshaking
+ * first if needed.
+ *
+ * @return true if the record went out.
+ */
+bool dtls_session_send(const uint8_t *buf, size_t len);
+
+/**
+ * @brief Waits up to @p timeout_ms (0: only what is already queued,
+ * UINT32_MAX: forever) for one authenticated record.
+ *
+ * @return Its length, or -1 if none arrived. Anything that fails to
+ * authenticate is dropped.
+ */
+ssize_t dtls_session_receive(uint8_t *buf, size_t size, uint32_t timeout_ms);
+
+/**
+ * @brief Copies the counters.
+ */
+void dtls_session_get_stats(dtls_session_stats_t *stats_out);
+
+/**
+ * @brief Logs the handshake counts and per-record crypto cost.
+ */
+void dtls_session_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DTLS_SESSION_H
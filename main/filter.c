@@ -0,0 +1,75 @@
+#include "filter.h"
+
+#define FILTER_EMA_FRAC_BITS    8
+
+// Bursts are a handful of codes, so insertion sort beats anything cleverer
+static void filter_sort(int32_t *codes, size_t n)
+{
+    int32_t code;
+    size_t j;
+
+    for (size_t i = 1; i < n; i++) {
+        code = codes[i];
+        for (j = i; j > 0 && codes[j - 1] > code; j--) {
+            codes[j] = codes[j - 1];
+        }
+        codes[j] = code;
+    }
+}
+
+int32_t filter_median(int32_t *codes, size_t n)
+{
+    filter_sort(codes, n);
+
+    if (n % 2) {
+        return codes[n / 2];
+    }
+
+    return (int32_t) (((int64_t) codes[n / 2 - 1] + codes[n / 2] + 1) >> 1);
+}
+
+int32_t filter_trimmed_mean(int32_t *codes, size_t n, size_t trim)
+{
+    int64_t sum = 0;
+    size_t kept;
+
+    if (2 * trim >= n) {
+        trim = (n - 1) / 2;
+    }
+    kept = n - 2 * trim;
+
+    filter_sort(codes, n);
+    for (size_t i = trim; i < n - trim; i++) {
+        sum += codes[i];
+    }
+
+    return (int32_t) ((sum + (int64_t) (kept / 2)) / (int64_t) kept);
+}
+
+int32_t filter_ema(const int32_t *codes, size_t n, uint8_t shift)
+{
+    int64_t acc = (int64_t) codes[0] << FILTER_EMA_FRAC_BITS;
+
+    for (size_t i = 1; i < n; i++) {
+        acc += (((int64_t) codes[i] << FILTER_EMA_FRAC_BITS) - acc) >> shift;
+    }
+
+    return (int32_t) ((acc + (1 << (FILTER_EMA_FRAC_BITS - 1))) >> FILTER_EMA_FRAC_BITS);
+}
+
+int32_t filter_spread(const int32_t *codes, size_t n)
+{
+    int32_t min = codes[0];
+    int32_t max = codes[0];
+
+    for (size_t i = 1; i < n; i++) {
+        if (codes[i] < min) {
+            min = codes[i];
+        }
+        if (codes[i] > max) {
+            max = codes[i];
+        }
+    }
+
+    return max - min;
+}
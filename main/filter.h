@@ -0,0 +1,50 @@
+// filter.h
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Decimation filters for an oversampled burst of raw sensor codes. Everything
+ * is integer arithmetic so a burst reduces to one code without touching the FPU.
+ */
+
+/**
+ * @brief Returns the median of @p n codes, sorting @p codes in place.
+ *
+ * For an even @p n the two middle codes are averaged, rounding half up.
+ */
+int32_t filter_median(int32_t *codes, size_t n);
+
+/**
+ * @brief Sorts @p codes in place, drops @p trim codes from each end and
+ * returns the rounded mean of the rest.
+ *
+ * @p trim is clamped so at least one code is kept.
+ */
+int32_t filter_trimmed_mean(int32_t *codes, size_t n, size_t trim);
+
+/**
+ * @brief Runs a first-order IIR (EMA) with alpha = 1 / 2^@p shift over the
+ * codes in order and returns the final output.
+ *
+ * The accumulator carries 8 fractional bits so small steps are not lost to
+ * truncation.
+ */
+int32_t filter_ema(const int32_t *codes, size_t n, uint8_t shift);
+
+/**
+ * @brief Returns max - min of the codes.
+ */
+int32_t filter_spread(const int32_t *codes, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILTER_H
@@ -0,0 +1,555 @@
+#include <inttypes.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "spi_flash_mmap.h"
+#include "sdkconfig.h"
+#include "journal.h"
+
+const static char *TAG = "JOURNAL";
+
+#define JOURNAL_PARTITION_SUBTYPE   0x40
+#define JOURNAL_SECTOR_MAGIC        0x314C4E4A      // "JNL1"
+#define JOURNAL_RECORD_MAGIC        0x4A52          // "RJ"
+#define JOURNAL_FORMAT_VERSION      1               // Bump when sensor_sample_t changes layout
+#define JOURNAL_STATE_CONSUMED      0x00000000      // Cleared in place, no erase needed
+#define JOURNAL_CRC_CHUNK           256
+
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;
+    uint16_t version;               // JOURNAL_FORMAT_VERSION of the records
+    uint16_t sample_size;           // sizeof(sensor_sample_t) they were written with
+    uint32_t crc;
+} journal_sector_header_t;
+
+typedef struct {
+    uint16_t magic;
+    uint16_t len;                   // Payload bytes
+    uint32_t seq;
+    uint32_t crc;                   // Over magic, len, seq and the payload
+    uint32_t state;                 // Left erased until the record is consumed
+} journal_record_header_t;
+
+#define JOURNAL_SECTOR_SIZE     SPI_FLASH_SEC_SIZE
+#define JOURNAL_RECORD_START    ((sizeof(journal_sector_header_t) + 3) & ~3u)
+
+_Static_assert(JOURNAL_RECORD_START + sizeof(journal_record_header_t) + sizeof(sensor_sample_t) <= JOURNAL_SECTOR_SIZE, "A sector must hold a sample");
+_Static_assert(sizeof(sensor_sample_t) % 4 == 0, "Records must stay word aligned");
+_Static_assert(sizeof(sensor_sample_t) <= UINT16_MAX, "Sample size is stored in 16 bits");
+
+typedef enum {
+    JOURNAL_SLOT_RECORD,            // Valid record header
+    JOURNAL_SLOT_ERASED,            // End of the written part of the sector
+    JOURNAL_SLOT_TORN,              // Anything else: the rest of the sector is unusable
+} journal_slot_t;
+
+typedef struct {
+    uint32_t sector;
+    uint32_t offset;
+} journal_pos_t;
+
+static const esp_partition_t *partition;
+static uint32_t sector_count;
+static uint32_t generation;         // Of the head sector
+static uint32_t next_seq;
+static journal_pos_t head;          // Where the next record goes
+static journal_pos_t tail;          // Oldest record that may still be pending
+static journal_pos_t cursor;        // Where journal_peek_next() carries on
+static bool cursor_valid;
+static journal_stats_t stats;
+
+// Staging for the wall-clock copy of a batch; only the sender appends
+static sensor_sample_t staging[CONFIG_UPLINK_MAX_BATCH_SAMPLES];
+
+static size_t journal_record_size(uint16_t len)
+{
+    return sizeof(journal_record_header_t) + ((len + 3) & ~3u);
+}
+
+static size_t journal_addr(journal_pos_t pos)
+{
+    return (size_t) pos.sector * JOURNAL_SECTOR_SIZE + pos.offset;
+}
+
+static uint32_t journal_sector_crc(const journal_sector_header_t *header)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *) header, offsetof(journal_sector_header_t, crc));
+}
+
+static uint32_t journal_record_crc(const journal_record_header_t *header, const void *payload)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *) header, offsetof(journal_record_header_t, crc));
+
+    return esp_rom_crc32_le(crc, payload, header->len);
+}
+
+static bool journal_erased(const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool journal_sector_header_valid(const journal_sector_header_t *header)
+{
+    return header->magic == JOURNAL_SECTOR_MAGIC && header->crc == journal_sector_crc(header) &&
+           header->version == JOURNAL_FORMAT_VERSION && header->sample_size == sizeof(sensor_sample_t);
+}
+
+static bool journal_read_sector_header(uint32_t sector, journal_sector_header_t *header)
+{
+    if (esp_partition_read(partition, (size_t) sector * JOURNAL_SECTOR_SIZE, header, sizeof(*header)) != ESP_OK) {
+        return false;
+    }
+    return journal_sector_header_valid(header);
+}
+
+// A sector with the magic but a header that does not check out was written
+// in another format, or lost power while being started. Its records cannot
+// be read back as samples, so it is erased rather than left to be misread.
+static void journal_discard_stale(void)
+{
+    journal_sector_header_t header;
+    uint32_t discarded = 0;
+
+    for (uint32_t s = 0; s < sector_count; s++) {
+        if (esp_partition_read(partition, (size_t) s * JOURNAL_SECTOR_SIZE, &header, sizeof(header)) != ESP_OK ||
+            header.magic != JOURNAL_SECTOR_MAGIC || journal_sector_header_valid(&header)) {
+            continue;
+        }
+        if (esp_partition_erase_range(partition, (size_t) s * JOURNAL_SECTOR_SIZE, JOURNAL_SECTOR_SIZE) != ESP_OK) {
+            ESP_LOGW(TAG, "Unable to erase stale sector %" PRIu32, s);
+            continue;
+        }
+        stats.erases++;
+        discarded++;
+    }
+
+    if (discarded > 0) {
+        ESP_LOGW(TAG, "Discarded %" PRIu32 " sector(s) in another format", discarded);
+    }
+}
+
+static journal_slot_t journal_read_slot(journal_pos_t pos, journal_record_header_t *header)
+{
+    if (pos.offset + sizeof(*header) > JOURNAL_SECTOR_SIZE) {
+        return JOURNAL_SLOT_TORN;
+    }
+    if (esp_partition_read(partition, journal_addr(pos), header, sizeof(*header)) != ESP_OK) {
+        return JOURNAL_SLOT_TORN;
+    }
+    if (journal_erased(header, offsetof(journal_record_header_t, state))) {
+        return JOURNAL_SLOT_ERASED;
+    }
+    if (header->magic != JOURNAL_RECORD_MAGIC || pos.offset + journal_record_size(header->len) > JOURNAL_SECTOR_SIZE) {
+        return JOURNAL_SLOT_TORN;
+    }
+    return JOURNAL_SLOT_RECORD;
+}
+
+// Reads the payload in chunks to check the CRC without a sector-sized buffer
+static bool journal_verify(journal_pos_t pos, const journal_record_header_t *header)
+{
+    uint8_t chunk[JOURNAL_CRC_CHUNK];
+    size_t addr = journal_addr(pos) + sizeof(*header);
+    size_t n;
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *) header, offsetof(journal_record_header_t, crc));
+
+    for (size_t done = 0; done < header->len; done += n) {
+        n = header->len - done < sizeof(chunk) ? header->len - done : sizeof(chunk);
+        if (esp_partition_read(partition, addr + done, chunk, n) != ESP_OK) {
+            return false;
+        }
+        crc = esp_rom_crc32_le(crc, chunk, n);
+    }
+
+    return crc == header->crc;
+}
+
+static void journal_advance(journal_pos_t *pos, const journal_record_header_t *header)
+{
+    pos->offset += journal_record_size(header->len);
+}
+
+static void journal_next_sector(journal_pos_t *pos)
+{
+    pos->sector = (pos->sector + 1) % sector_count;
+    pos->offset = JOURNAL_RECORD_START;
+}
+
+static bool journal_pos_equal(journal_pos_t a, journal_pos_t b)
+{
+    return a.sector == b.sector && a.offset == b.offset;
+}
+
+// Clearing bits needs no erase, so the state word is rewritten in place
+static esp_err_t journal_mark_consumed(journal_pos_t pos)
+{
+    const uint32_t consumed = JOURNAL_STATE_CONSUMED;
+
+    stats.bytes_written += sizeof(consumed);
+    return esp_partition_write(partition, journal_addr(pos) + offsetof(journal_record_header_t, state), &consumed, sizeof(consumed));
+}
+
+static esp_err_t journal_start_sector(uint32_t sector)
+{
+    journal_sector_header_t header = {
+        .magic = JOURNAL_SECTOR_MAGIC,
+        .generation = generation + 1,
+        .version = JOURNAL_FORMAT_VERSION,
+        .sample_size = sizeof(sensor_sample_t),
+    };
+
+    header.crc = journal_sector_crc(&header);
+
+    ESP_RETURN_ON_ERROR(esp_partition_erase_range(partition, (size_t) sector * JOURNAL_SECTOR_SIZE, JOURNAL_SECTOR_SIZE),
+                        TAG, "Unable to erase sector %" PRIu32, sector);
+    stats.erases++;
+    ESP_RETURN_ON_ERROR(esp_partition_write(partition, (size_t) sector * JOURNAL_SECTOR_SIZE, &header, sizeof(header)),
+                        TAG, "Unable to write sector %" PRIu32 " header", sector);
+    stats.bytes_written += sizeof(header);
+
+    generation = header.generation;
+    head.sector = sector;
+    head.offset = JOURNAL_RECORD_START;
+    return ESP_OK;
+}
+
+// Counts what a sector still holds for replay, starting at @p pos
+static void journal_count_pending(journal_pos_t pos, uint32_t *records, uint32_t *samples)
+{
+    journal_record_header_t header;
+
+    while (journal_read_slot(pos, &header) == JOURNAL_SLOT_RECORD) {
+        if (header.state != JOURNAL_STATE_CONSUMED) {
+            (*records)++;
+            *samples += header.len / sizeof(sensor_sample_t);
+        }
+        journal_advance(&pos, &header);
+    }
+}
+
+// The head is about to take over the tail's sector: whatever it still holds is lost
+static void journal_drop_tail_sector(void)
+{
+    uint32_t records = 0;
+    uint32_t samples = 0;
+    uint32_t dropped = tail.sector;
+
+    journal_count_pending(tail, &records, &samples);
+    stats.dropped_records += records;
+    stats.pending_records -= records;
+    stats.pending_samples -= samples;
+    journal_next_sector(&tail);
+    if (cursor.sector == dropped) {
+        cursor = tail;
+    }
+
+    if (records > 0) {
+        ESP_LOGW(TAG, "Journal full, dropped %" PRIu32 " unsent record(s)", records);
+    }
+}
+
+// Finds the newest sector, then the end of its records
+static esp_err_t journal_recover_head(void)
+{
+    journal_sector_header_t header;
+    journal_record_header_t record;
+    bool found = false;
+
+    for (uint32_t s = 0; s < sector_count; s++) {
+        if (journal_read_sector_header(s, &header) && (!found || header.generation > generation)) {
+            generation = header.generation;
+            head.sector = s;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        ESP_LOGI(TAG, "No journal found, formatting");
+        generation = 0;
+        return journal_start_sector(0);
+    }
+
+    head.offset = JOURNAL_RECORD_START;
+    while (1) {
+        switch (journal_read_slot(head, &record)) {
+        case JOURNAL_SLOT_ERASED:
+            return ESP_OK;
+        case JOURNAL_SLOT_RECORD:
+            if (journal_verify(head, &record)) {
+                next_seq = record.seq + 1;
+                journal_advance(&head, &record);
+                continue;
+            }
+            // fall through
+        case JOURNAL_SLOT_TORN:
+        default:
+            // Power was lost mid-write; nothing more can go in this sector
+            ESP_LOGW(TAG, "Torn record in sector %" PRIu32 " at %" PRIu32 ", sealing it", head.sector, head.offset);
+            head.offset = JOURNAL_SECTOR_SIZE;
+            return ESP_OK;
+        }
+    }
+}
+
+// Walks the sectors from oldest to newest to find the first pending record
+// and count the backlog
+static void journal_recover_tail(void)
+{
+    journal_sector_header_t header;
+    journal_pos_t pos = head;
+    bool tail_found = false;
+
+    for (uint32_t i = 0; i < sector_count; i++) {
+        journal_next_sector(&pos);
+        if (!journal_read_sector_header(pos.sector, &header) || header.generation > generation) {
+            continue;
+        }
+
+        if (!tail_found) {
+            journal_record_header_t record;
+            journal_pos_t scan = pos;
+
+            while (journal_read_slot(scan, &record) == JOURNAL_SLOT_RECORD) {
+                if (record.state != JOURNAL_STATE_CONSUMED) {
+                    tail = scan;
+                    tail_found = true;
+                    break;
+                }
+                journal_advance(&scan, &record);
+            }
+        }
+
+        journal_count_pending(pos, &stats.pending_records, &stats.pending_samples);
+    }
+
+    if (!tail_found) {
+        tail = head;
+    }
+}
+
+esp_err_t journal_init(void)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_PARTITION_SUBTYPE, CONFIG_JOURNAL_PARTITION_LABEL);
+    ESP_RETURN_ON_FALSE(partition != NULL, ESP_ERR_NOT_FOUND, TAG, "No \"%s\" partition, journal disabled", CONFIG_JOURNAL_PARTITION_LABEL);
+
+    sector_count = partition->size / JOURNAL_SECTOR_SIZE;
+    if (sector_count < 2) {
+        partition = NULL;
+        ESP_LOGE(TAG, "Journal partition needs at least two sectors");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    stats = (journal_stats_t) { 0 };
+    next_seq = 0;
+    cursor_valid = false;
+
+    journal_discard_stale();
+    if (journal_recover_head() != ESP_OK) {
+        partition = NULL;
+        return ESP_FAIL;
+    }
+    journal_recover_tail();
+
+    ESP_LOGI(TAG, "%" PRIu32 " sectors, %" PRIu32 " record(s) / %" PRIu32 " sample(s) pending, next sequence %" PRIu32,
+             sector_count, stats.pending_records, stats.pending_samples, next_seq);
+    return ESP_OK;
+}
+
+bool journal_ready(void)
+{
+    return partition != NULL;
+}
+
+static esp_err_t journal_write_record(const sensor_sample_t *samples, size_t count)
+{
+    journal_record_header_t header = {
+        .magic = JOURNAL_RECORD_MAGIC,
+        .len = count * sizeof(sensor_sample_t),
+        .seq = next_seq,
+        .state = UINT32_MAX,
+    };
+
+    header.crc = journal_record_crc(&header, samples);
+
+    // Header first: if power goes before the payload lands, the CRC exposes it
+    ESP_RETURN_ON_ERROR(esp_partition_write(partition, journal_addr(head), &header, offsetof(journal_record_header_t, state)),
+                        TAG, "Unable to write record header");
+    ESP_RETURN_ON_ERROR(esp_partition_write(partition, journal_addr(head) + sizeof(header), samples, header.len),
+                        TAG, "Unable to write record payload");
+
+    if (stats.pending_records == 0) {
+        tail = head;
+    }
+    head.offset += journal_record_size(header.len);
+    next_seq++;
+
+    stats.pending_records++;
+    stats.pending_samples += count;
+    stats.appended_records++;
+    stats.appended_samples += count;
+    stats.bytes_written += offsetof(journal_record_header_t, state) + header.len;
+    return ESP_OK;
+}
+
+esp_err_t journal_append(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us)
+{
+    journal_pos_t next;
+    size_t room;
+    size_t n;
+
+    ESP_RETURN_ON_FALSE(partition != NULL, ESP_ERR_INVALID_STATE, TAG, "Journal disabled");
+    ESP_RETURN_ON_FALSE(count > 0 && count <= CONFIG_UPLINK_MAX_BATCH_SAMPLES, ESP_ERR_INVALID_ARG, TAG, "Bad record size");
+
+    for (size_t i = 0; i < count; i++) {
+        staging[i] = samples[i];
+        staging[i].acquired_us += epoch_offset_us;
+    }
+
+    // A batch that does not fit the rest of the sector is split rather than
+    // leaving the space unused
+    for (size_t done = 0; done < count; done += n) {
+        room = head.offset + sizeof(journal_record_header_t) < JOURNAL_SECTOR_SIZE
+               ? (JOURNAL_SECTOR_SIZE - head.offset - sizeof(journal_record_header_t)) / sizeof(sensor_sample_t) : 0;
+
+        if (room == 0) {
+            next = head;
+            journal_next_sector(&next);
+            if (next.sector == tail.sector && !journal_pos_equal(tail, head)) {
+                journal_drop_tail_sector();
+            }
+            ESP_RETURN_ON_ERROR(journal_start_sector(next.sector), TAG, "Unable to open a new sector");
+            n = 0;
+            continue;
+        }
+
+        n = count - done < room ? count - done : room;
+        ESP_RETURN_ON_ERROR(journal_write_record(&staging[done], n), TAG, "Unable to append %u sample(s)", (unsigned) n);
+    }
+
+    return ESP_OK;
+}
+
+// Moves @p pos to the first record at or after it that is still pending,
+// past consumed records and the unused end of each sector. Returns false if
+// there is none before the head.
+static bool journal_seek_pending(journal_pos_t *pos, journal_record_header_t *header)
+{
+    while (!journal_pos_equal(*pos, head)) {
+        switch (journal_read_slot(*pos, header)) {
+        case JOURNAL_SLOT_RECORD:
+            if (header->state != JOURNAL_STATE_CONSUMED) {
+                return true;
+            }
+            journal_advance(pos, header);
+            continue;
+        case JOURNAL_SLOT_ERASED:
+        case JOURNAL_SLOT_TORN:
+        default:
+            if (pos->sector == head.sector) {
+                *pos = head;
+            } else {
+                journal_next_sector(pos);
+            }
+            continue;
+        }
+    }
+
+    return false;
+}
+
+// Reads the first pending record at or after @p pos, which is left on it,
+// and points @p next_out past it. Records that fail their CRC are retired.
+static esp_err_t journal_read_pending(journal_pos_t *pos, sensor_sample_t *samples, size_t *count_out, uint32_t *id_out,
+                                      journal_pos_t *next_out)
+{
+    journal_record_header_t header;
+
+    while (stats.pending_records > 0 && journal_seek_pending(pos, &header)) {
+        if (header.len % sizeof(sensor_sample_t) == 0 && header.len <= sizeof(staging)) {
+            ESP_RETURN_ON_ERROR(esp_partition_read(partition, journal_addr(*pos) + sizeof(header), samples, header.len),
+                                TAG, "Unable to read record");
+            if (journal_record_crc(&header, samples) == header.crc) {
+                *count_out = header.len / sizeof(sensor_sample_t);
+                *id_out = header.seq;
+                *next_out = *pos;
+                journal_advance(next_out, &header);
+                return ESP_OK;
+            }
+        }
+
+        // Corrupt record: retire it so it is not retried after a reboot
+        ESP_LOGW(TAG, "Record %" PRIu32 " failed its CRC, skipping", header.seq);
+        journal_mark_consumed(*pos);
+        stats.corrupt_records++;
+        stats.pending_records--;
+        stats.pending_samples -= header.len / sizeof(sensor_sample_t);
+        journal_advance(pos, &header);
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t journal_peek(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out)
+{
+    esp_err_t ret;
+
+    ESP_RETURN_ON_FALSE(partition != NULL, ESP_ERR_INVALID_STATE, TAG, "Journal disabled");
+
+    // Everything before the oldest pending record is consumed, so the tail follows it
+    ret = journal_read_pending(&tail, samples, count_out, id_out, &cursor);
+    cursor_valid = ret == ESP_OK;
+    return ret;
+}
+
+esp_err_t journal_peek_next(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out)
+{
+    journal_pos_t pos = cursor;
+
+    ESP_RETURN_ON_FALSE(partition != NULL && cursor_valid, ESP_ERR_INVALID_STATE, TAG, "Nothing peeked");
+    return journal_read_pending(&pos, samples, count_out, id_out, &cursor);
+}
+
+esp_err_t journal_consume(uint32_t id)
+{
+    journal_record_header_t header;
+    journal_pos_t pos;
+
+    ESP_RETURN_ON_FALSE(partition != NULL, ESP_ERR_INVALID_STATE, TAG, "Journal disabled");
+
+    // Records lie in sequence order from the tail; one that is not found was
+    // dropped when the journal filled up
+    journal_seek_pending(&tail, &header);
+    pos = tail;
+    while (journal_seek_pending(&pos, &header) && (int32_t) (header.seq - id) <= 0) {
+        if (header.seq == id) {
+            ESP_RETURN_ON_ERROR(journal_mark_consumed(pos), TAG, "Unable to mark record %" PRIu32 " consumed", id);
+            stats.pending_records--;
+            stats.pending_samples -= header.len / sizeof(sensor_sample_t);
+            stats.consumed_records++;
+            return ESP_OK;
+        }
+        journal_advance(&pos, &header);
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+uint32_t journal_pending(void)
+{
+    return stats.pending_records;
+}
+
+void journal_get_stats(journal_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
@@ -0,0 +1,124 @@
+// journal.h
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sensor_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t pending_records;       // Written and not yet consumed
+    uint32_t pending_samples;
+    uint32_t appended_records;      // Since boot
+    uint32_t appended_samples;
+    uint32_t consumed_records;
+    uint32_t dropped_records;       // Overwritten unsent when the journal filled up
+    uint32_t corrupt_records;       // Failed their CRC on replay and were skipped
+    uint32_t erases;
+    uint64_t bytes_written;         // Headers and payload, for write amplification
+} journal_stats_t;
+
+/**
+ * Append-only store-and-forward journal on a data partition, used as a ring
+ * of flash sectors.
+ *
+ * Each sector starts with a header carrying a generation number, so the
+ * newest sector is found again after a reboot, and the format version and
+ * sample size its records were written with. Samples are stored as raw
+ * sensor_sample_t images, so sectors from a build where either differs are
+ * erased on recovery instead of being replayed. Records follow back to back:
+ * a header (magic, length, sequence number, CRC-32 over all of it and the
+ * payload, and a state word) and a run of samples. The header is written
+ * before the payload, so power lost mid-write leaves a record whose CRC
+ * fails; recovery seals that sector and appends from the next one. Consumed
+ * records are marked by clearing their state word in place, which needs no
+ * erase.
+ *
+ * Each sample is written to flash once, plus one state word write per record
+ * and one erase per sector per lap. When the journal is full the oldest
+ * sector is erased, whether its records were sent or not.
+ *
+ * Not thread-safe: only the sender task uses it.
+ */
+
+/**
+ * @brief Finds the journal partition and rebuilds the write and read
+ * positions from what is on flash.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if the partition table has no journal
+ *         partition (the journal then stays disabled), or a flash error.
+ */
+esp_err_t journal_init(void);
+
+/**
+ * @brief Returns true if journal_init() succeeded.
+ */
+bool journal_ready(void);
+
+/**
+ * @brief Stores samples as one record.
+ *
+ * Monotonic timestamps do not survive a reboot, so each sample's
+ * acquired_us is rewritten as wall-clock microseconds on the way in.
+ *
+ * @param epoch_offset_us Added to acquired_us, as for payload_encode_batch().
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if @p count is 0 or over
+ *         CONFIG_UPLINK_MAX_BATCH_SAMPLES, ESP_ERR_INVALID_STATE if the
+ *         journal is disabled, or a flash error.
+ */
+esp_err_t journal_append(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us);
+
+/**
+ * @brief Reads the oldest record that has not been consumed.
+ *
+ * Calling it again without journal_consume() returns the same record.
+ * Records that fail their CRC are skipped and counted.
+ *
+ * @param samples Receives up to CONFIG_UPLINK_MAX_BATCH_SAMPLES samples, with
+ *        acquired_us in wall-clock microseconds.
+ * @param id_out Receives the record's ID, for journal_consume().
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if nothing is pending, or a flash error.
+ */
+esp_err_t journal_peek(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out);
+
+/**
+ * @brief Reads the pending record after the one the last journal_peek() or
+ * journal_peek_next() returned, so several records can be in flight before
+ * any is consumed. Records appended meanwhile are found too.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if there is no later record,
+ *         ESP_ERR_INVALID_STATE if nothing was peeked, or a flash error.
+ */
+esp_err_t journal_peek_next(sensor_sample_t *samples, size_t *count_out, uint32_t *id_out);
+
+/**
+ * @brief Marks a record as sent, in any order. Consumed records are never
+ * returned again, not even after a reboot.
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if the record was consumed already or
+ *         dropped because the journal filled up.
+ */
+esp_err_t journal_consume(uint32_t id);
+
+/**
+ * @brief Returns the number of records waiting to be replayed.
+ */
+uint32_t journal_pending(void);
+
+/**
+ * @brief Copies the counters. Meant for periodic reports from any task; the
+ * copy is not a consistent snapshot across fields.
+ */
+void journal_get_stats(journal_stats_t *stats_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JOURNAL_H
@@ -0,0 +1,53 @@
+#include <inttypes.h>
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "mem_budget.h"
+
+const static char *TAG = "MEM_BUDGET";
+
+static mem_task_t *tasks[MEM_BUDGET_MAX_TASKS];
+static size_t task_count;
+static size_t steady_free;
+
+esp_err_t mem_task_start(mem_task_t *task, TaskFunction_t fn, UBaseType_t priority, BaseType_t core)
+{
+    ESP_RETURN_ON_FALSE(task_count < MEM_BUDGET_MAX_TASKS, ESP_ERR_INVALID_STATE, TAG, "Too many tasks");
+
+#ifdef CONFIG_STATIC_MEMORY
+    task->handle = xTaskCreateStaticPinnedToCore(fn, task->name, task->stack_size, NULL, priority, task->stack, &task->tcb, core);
+#else
+    if (xTaskCreatePinnedToCore(fn, task->name, task->stack_size, NULL, priority, &task->handle, core) != pdPASS) {
+        task->handle = NULL;
+    }
+#endif
+    ESP_RETURN_ON_FALSE(task->handle != NULL, ESP_ERR_NO_MEM, TAG, "Unable to create task %s", task->name);
+
+    tasks[task_count++] = task;
+    return ESP_OK;
+}
+
+void mem_budget_mark_steady(void)
+{
+    steady_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+}
+
+void mem_budget_log(void)
+{
+    uint32_t unused;
+    uint32_t used;
+    size_t free_now = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+
+    for (size_t i = 0; i < task_count; i++) {
+        // ESP-IDF reports the high-water mark in bytes
+        unused = uxTaskGetStackHighWaterMark(tasks[i]->handle);
+        used = tasks[i]->stack_size - unused;
+        ESP_LOGI(TAG, "Stack %s: %" PRIu32 "/%" PRIu32 " bytes used at most, suggest %" PRIu32,
+                 tasks[i]->name, used, tasks[i]->stack_size, (used + CONFIG_STACK_MARGIN_BYTES + 15) & ~15U);
+    }
+
+    ESP_LOGI(TAG, "Internal heap: %u free, %u lowest, %u largest block, %+d since startup",
+             (unsigned) free_now, (unsigned) heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+             (unsigned) heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+             steady_free > 0 ? (int) free_now - (int) steady_free : 0);
+}
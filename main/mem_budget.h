@@ -0,0 +1,73 @@
+// mem_budget.h
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEM_BUDGET_MAX_TASKS    4
+
+/**
+ * An application task and, with CONFIG_STATIC_MEMORY, its statically
+ * allocated stack and TCB. Declare one with MEM_TASK_DEFINE().
+ */
+typedef struct {
+    const char      *name;
+    uint32_t        stack_size;         // Bytes
+    TaskHandle_t    handle;
+#ifdef CONFIG_STATIC_MEMORY
+    StackType_t     *stack;
+    StaticTask_t    tcb;
+#endif
+} mem_task_t;
+
+#ifdef CONFIG_STATIC_MEMORY
+#define MEM_TASK_DEFINE(var, task_name, size)                                   \
+    static StackType_t var##_stack[(size) / sizeof(StackType_t)];               \
+    static mem_task_t var = { .name = (task_name), .stack_size = (size), .stack = var##_stack }
+#else
+#define MEM_TASK_DEFINE(var, task_name, size)                                   \
+    static mem_task_t var = { .name = (task_name), .stack_size = (size) }
+#endif
+
+/**
+ * @brief Creates the task pinned to @p core, from its static storage with
+ * CONFIG_STATIC_MEMORY and from the heap otherwise, and adds it to the
+ * stack report.
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM if the heap could not hold the task, or
+ *         ESP_ERR_INVALID_STATE if MEM_BUDGET_MAX_TASKS are already tracked.
+ */
+esp_err_t mem_task_start(mem_task_t *task, TaskFunction_t fn, UBaseType_t priority, BaseType_t core);
+
+/**
+ * @brief Records the free heap once startup allocations (Wi-Fi, lwIP, I2C,
+ * timers, the uplink's client or socket) are done. Called by the task that
+ * makes the last of them, once it has. Later reports show how far the heap
+ * moved from it.
+ */
+void mem_budget_mark_steady(void);
+
+/**
+ * @brief Logs each task's stack high-water mark with the size it suggests,
+ * and the internal heap: free, lowest ever, largest block and drift since
+ * mem_budget_mark_steady().
+ *
+ * The suggested size is the deepest use seen so far plus
+ * CONFIG_STACK_MARGIN_BYTES, rounded up to 16 bytes; it is only as good as
+ * the code paths the run has exercised.
+ */
+void mem_budget_log(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MEM_BUDGET_H
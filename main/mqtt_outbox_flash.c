@@ -0,0 +1,527 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sys/queue.h"
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "spi_flash_mmap.h"
+#include "sdkconfig.h"
+#include "mqtt_config.h"
+#include "mqtt_msg.h"
+#include "mqtt_outbox.h"
+#include "platform.h"
+#include "mqtt_outbox_flash.h"
+
+const static char *TAG = "OUTBOX";
+
+#define OUTBOX_PARTITION_SUBTYPE    0x41
+#define OUTBOX_SECTOR_MAGIC         0x3142584F      // "OXB1"
+#define OUTBOX_RECORD_MAGIC         0x424F          // "OB"
+#define OUTBOX_STATE_DELETED        0x00000000      // Cleared in place, no erase needed
+#define OUTBOX_CRC_CHUNK            256
+#define OUTBOX_MAX_SECTORS          64
+#define OUTBOX_NOT_STORED           (-1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t crc;
+} outbox_sector_header_t;
+
+typedef struct {
+    uint16_t magic;
+    uint16_t len;                   // MQTT packet bytes
+    uint16_t msg_id;
+    uint8_t  msg_type;
+    uint8_t  qos;
+    uint32_t crc;                   // Over the fields above and the packet
+    uint32_t state;                 // Left erased until the message is deleted
+} outbox_record_header_t;
+
+#define OUTBOX_SECTOR_SIZE      SPI_FLASH_SEC_SIZE
+#define OUTBOX_RECORD_START     ((sizeof(outbox_sector_header_t) + 3) & ~3u)
+
+typedef struct outbox_item {
+    uint8_t *buffer;
+    int len;
+    int msg_id;
+    int msg_type;
+    int msg_qos;
+    outbox_tick_t tick;
+    pending_state_t pending;
+    bool restored;                  // Read back from flash; nobody waits for it, so it never expires
+    int32_t sector;                 // OUTBOX_NOT_STORED for messages kept in RAM only
+    uint32_t offset;
+    STAILQ_ENTRY(outbox_item) next;
+} outbox_item_t;
+
+STAILQ_HEAD(outbox_list_t, outbox_item);
+
+struct outbox_t {
+    uint64_t size;
+    struct outbox_list_t list;
+};
+
+static const esp_partition_t *partition;
+static bool partition_searched;
+static uint32_t sector_count;
+static uint32_t generation;         // Of the head sector
+static uint32_t head_sector;
+static uint32_t head_offset;        // Where the next record goes
+static uint16_t live[OUTBOX_MAX_SECTORS];   // Records per sector not deleted yet
+static size_t restored;
+
+static size_t outbox_record_size(uint16_t len)
+{
+    return sizeof(outbox_record_header_t) + ((len + 3) & ~3u);
+}
+
+static size_t outbox_addr(uint32_t sector, uint32_t offset)
+{
+    return (size_t) sector * OUTBOX_SECTOR_SIZE + offset;
+}
+
+static uint32_t outbox_sector_crc(const outbox_sector_header_t *header)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *) header, offsetof(outbox_sector_header_t, crc));
+}
+
+static bool outbox_read_sector_header(uint32_t sector, outbox_sector_header_t *header)
+{
+    if (esp_partition_read(partition, outbox_addr(sector, 0), header, sizeof(*header)) != ESP_OK) {
+        return false;
+    }
+    return header->magic == OUTBOX_SECTOR_MAGIC && header->crc == outbox_sector_crc(header);
+}
+
+static esp_err_t outbox_start_sector(uint32_t sector)
+{
+    outbox_sector_header_t header = {
+        .magic = OUTBOX_SECTOR_MAGIC,
+        .generation = generation + 1,
+    };
+
+    header.crc = outbox_sector_crc(&header);
+
+    ESP_RETURN_ON_ERROR(esp_partition_erase_range(partition, outbox_addr(sector, 0), OUTBOX_SECTOR_SIZE),
+                        TAG, "Unable to erase sector %" PRIu32, sector);
+    ESP_RETURN_ON_ERROR(esp_partition_write(partition, outbox_addr(sector, 0), &header, sizeof(header)),
+                        TAG, "Unable to write sector %" PRIu32 " header", sector);
+
+    generation = header.generation;
+    head_sector = sector;
+    head_offset = OUTBOX_RECORD_START;
+    return ESP_OK;
+}
+
+// The header goes first, so power lost mid-write leaves a record whose CRC
+// fails and is skipped at startup
+static esp_err_t outbox_persist(outbox_item_t *item)
+{
+    outbox_record_header_t header = {
+        .magic = OUTBOX_RECORD_MAGIC,
+        .len = item->len,
+        .msg_id = item->msg_id,
+        .msg_type = item->msg_type,
+        .qos = item->msg_qos,
+        .state = UINT32_MAX,
+    };
+    size_t size = outbox_record_size(item->len);
+    uint32_t next;
+
+    ESP_RETURN_ON_FALSE(OUTBOX_RECORD_START + size <= OUTBOX_SECTOR_SIZE, ESP_ERR_INVALID_SIZE, TAG,
+                        "Message %d does not fit in a sector", item->msg_id);
+
+    if (head_offset + size > OUTBOX_SECTOR_SIZE) {
+        next = (head_sector + 1) % sector_count;
+        ESP_RETURN_ON_FALSE(live[next] == 0, ESP_ERR_NO_MEM, TAG, "Outbox full, message %d not kept", item->msg_id);
+        ESP_RETURN_ON_ERROR(outbox_start_sector(next), TAG, "Unable to start sector %" PRIu32, next);
+    }
+
+    header.crc = esp_rom_crc32_le(0, (const uint8_t *) &header, offsetof(outbox_record_header_t, crc));
+    header.crc = esp_rom_crc32_le(header.crc, item->buffer, item->len);
+
+    ESP_RETURN_ON_ERROR(esp_partition_write(partition, outbox_addr(head_sector, head_offset), &header, sizeof(header)),
+                        TAG, "Unable to write message %d", item->msg_id);
+    ESP_RETURN_ON_ERROR(esp_partition_write(partition, outbox_addr(head_sector, head_offset) + sizeof(header), item->buffer, item->len),
+                        TAG, "Unable to write message %d", item->msg_id);
+
+    item->sector = head_sector;
+    item->offset = head_offset;
+    live[head_sector]++;
+    head_offset += size;
+    return ESP_OK;
+}
+
+// Clearing bits needs no erase, so the state word is rewritten in place
+static void outbox_forget(outbox_item_t *item)
+{
+    const uint32_t deleted = OUTBOX_STATE_DELETED;
+
+    if (item->sector == OUTBOX_NOT_STORED) {
+        return;
+    }
+
+    if (esp_partition_write(partition, outbox_addr(item->sector, item->offset) + offsetof(outbox_record_header_t, state),
+                            &deleted, sizeof(deleted)) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to mark message %d deleted, it may be sent again after a reboot", item->msg_id);
+    }
+    live[item->sector]--;
+    item->sector = OUTBOX_NOT_STORED;
+}
+
+static void outbox_free_item(outbox_handle_t outbox, outbox_item_t *item)
+{
+    STAILQ_REMOVE(&outbox->list, item, outbox_item, next);
+    outbox->size -= item->len;
+    outbox_forget(item);
+    free(item->buffer);
+    free(item);
+}
+
+// Reads the packet in chunks to check the CRC without a sector-sized buffer
+static bool outbox_verify(uint32_t sector, uint32_t offset, const outbox_record_header_t *header)
+{
+    uint8_t chunk[OUTBOX_CRC_CHUNK];
+    size_t addr = outbox_addr(sector, offset) + sizeof(*header);
+    size_t n;
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *) header, offsetof(outbox_record_header_t, crc));
+
+    for (size_t done = 0; done < header->len; done += n) {
+        n = header->len - done < sizeof(chunk) ? header->len - done : sizeof(chunk);
+        if (esp_partition_read(partition, addr + done, chunk, n) != ESP_OK) {
+            return false;
+        }
+        crc = esp_rom_crc32_le(crc, chunk, n);
+    }
+
+    return crc == header->crc;
+}
+
+static void outbox_restore_record(outbox_handle_t outbox, uint32_t sector, uint32_t offset, const outbox_record_header_t *header)
+{
+    outbox_item_t *item = calloc(1, sizeof(outbox_item_t));
+
+    if (item == NULL || (item->buffer = heap_caps_malloc(header->len, MQTT_OUTBOX_MEMORY)) == NULL ||
+            esp_partition_read(partition, outbox_addr(sector, offset) + sizeof(*header), item->buffer, header->len) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to restore message %u", header->msg_id);
+        if (item) {
+            free(item->buffer);
+            free(item);
+        }
+        return;
+    }
+
+    item->len = header->len;
+    item->msg_id = header->msg_id;
+    item->msg_type = header->msg_type;
+    item->msg_qos = header->qos;
+    item->tick = platform_tick_get_ms();
+    item->pending = QUEUED;
+    item->restored = true;
+    item->sector = sector;
+    item->offset = offset;
+    STAILQ_INSERT_TAIL(&outbox->list, item, next);
+    outbox->size += item->len;
+    live[sector]++;
+    restored++;
+}
+
+// Queues the records of one sector that were never deleted; returns the
+// offset after the last intact record
+static uint32_t outbox_restore_sector(outbox_handle_t outbox, uint32_t sector)
+{
+    outbox_record_header_t header;
+    uint32_t offset = OUTBOX_RECORD_START;
+
+    while (offset + sizeof(header) <= OUTBOX_SECTOR_SIZE &&
+            esp_partition_read(partition, outbox_addr(sector, offset), &header, sizeof(header)) == ESP_OK &&
+            header.magic == OUTBOX_RECORD_MAGIC &&
+            offset + outbox_record_size(header.len) <= OUTBOX_SECTOR_SIZE) {
+        if (!outbox_verify(sector, offset, &header)) {
+            // Power was lost mid-write; nothing more can go in this sector
+            ESP_LOGW(TAG, "Torn record in sector %" PRIu32 " at %" PRIu32, sector, offset);
+            return OUTBOX_SECTOR_SIZE;
+        }
+        if (header.state != OUTBOX_STATE_DELETED) {
+            outbox_restore_record(outbox, sector, offset, &header);
+        }
+        offset += outbox_record_size(header.len);
+    }
+
+    // Anything but erased flash after the last record is a torn header
+    if (offset + sizeof(header) <= OUTBOX_SECTOR_SIZE && header.magic != UINT16_MAX) {
+        return OUTBOX_SECTOR_SIZE;
+    }
+    return offset;
+}
+
+// Finds the newest sector, then restores every sector from the oldest on,
+// so pending publishes go out in the order they were queued
+static void outbox_restore(outbox_handle_t outbox)
+{
+    outbox_sector_header_t header;
+    uint32_t sector;
+    uint32_t end;
+    bool found = false;
+
+    for (uint32_t s = 0; s < sector_count; s++) {
+        if (outbox_read_sector_header(s, &header) && (!found || header.generation > generation)) {
+            generation = header.generation;
+            head_sector = s;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        // The first write formats the sector after this one
+        generation = 0;
+        head_sector = sector_count - 1;
+        head_offset = OUTBOX_SECTOR_SIZE;
+        return;
+    }
+
+    for (uint32_t i = 1; i <= sector_count; i++) {
+        sector = (head_sector + i) % sector_count;
+        if (!outbox_read_sector_header(sector, &header) || header.generation > generation) {
+            continue;
+        }
+
+        end = outbox_restore_sector(outbox, sector);
+        if (sector == head_sector) {
+            head_offset = end;
+        }
+    }
+
+    ESP_LOGI(TAG, "%" PRIu32 " sectors, %u publish(es) restored", sector_count, (unsigned) restored);
+}
+
+static void outbox_open_partition(outbox_handle_t outbox)
+{
+    if (partition_searched) {
+        return;
+    }
+    partition_searched = true;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, OUTBOX_PARTITION_SUBTYPE, CONFIG_UPLINK_MQTT_OUTBOX_PARTITION_LABEL);
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "No \"%s\" partition, unacknowledged publishes will not survive a reboot",
+                 CONFIG_UPLINK_MQTT_OUTBOX_PARTITION_LABEL);
+        return;
+    }
+
+    sector_count = partition->size / OUTBOX_SECTOR_SIZE;
+    if (sector_count < 2 || sector_count > OUTBOX_MAX_SECTORS) {
+        ESP_LOGE(TAG, "Outbox partition needs 2 to %d sectors", OUTBOX_MAX_SECTORS);
+        partition = NULL;
+        return;
+    }
+
+    outbox_restore(outbox);
+}
+
+size_t mqtt_outbox_flash_restored(void)
+{
+    return restored;
+}
+
+outbox_handle_t outbox_init(void)
+{
+    outbox_handle_t outbox = calloc(1, sizeof(struct outbox_t));
+
+    ESP_RETURN_ON_FALSE(outbox != NULL, NULL, TAG, "No memory for the outbox");
+    STAILQ_INIT(&outbox->list);
+    outbox_open_partition(outbox);
+    return outbox;
+}
+
+outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    outbox_item_t *item;
+
+    // The broker would take the PUBACK of one for the other
+    if (message->msg_type == MQTT_MSG_TYPE_PUBLISH && message->msg_qos > 0 && outbox_get(outbox, message->msg_id) != NULL) {
+        ESP_LOGW(TAG, "Message ID %d still pending from before the reboot", message->msg_id);
+        return NULL;
+    }
+
+    item = calloc(1, sizeof(outbox_item_t));
+    ESP_RETURN_ON_FALSE(item != NULL, NULL, TAG, "No memory for message %d", message->msg_id);
+    item->msg_id = message->msg_id;
+    item->msg_type = message->msg_type;
+    item->msg_qos = message->msg_qos;
+    item->tick = tick;
+    item->len = message->len + message->remaining_len;
+    item->pending = QUEUED;
+    item->sector = OUTBOX_NOT_STORED;
+    item->buffer = heap_caps_malloc(item->len, MQTT_OUTBOX_MEMORY);
+    if (item->buffer == NULL) {
+        ESP_LOGE(TAG, "No memory for message %d", message->msg_id);
+        free(item);
+        return NULL;
+    }
+    memcpy(item->buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(item->buffer + message->len, message->remaining_data, message->remaining_len);
+    }
+
+    // Only publishes the broker has to acknowledge are worth keeping
+    if (partition != NULL && item->msg_type == MQTT_MSG_TYPE_PUBLISH && item->msg_qos > 0 &&
+            outbox_persist(item) != ESP_OK) {
+        free(item->buffer);
+        free(item);
+        return NULL;
+    }
+
+    STAILQ_INSERT_TAIL(&outbox->list, item, next);
+    outbox->size += item->len;
+    return item;
+}
+
+outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
+{
+    outbox_item_handle_t item;
+
+    STAILQ_FOREACH(item, &outbox->list, next) {
+        if (item->msg_id == msg_id) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick)
+{
+    outbox_item_handle_t item;
+
+    STAILQ_FOREACH(item, &outbox->list, next) {
+        if (item->pending == pending) {
+            if (tick) {
+                *tick = item->tick;
+            }
+            return item;
+        }
+    }
+    return NULL;
+}
+
+uint8_t *outbox_item_get_data(outbox_item_handle_t item, size_t *len, uint16_t *msg_id, int *msg_type, int *qos)
+{
+    if (item == NULL) {
+        return NULL;
+    }
+
+    *len = item->len;
+    *msg_id = item->msg_id;
+    *msg_type = item->msg_type;
+    *qos = item->msg_qos;
+    return item->buffer;
+}
+
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item_to_delete)
+{
+    outbox_item_handle_t item;
+
+    STAILQ_FOREACH(item, &outbox->list, next) {
+        if (item == item_to_delete) {
+            outbox_free_item(outbox, item);
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
+{
+    outbox_item_handle_t item;
+
+    STAILQ_FOREACH(item, &outbox->list, next) {
+        if (item->msg_id == msg_id && (0xFF & item->msg_type) == msg_type) {
+            outbox_free_item(outbox, item);
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    item->pending = pending;
+    return ESP_OK;
+}
+
+pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
+{
+    return item ? item->pending : QUEUED;
+}
+
+esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    item->tick = tick;
+    return ESP_OK;
+}
+
+int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    outbox_item_handle_t item;
+    int msg_id;
+
+    STAILQ_FOREACH(item, &outbox->list, next) {
+        if (!item->restored && current_tick - item->tick > timeout) {
+            msg_id = item->msg_id;
+            outbox_free_item(outbox, item);
+            return msg_id;
+        }
+    }
+    return -1;
+}
+
+int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    outbox_item_handle_t item;
+    outbox_item_handle_t tmp;
+    int deleted = 0;
+
+    STAILQ_FOREACH_SAFE(item, &outbox->list, next, tmp) {
+        if (!item->restored && current_tick - item->tick > timeout) {
+            outbox_free_item(outbox, item);
+            deleted++;
+        }
+    }
+    return deleted;
+}
+
+uint64_t outbox_get_size(outbox_handle_t outbox)
+{
+    return outbox->size;
+}
+
+void outbox_delete_all_items(outbox_handle_t outbox)
+{
+    outbox_item_handle_t item;
+    outbox_item_handle_t tmp;
+
+    STAILQ_FOREACH_SAFE(item, &outbox->list, next, tmp) {
+        outbox_free_item(outbox, item);
+    }
+}
+
+void outbox_destroy(outbox_handle_t outbox)
+{
+    outbox_delete_all_items(outbox);
+    free(outbox);
+}
@@ -0,0 +1,46 @@
+// mqtt_outbox_flash.h
+#ifndef MQTT_OUTBOX_FLASH_H
+#define MQTT_OUTBOX_FLASH_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Persistent outbox for the MQTT client (CONFIG_MQTT_CUSTOM_OUTBOX),
+ * compiled into the mqtt component by the project CMakeLists.
+ *
+ * It keeps every queued message in RAM like the stock outbox, and also
+ * writes QoS 1 and 2 publishes to a data partition used as a ring of flash
+ * sectors, in the journal's layout: a sector header with a generation
+ * number, then records (magic, length, message ID, type, QoS, CRC-32 and a
+ * state word) each followed by the MQTT packet. Deleting a message clears
+ * its state word in place. A sector is only erased once none of its records
+ * is still pending; when the next sector still holds one, the publish is
+ * refused and the caller keeps the samples another way.
+ *
+ * At startup the pending publishes are read back and queued for sending
+ * once the client connects. Nobody waits for those, so they never expire;
+ * they stay until the broker acknowledges them. A new publish whose message
+ * ID is still held by one of them is refused.
+ *
+ * Only one MQTT client may use it. Without the partition it works from RAM
+ * alone.
+ */
+
+/**
+ * @brief Publishes read back from flash by the outbox, including those
+ * acknowledged since.
+ *
+ * Each of them raises at most one MQTT_EVENT_PUBLISHED on top of the
+ * client's own publishes. Valid once esp_mqtt_client_init() has returned.
+ */
+size_t mqtt_outbox_flash_restored(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MQTT_OUTBOX_FLASH_H
@@ -0,0 +1,535 @@
+#include <stdbool.h>
+#include <string.h>
+#include "cbor.h"
+#include "payload.h"
+#include "sample_codec.h"
+
+#ifdef CONFIG_PAYLOAD_BENCHMARK
+#include <inttypes.h>
+#include "esp_cpu.h"
+#include "esp_log.h"
+#endif
+
+#define PAYLOAD_ARRAY_HEADER_MAX    3       // Array head with a 16-bit length
+#define PAYLOAD_TEMPLATES           4
+#define PAYLOAD_TEMPLATE_MAX        96
+#define PAYLOAD_SLOT_NONE           0       // Offset 0 is always the map head
+
+// Fixed-width CBOR initial bytes: uint8, uint32, negative int32, float32
+#define PAYLOAD_CBOR_UINT8          0x18
+#define PAYLOAD_CBOR_UINT32         0x1A
+#define PAYLOAD_CBOR_NINT32         0x3A
+#define PAYLOAD_CBOR_FLOAT32        0xFA
+
+#ifdef CONFIG_UPLINK_FORMAT_CBOR_TEMPLATE
+#define PAYLOAD_ENCODE_SAMPLE       payload_encode_sample_template
+#else
+#define PAYLOAD_ENCODE_SAMPLE       payload_encode_sample
+#endif
+#define PAYLOAD_COLUMNAR_TIME_RESOLUTION_US 1000
+
+_Static_assert(2 * SENSOR_CHANNEL_COUNT <= SAMPLE_CODEC_MAX_CHANNELS, "Columnar batches carry a value and a spread column per channel");
+
+/**
+ * A sample map serialized once per record layout. Every value sits in a
+ * fixed-width slot, so encoding a sample is a copy plus a few byte stores.
+ * Slots hold offsets of the slot's initial byte.
+ */
+typedef struct {
+    uint32_t shape;
+    uint8_t  len;
+    uint8_t  id_slot;
+    uint8_t  time_slot;
+    uint8_t  value_slots[SENSOR_MAX_RECORDS];
+    uint8_t  spread_slots[SENSOR_MAX_RECORDS];
+    uint8_t  bytes[PAYLOAD_TEMPLATE_MAX];
+} payload_template_t;
+
+// Only the sender encodes, so the row staging area and template cache can be static
+static sample_codec_row_t payload_rows[CONFIG_UPLINK_MAX_BATCH_SAMPLES];
+static payload_template_t payload_templates[PAYLOAD_TEMPLATES];
+static size_t payload_template_next;
+
+// "id" and "time", plus one key per record and one per reported spread
+static size_t payload_sample_keys(const sensor_sample_t *sample)
+{
+    size_t keys = 2;
+
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        keys += (sample->records[i].flags & SENSOR_RECORD_HAS_SPREAD) ? 2 : 1;
+    }
+
+    return keys;
+}
+
+static CborError payload_encode_value(CborEncoder *encoder, const sensor_record_t *record, const sensor_value_t *value)
+{
+    if (record->flags & SENSOR_RECORD_FIXED) {
+        return cbor_encode_int(encoder, value->i);
+    }
+
+    return cbor_encode_float(encoder, value->f);
+}
+
+esp_err_t payload_encode_sample(const sensor_sample_t *sample, time_t timestamp, uint8_t *buf, size_t buf_size, size_t *len_out)
+{
+    CborEncoder encoder;
+    CborEncoder map_encoder;
+    CborError err = CborNoError;
+    const sensor_record_t *record;
+
+    // Initialize CBOR encoders
+    cbor_encoder_init(&encoder, buf, buf_size, 0);
+    err |= cbor_encoder_create_map(&encoder, &map_encoder, payload_sample_keys(sample));
+
+    // Create map -- id:uint
+    err |= cbor_encode_text_stringz(&map_encoder, "id");
+    err |= cbor_encode_uint(&map_encoder, sample->sensor_id);
+
+    // Create map -- <channel key>:float|int for every record
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        record = &sample->records[i];
+        if (record->channel >= SENSOR_CHANNEL_COUNT) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        err |= cbor_encode_text_stringz(&map_encoder, SENSOR_CHANNEL_SCHEMA[record->channel].key);
+        err |= payload_encode_value(&map_encoder, record, &record->value);
+
+        if (record->flags & SENSOR_RECORD_HAS_SPREAD) {
+            err |= cbor_encode_text_stringz(&map_encoder, SENSOR_CHANNEL_SCHEMA[record->channel].spread_key);
+            err |= payload_encode_value(&map_encoder, record, &record->spread);
+        }
+    }
+
+    // Create map -- time:uint64_t
+    err |= cbor_encode_text_stringz(&map_encoder, "time");
+    err |= cbor_encode_uint(&map_encoder, timestamp);
+
+    // Close CBOR container
+    err |= cbor_encoder_close_container(&encoder, &map_encoder);
+
+    if (err != CborNoError) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    *len_out = cbor_encoder_get_buffer_size(&encoder, buf);
+    return ESP_OK;
+}
+
+// Record count plus each record's channel and layout flags; 0 is never a shape
+static uint32_t payload_sample_shape(const sensor_sample_t *sample)
+{
+    uint32_t shape = sample->record_count + 1;
+
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        shape = (shape << 6) | ((sample->records[i].channel & 0x0F) << 2) |
+                (sample->records[i].flags & (SENSOR_RECORD_FIXED | SENSOR_RECORD_HAS_SPREAD));
+    }
+
+    return shape;
+}
+
+_Static_assert(SENSOR_MAX_RECORDS * 6 + 3 <= 32, "Sample shape must fit in 32 bits");
+_Static_assert((SENSOR_RECORD_FIXED | SENSOR_RECORD_HAS_SPREAD) <= 0x03, "Shape packs the layout flags in two bits");
+
+// Appends a text string key; false if it does not fit or needs a long head
+static bool payload_template_key(payload_template_t *tmpl, const char *key)
+{
+    size_t len = strlen(key);
+
+    if (len >= 24 || tmpl->len + 1 + len > PAYLOAD_TEMPLATE_MAX) {
+        return false;
+    }
+
+    tmpl->bytes[tmpl->len++] = 0x60 | len;
+    memcpy(&tmpl->bytes[tmpl->len], key, len);
+    tmpl->len += len;
+    return true;
+}
+
+// Reserves a slot of an initial byte plus width bytes; returns its offset
+static uint8_t payload_template_slot(payload_template_t *tmpl, uint8_t initial, size_t width)
+{
+    uint8_t slot = tmpl->len;
+
+    if (tmpl->len + 1 + width > PAYLOAD_TEMPLATE_MAX) {
+        return PAYLOAD_SLOT_NONE;
+    }
+
+    tmpl->bytes[tmpl->len] = initial;
+    memset(&tmpl->bytes[tmpl->len + 1], 0, width);
+    tmpl->len += 1 + width;
+    return slot;
+}
+
+static uint8_t payload_template_value_slot(payload_template_t *tmpl, const sensor_record_t *record)
+{
+    return payload_template_slot(tmpl, (record->flags & SENSOR_RECORD_FIXED) ? PAYLOAD_CBOR_UINT32 : PAYLOAD_CBOR_FLOAT32, 4);
+}
+
+// Lays out the same keys, in the same order, as payload_encode_sample()
+static bool payload_template_build(const sensor_sample_t *sample, payload_template_t *tmpl)
+{
+    const sensor_record_t *record;
+    size_t keys = payload_sample_keys(sample);
+
+    if (keys >= 24) {
+        return false;
+    }
+
+    memset(tmpl, 0, sizeof(*tmpl));
+    tmpl->bytes[tmpl->len++] = 0xA0 | keys;
+
+    if (!payload_template_key(tmpl, "id") ||
+        (tmpl->id_slot = payload_template_slot(tmpl, PAYLOAD_CBOR_UINT8, 1)) == PAYLOAD_SLOT_NONE) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        record = &sample->records[i];
+        if (record->channel >= SENSOR_CHANNEL_COUNT ||
+            !payload_template_key(tmpl, SENSOR_CHANNEL_SCHEMA[record->channel].key) ||
+            (tmpl->value_slots[i] = payload_template_value_slot(tmpl, record)) == PAYLOAD_SLOT_NONE) {
+            return false;
+        }
+
+        if (record->flags & SENSOR_RECORD_HAS_SPREAD) {
+            if (!payload_template_key(tmpl, SENSOR_CHANNEL_SCHEMA[record->channel].spread_key) ||
+                (tmpl->spread_slots[i] = payload_template_value_slot(tmpl, record)) == PAYLOAD_SLOT_NONE) {
+                return false;
+            }
+        }
+    }
+
+    if (!payload_template_key(tmpl, "time") ||
+        (tmpl->time_slot = payload_template_slot(tmpl, PAYLOAD_CBOR_UINT32, 4)) == PAYLOAD_SLOT_NONE) {
+        return false;
+    }
+
+    tmpl->shape = payload_sample_shape(sample);
+    return true;
+}
+
+// Cached template for the sample's layout, built on first use. Drivers report
+// one or two layouts, so a small round-robin cache never thrashes.
+static const payload_template_t *payload_template_for(const sensor_sample_t *sample)
+{
+    uint32_t shape = payload_sample_shape(sample);
+    payload_template_t *tmpl;
+
+    for (size_t i = 0; i < PAYLOAD_TEMPLATES; i++) {
+        if (payload_templates[i].shape == shape) {
+            return &payload_templates[i];
+        }
+    }
+
+    tmpl = &payload_templates[payload_template_next];
+    if (!payload_template_build(sample, tmpl)) {
+        tmpl->shape = 0;
+        return NULL;
+    }
+
+    payload_template_next = (payload_template_next + 1) % PAYLOAD_TEMPLATES;
+    return tmpl;
+}
+
+static void payload_put_be32(uint8_t *out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static void payload_patch_value(uint8_t *slot, const sensor_record_t *record, const sensor_value_t *value)
+{
+    uint32_t bits;
+
+    if (!(record->flags & SENSOR_RECORD_FIXED)) {
+        memcpy(&bits, &value->f, sizeof(bits));
+    } else if (value->i < 0) {
+        // CBOR negative integers carry -1 - n
+        slot[0] = PAYLOAD_CBOR_NINT32;
+        bits = (uint32_t) (-1 - value->i);
+    } else {
+        slot[0] = PAYLOAD_CBOR_UINT32;
+        bits = (uint32_t) value->i;
+    }
+
+    payload_put_be32(slot + 1, bits);
+}
+
+esp_err_t payload_encode_sample_template(const sensor_sample_t *sample, time_t timestamp, uint8_t *buf, size_t buf_size, size_t *len_out)
+{
+    const payload_template_t *tmpl;
+    const sensor_record_t *record;
+
+    tmpl = (timestamp >= 0 && (uint64_t) timestamp <= UINT32_MAX) ? payload_template_for(sample) : NULL;
+    if (tmpl == NULL) {
+        return payload_encode_sample(sample, timestamp, buf, buf_size, len_out);
+    }
+    if (tmpl->len > buf_size) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    memcpy(buf, tmpl->bytes, tmpl->len);
+    buf[tmpl->id_slot + 1] = sample->sensor_id;
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        record = &sample->records[i];
+        payload_patch_value(&buf[tmpl->value_slots[i]], record, &record->value);
+        if (record->flags & SENSOR_RECORD_HAS_SPREAD) {
+            payload_patch_value(&buf[tmpl->spread_slots[i]], record, &record->spread);
+        }
+    }
+    payload_put_be32(&buf[tmpl->time_slot + 1], (uint32_t) timestamp);
+
+    *len_out = tmpl->len;
+    return ESP_OK;
+}
+
+// CBOR array head (major type 4) for count items
+static size_t payload_array_header(size_t count, uint8_t *out)
+{
+    if (count < 24) {
+        out[0] = 0x80 | count;
+        return 1;
+    }
+    if (count <= UINT8_MAX) {
+        out[0] = 0x98;
+        out[1] = count;
+        return 2;
+    }
+    out[0] = 0x99;
+    out[1] = count >> 8;
+    out[2] = count & 0xFF;
+    return 3;
+}
+
+esp_err_t payload_encode_batch(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                               uint8_t *buf, size_t buf_size, size_t *len_out, size_t *encoded_out)
+{
+    uint8_t header[PAYLOAD_ARRAY_HEADER_MAX];
+    size_t offset = PAYLOAD_ARRAY_HEADER_MAX;
+    size_t header_len;
+    size_t len;
+    size_t n;
+    time_t timestamp;
+    esp_err_t ret = ESP_ERR_NO_MEM;
+
+    if (buf_size <= PAYLOAD_ARRAY_HEADER_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (count > UINT16_MAX) {
+        count = UINT16_MAX;
+    }
+
+    // The count is only known once the budget runs out, so the maps go after
+    // room for the largest array head and are moved up to meet the real one
+    for (n = 0; n < count; n++) {
+        timestamp = (samples[n].acquired_us + epoch_offset_us) / 1000000;
+        ret = PAYLOAD_ENCODE_SAMPLE(&samples[n], timestamp, buf + offset, buf_size - offset, &len);
+        if (ret != ESP_OK) {
+            break;
+        }
+        offset += len;
+    }
+
+    if (n == 0) {
+        return ret;
+    }
+
+    header_len = payload_array_header(n, header);
+    memmove(buf + header_len, buf + PAYLOAD_ARRAY_HEADER_MAX, offset - PAYLOAD_ARRAY_HEADER_MAX);
+    memcpy(buf, header, header_len);
+
+    *len_out = offset - PAYLOAD_ARRAY_HEADER_MAX + header_len;
+    *encoded_out = n;
+    return ESP_OK;
+}
+
+// Flags that decide the column layout; a batch only holds samples that agree on them
+static uint8_t payload_columnar_flags(const sensor_sample_t *sample)
+{
+    uint8_t flags = 0;
+
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        flags |= sample->records[i].flags & (SENSOR_RECORD_FIXED | SENSOR_RECORD_HAS_SPREAD);
+    }
+
+    return flags;
+}
+
+static void payload_columnar_row(const sensor_sample_t *sample, int64_t epoch_offset_us, sample_codec_row_t *row)
+{
+    const sensor_record_t *record;
+
+    memset(row, 0, sizeof(*row));
+    row->time_us = sample->acquired_us + epoch_offset_us;
+    row->sensor_id = sample->sensor_id;
+
+    for (uint8_t i = 0; i < sample->record_count; i++) {
+        record = &sample->records[i];
+        if (record->channel >= SENSOR_CHANNEL_COUNT) {
+            continue;
+        }
+        // Both union members are 32 bits, so the integer view carries either
+        row->values[record->channel] = (uint32_t) record->value.i;
+        row->values[SENSOR_CHANNEL_COUNT + record->channel] = (uint32_t) record->spread.i;
+    }
+}
+
+size_t payload_columnar_rows(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                             sample_codec_params_t *params_out, sample_codec_row_t *rows_out)
+{
+    uint8_t flags;
+    size_t n;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    flags = payload_columnar_flags(&samples[0]);
+    params_out->flags = (flags & SENSOR_RECORD_FIXED) ? 0 : SAMPLE_CODEC_FLAG_XOR;
+    params_out->channel_count = (flags & SENSOR_RECORD_HAS_SPREAD) ? 2 * SENSOR_CHANNEL_COUNT : SENSOR_CHANNEL_COUNT;
+    params_out->time_resolution_us = PAYLOAD_COLUMNAR_TIME_RESOLUTION_US;
+
+    for (n = 0; n < count && payload_columnar_flags(&samples[n]) == flags; n++) {
+        payload_columnar_row(&samples[n], epoch_offset_us, &rows_out[n]);
+    }
+
+    return n;
+}
+
+void payload_columnar_samples(const sample_codec_params_t *params, const sample_codec_row_t *rows, size_t count,
+                              sensor_sample_t *samples_out)
+{
+    uint8_t flags = 0;
+    sensor_record_t *record;
+
+    if (!(params->flags & SAMPLE_CODEC_FLAG_XOR)) {
+        flags |= SENSOR_RECORD_FIXED;
+    }
+    if (params->channel_count > SENSOR_CHANNEL_COUNT) {
+        flags |= SENSOR_RECORD_HAS_SPREAD;
+    }
+
+    for (size_t n = 0; n < count; n++) {
+        memset(&samples_out[n], 0, sizeof(samples_out[n]));
+        samples_out[n].acquired_us = rows[n].time_us;
+        samples_out[n].sensor_id = rows[n].sensor_id;
+        samples_out[n].record_count = SENSOR_CHANNEL_COUNT;
+
+        for (uint8_t ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+            record = &samples_out[n].records[ch];
+            record->channel = ch;
+            record->unit = SENSOR_CHANNEL_SCHEMA[ch].unit;
+            record->flags = flags;
+            record->value.i = (int32_t) rows[n].values[ch];
+            record->spread.i = (int32_t) rows[n].values[SENSOR_CHANNEL_COUNT + ch];
+        }
+    }
+}
+
+esp_err_t payload_encode_columnar(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                                  uint8_t *buf, size_t buf_size, size_t *len_out, size_t *encoded_out)
+{
+    sample_codec_params_t params;
+    size_t n;
+
+    if (count == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (count > CONFIG_UPLINK_MAX_BATCH_SAMPLES) {
+        count = CONFIG_UPLINK_MAX_BATCH_SAMPLES;
+    }
+
+    n = payload_columnar_rows(samples, count, epoch_offset_us, &params, payload_rows);
+    n = sample_codec_fit(&params, payload_rows, n, buf_size);
+    if (n == 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (sample_codec_encode(&params, payload_rows, n, buf, buf_size, len_out) != SAMPLE_CODEC_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    *encoded_out = n;
+    return ESP_OK;
+}
+
+#ifdef CONFIG_PAYLOAD_BENCHMARK
+static const char *PAYLOAD_TAG = "PAYLOAD";
+
+static void payload_benchmark_sample(sensor_sample_t *sample, uint8_t flags)
+{
+    memset(sample, 0, sizeof(*sample));
+    sample->sensor_id = 3;
+    sample->record_count = SENSOR_CHANNEL_COUNT;
+
+    for (uint8_t ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        sample->records[ch].channel = ch;
+        sample->records[ch].unit = SENSOR_CHANNEL_SCHEMA[ch].unit;
+        sample->records[ch].flags = flags;
+        if (flags & SENSOR_RECORD_FIXED) {
+            sample->records[ch].value.i = ch == 0 ? -512 : 4821;
+            sample->records[ch].spread.i = 7;
+        } else {
+            sample->records[ch].value.f = ch == 0 ? -5.12f : 48.21f;
+            sample->records[ch].spread.f = 0.07f;
+        }
+    }
+}
+
+// Every encoder starts from a fresh sample, so all of them time the same
+// sequence of readings
+static uint32_t payload_benchmark_run(esp_err_t (*encode)(const sensor_sample_t *, time_t, uint8_t *, size_t, size_t *),
+                                      uint8_t flags, size_t iterations, uint8_t *buf, size_t buf_size, size_t *len_out)
+{
+    sensor_sample_t sample;
+    uint32_t start;
+    uint32_t cycles = 0;
+
+    payload_benchmark_sample(&sample, flags);
+
+    // The first call builds the template; only steady-state encodes are timed
+    encode(&sample, 1700000000, buf, buf_size, len_out);
+
+    for (size_t i = 0; i < iterations; i++) {
+        // A new reading each time, in the layout's own representation
+        if (flags & SENSOR_RECORD_FIXED) {
+            sample.records[0].value.i = -512 + (int32_t) (i % 100);
+        } else {
+            sample.records[0].value.f = -5.12f + (float) (i % 100) * 0.01f;
+        }
+        start = esp_cpu_get_cycle_count();
+        encode(&sample, 1700000000 + i, buf, buf_size, len_out);
+        cycles += esp_cpu_get_cycle_count() - start;
+    }
+
+    return cycles / iterations;
+}
+
+void payload_benchmark(size_t iterations)
+{
+    static const uint8_t layouts[] = { 0, SENSOR_RECORD_HAS_SPREAD, SENSOR_RECORD_FIXED, SENSOR_RECORD_FIXED | SENSOR_RECORD_HAS_SPREAD };
+    uint8_t buf[PAYLOAD_TEMPLATE_MAX];
+    size_t tinycbor_len;
+    size_t template_len;
+    uint32_t tinycbor_cycles;
+    uint32_t template_cycles;
+    CborParser parser;
+    CborValue value;
+
+    for (size_t i = 0; i < sizeof(layouts); i++) {
+        tinycbor_cycles = payload_benchmark_run(payload_encode_sample, layouts[i], iterations, buf, sizeof(buf), &tinycbor_len);
+        template_cycles = payload_benchmark_run(payload_encode_sample_template, layouts[i], iterations, buf, sizeof(buf), &template_len);
+
+        if (cbor_parser_init(buf, template_len, 0, &parser, &value) != CborNoError ||
+            cbor_value_validate_basic(&value) != CborNoError) {
+            ESP_LOGE(PAYLOAD_TAG, "Template output for layout 0x%02x is not valid CBOR", layouts[i]);
+        }
+
+        ESP_LOGI(PAYLOAD_TAG, "Layout 0x%02x: tinycbor %" PRIu32 " cycles / %u bytes, template %" PRIu32 " cycles / %u bytes",
+                 layouts[i], tinycbor_cycles, (unsigned) tinycbor_len, template_cycles, (unsigned) template_len);
+    }
+}
+#endif
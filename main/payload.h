@@ -0,0 +1,123 @@
+// payload.h
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "esp_err.h"
+#include "sample_codec.h"
+#include "sensor_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Encodes one sample as a CBOR map.
+ *
+ * Keys come from SENSOR_CHANNEL_SCHEMA, so any driver's records are encoded
+ * without sensor-specific code: `{"id": uint, <channel key>: float, ..., "time": uint}`.
+ * Records carrying a burst spread add `<channel spread key>: float`. Records
+ * flagged SENSOR_RECORD_FIXED are sent as CBOR integers instead of floats
+ * (centi-units or raw codes, per CONFIG_SENSOR_VALUE_FORMAT).
+ *
+ * @param sample The sample to encode.
+ * @param timestamp Epoch seconds for the "time" key.
+ * @param buf Output buffer.
+ * @param buf_size Size of @p buf.
+ * @param len_out Receives the number of bytes written.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if @p buf is too small.
+ */
+esp_err_t payload_encode_sample(const sensor_sample_t *sample, time_t timestamp, uint8_t *buf, size_t buf_size, size_t *len_out);
+
+/**
+ * @brief Encodes one sample as the map payload_encode_sample() produces, but
+ * with fixed-width values: "id" as a one-byte uint, "time" as a four-byte
+ * uint, and every value as a float32 or four-byte integer.
+ *
+ * The map skeleton is serialized once per record layout and cached, and each
+ * call copies it and patches the value bytes in place. The result is valid
+ * but not minimally encoded CBOR, a few bytes larger than tinycbor's output
+ * for small integers. Falls back to payload_encode_sample() for layouts that
+ * do not fit a template. Parameters and return values are those of
+ * payload_encode_sample(); only the sender may call it.
+ */
+esp_err_t payload_encode_sample_template(const sensor_sample_t *sample, time_t timestamp, uint8_t *buf, size_t buf_size, size_t *len_out);
+
+/**
+ * @brief Packs as many samples as fit in @p buf_size bytes into one CBOR
+ * array of sample maps, in order.
+ *
+ * Each map is the one payload_encode_sample() produces (or
+ * payload_encode_sample_template() with CONFIG_UPLINK_FORMAT_CBOR_TEMPLATE),
+ * with "time" taken from the sample's own acquisition time, so the receiver
+ * handles a batch as a list of ordinary samples.
+ *
+ * @param samples Samples to pack, oldest first.
+ * @param count Number of samples available.
+ * @param epoch_offset_us Added to each sample's acquired_us to get wall-clock time.
+ * @param buf Output buffer.
+ * @param buf_size Byte budget for the datagram.
+ * @param len_out Receives the number of bytes written.
+ * @param encoded_out Receives how many samples from the front of @p samples were packed.
+ * @return ESP_OK if at least one sample was packed, ESP_ERR_NO_MEM if not
+ *         even the first one fits, or ESP_ERR_INVALID_ARG if the first one
+ *         cannot be encoded.
+ */
+esp_err_t payload_encode_batch(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                               uint8_t *buf, size_t buf_size, size_t *len_out, size_t *encoded_out);
+
+/**
+ * @brief Packs as many samples as fit in @p buf_size bytes into one columnar
+ * batch (see sample_codec.h).
+ *
+ * Column i holds the record for channel i; when the first sample carries
+ * spreads, SENSOR_CHANNEL_COUNT more columns hold them. Fixed-point records
+ * are delta/zigzag coded, float records XOR coded. Timestamps keep
+ * millisecond resolution. A channel a sample has no record for is sent as 0.
+ *
+ * The batch stops early at a sample whose value format or spreads differ from
+ * the first one, so every column is uniform. Parameters and return values are
+ * those of payload_encode_batch().
+ */
+esp_err_t payload_encode_columnar(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                                  uint8_t *buf, size_t buf_size, size_t *len_out, size_t *encoded_out);
+
+/**
+ * @brief Maps samples onto the codec rows payload_encode_columnar() sends.
+ *
+ * @param epoch_offset_us Added to each sample's acquired_us.
+ * @param params_out Receives the column layout.
+ * @param rows_out Room for @p count rows.
+ * @return How many samples were mapped: mapping stops at the first sample
+ *         whose value format or spreads differ from the first one's.
+ */
+size_t payload_columnar_rows(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                             sample_codec_params_t *params_out, sample_codec_row_t *rows_out);
+
+/**
+ * @brief Rebuilds samples from decoded rows, the inverse of
+ * payload_columnar_rows().
+ *
+ * Every sample gets one record per channel, with the unit from
+ * SENSOR_CHANNEL_SCHEMA and acquired_us set to the row's time.
+ */
+void payload_columnar_samples(const sample_codec_params_t *params, const sample_codec_row_t *rows, size_t count,
+                              sensor_sample_t *samples_out);
+
+#ifdef CONFIG_PAYLOAD_BENCHMARK
+/**
+ * @brief Times payload_encode_sample() against payload_encode_sample_template()
+ * for float and fixed-point layouts, with and without spreads, and logs the
+ * mean cycles and bytes per sample. Also checks that the template output is
+ * well-formed CBOR.
+ */
+void payload_benchmark(size_t iterations);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PAYLOAD_H
@@ -0,0 +1,93 @@
+#include <stddef.h>
+#include "rto.h"
+
+#define RTO_GRANULARITY_US  1000
+
+static uint32_t rto_clamp(const rto_estimator_t *rto, int64_t ms)
+{
+    if (ms < rto->min_ms) {
+        return rto->min_ms;
+    }
+    if (ms > rto->max_ms) {
+        return rto->max_ms;
+    }
+    return (uint32_t) ms;
+}
+
+static void rto_update(rto_estimator_t *rto)
+{
+    int64_t variance_us = 4 * rto->rttvar_us;
+
+    if (variance_us < RTO_GRANULARITY_US) {
+        variance_us = RTO_GRANULARITY_US;
+    }
+    rto->rto_ms = rto_clamp(rto, (rto->srtt_us + variance_us + 999) / 1000);
+}
+
+static size_t rto_histogram_bin(int64_t rtt_us)
+{
+    size_t bin = 0;
+
+    while (bin < RTO_HISTOGRAM_BINS - 1 && rtt_us >= (1000LL << bin)) {
+        bin++;
+    }
+    return bin;
+}
+
+void rto_init(rto_estimator_t *rto, uint32_t min_ms, uint32_t max_ms, uint32_t initial_ms)
+{
+    *rto = (rto_estimator_t) {
+        .min_ms = min_ms,
+        .max_ms = max_ms > min_ms ? max_ms : min_ms,
+    };
+    rto->rto_ms = rto_clamp(rto, initial_ms);
+}
+
+void rto_sample(rto_estimator_t *rto, int64_t rtt_us)
+{
+    int64_t error_us;
+
+    if (rtt_us < 0) {
+        return;
+    }
+
+    if (!rto->has_sample) {
+        rto->srtt_us = rtt_us;
+        rto->rttvar_us = rtt_us / 2;
+        rto->min_rtt_us = rtt_us;
+        rto->max_rtt_us = rtt_us;
+        rto->has_sample = true;
+    } else {
+        error_us = rto->srtt_us - rtt_us;
+        if (error_us < 0) {
+            error_us = -error_us;
+        }
+        rto->rttvar_us += (error_us - rto->rttvar_us) / 4;
+        rto->srtt_us += (rtt_us - rto->srtt_us) / 8;
+        if (rtt_us < rto->min_rtt_us) {
+            rto->min_rtt_us = rtt_us;
+        }
+        if (rtt_us > rto->max_rtt_us) {
+            rto->max_rtt_us = rtt_us;
+        }
+    }
+
+    rto->samples++;
+    rto->histogram[rto_histogram_bin(rtt_us)]++;
+    rto->backoffs = 0;
+    rto_update(rto);
+}
+
+void rto_backoff(rto_estimator_t *rto)
+{
+    rto->timeouts++;
+    if (rto->rto_ms < rto->max_ms) {
+        rto->backoffs++;
+        rto->rto_ms = rto_clamp(rto, (int64_t) rto->rto_ms * 2);
+    }
+}
+
+uint32_t rto_timeout_ms(const rto_estimator_t *rto)
+{
+    return rto->rto_ms;
+}
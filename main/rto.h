@@ -0,0 +1,67 @@
+// rto.h
+#ifndef RTO_H
+#define RTO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Retransmission timeout estimator after RFC 6298 (Jacobson/Karels):
+ *
+ *   first sample R:  SRTT = R, RTTVAR = R / 2
+ *   later samples:   RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+ *   RTO = SRTT + max(1 ms, 4 RTTVAR), clamped to [min, max]
+ *
+ * Every expired timer doubles the RTO (up to max) until the next valid
+ * sample. Callers apply Karn's rule: only datagrams acknowledged after a
+ * single transmission give samples. Plain C with no ESP-IDF dependencies.
+ */
+
+/** Histogram bin i counts RTTs below 2^i ms; the last bin takes the rest. */
+#define RTO_HISTOGRAM_BINS  12
+
+typedef struct {
+    uint32_t min_ms;
+    uint32_t max_ms;
+    int64_t  srtt_us;
+    int64_t  rttvar_us;
+    uint32_t rto_ms;                // Backoff included
+    uint8_t  backoffs;              // Doublings since the last sample
+    bool     has_sample;
+    uint32_t samples;
+    uint32_t timeouts;
+    int64_t  min_rtt_us;
+    int64_t  max_rtt_us;
+    uint32_t histogram[RTO_HISTOGRAM_BINS];
+} rto_estimator_t;
+
+/**
+ * @brief Starts an estimator at @p initial_ms, with no samples.
+ */
+void rto_init(rto_estimator_t *rto, uint32_t min_ms, uint32_t max_ms, uint32_t initial_ms);
+
+/**
+ * @brief Folds in one round-trip time and clears the backoff.
+ */
+void rto_sample(rto_estimator_t *rto, int64_t rtt_us);
+
+/**
+ * @brief Doubles the RTO, up to the maximum, after a retransmission timer
+ * expired.
+ */
+void rto_backoff(rto_estimator_t *rto);
+
+/**
+ * @brief The timeout to arm for the next transmission.
+ */
+uint32_t rto_timeout_ms(const rto_estimator_t *rto);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RTO_H
@@ -0,0 +1,335 @@
+#include <string.h>
+#include "sample_codec.h"
+
+#define SAMPLE_CODEC_VARINT_MAX     10
+
+typedef struct {
+    uint8_t *buf;
+    size_t  size;
+    size_t  pos;
+    int     overflow;
+} codec_writer_t;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t        len;
+    size_t        pos;
+    int           corrupt;
+} codec_reader_t;
+
+static uint64_t zigzag_encode(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static size_t varint_len(uint64_t v)
+{
+    size_t len = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        len++;
+    }
+
+    return len;
+}
+
+static void put_u8(codec_writer_t *w, uint8_t v)
+{
+    if (w->pos >= w->size) {
+        w->overflow = 1;
+        return;
+    }
+    w->buf[w->pos++] = v;
+}
+
+static void put_varint(codec_writer_t *w, uint64_t v)
+{
+    while (v >= 0x80) {
+        put_u8(w, (uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    put_u8(w, (uint8_t) v);
+}
+
+static uint8_t get_u8(codec_reader_t *r)
+{
+    if (r->pos >= r->len) {
+        r->corrupt = 1;
+        return 0;
+    }
+    return r->buf[r->pos++];
+}
+
+static uint64_t get_varint(codec_reader_t *r)
+{
+    uint64_t v = 0;
+    uint8_t byte;
+
+    for (int shift = 0; shift < 7 * SAMPLE_CODEC_VARINT_MAX; shift += 7) {
+        byte = get_u8(r);
+        v |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return v;
+        }
+    }
+
+    r->corrupt = 1;
+    return 0;
+}
+
+// Byte-aligned take on Gorilla: an unchanged value costs one zero byte,
+// otherwise a control byte (leading zero bytes << 4 | significant bytes)
+// followed by the significant bytes of the XOR, most significant first
+static size_t xor_len(uint32_t x)
+{
+    size_t len = 4;
+
+    if (x == 0) {
+        return 1;
+    }
+    while (!(x & 0xFF000000u)) {
+        x <<= 8;
+        len--;
+    }
+    while (!(x & 0x000000FFu) && len > 1) {
+        x >>= 8;
+        len--;
+    }
+
+    return 1 + len;
+}
+
+static void put_xor(codec_writer_t *w, uint32_t x)
+{
+    uint8_t lead = 0;
+    uint8_t trail = 0;
+    uint8_t len;
+
+    if (x == 0) {
+        put_u8(w, 0);
+        return;
+    }
+
+    while (!((x << (8 * lead)) & 0xFF000000u)) {
+        lead++;
+    }
+    while (!((x >> (8 * trail)) & 0xFFu)) {
+        trail++;
+    }
+    len = 4 - lead - trail;
+
+    put_u8(w, (uint8_t) (lead << 4 | len));
+    for (int i = len - 1; i >= 0; i--) {
+        put_u8(w, (uint8_t) (x >> (8 * (trail + i))));
+    }
+}
+
+static uint32_t get_xor(codec_reader_t *r)
+{
+    uint8_t control = get_u8(r);
+    uint8_t lead = control >> 4;
+    uint8_t len = control & 0x0F;
+    uint32_t x = 0;
+
+    if (control == 0) {
+        return 0;
+    }
+    if (len == 0 || lead + len > 4) {
+        r->corrupt = 1;
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < len; i++) {
+        x = (x << 8) | get_u8(r);
+    }
+
+    return x << (8 * (4 - lead - len));
+}
+
+static int64_t quantize_time(const sample_codec_params_t *params, int64_t time_us)
+{
+    int64_t q = time_us / (int64_t) params->time_resolution_us;
+
+    // Round towards negative infinity so deltas stay consistent before 1970 too
+    if (time_us < 0 && q * (int64_t) params->time_resolution_us != time_us) {
+        q--;
+    }
+    return q;
+}
+
+static size_t header_len(const sample_codec_params_t *params, size_t count, int64_t base)
+{
+    return 4 + varint_len(count) + varint_len(params->time_resolution_us) + varint_len(zigzag_encode(base));
+}
+
+// Bytes row i adds to every column, given the row before it
+static size_t row_len(const sample_codec_params_t *params, const sample_codec_row_t *rows, size_t i, int64_t prev_time)
+{
+    size_t len = 1;     // Sensor ID
+    int64_t time = quantize_time(params, rows[i].time_us);
+    uint32_t prev;
+
+    len += varint_len(zigzag_encode(time - prev_time));
+
+    for (uint8_t ch = 0; ch < params->channel_count; ch++) {
+        prev = i > 0 ? rows[i - 1].values[ch] : 0;
+        if (params->flags & SAMPLE_CODEC_FLAG_XOR) {
+            len += xor_len(rows[i].values[ch] ^ prev);
+        } else {
+            len += varint_len(zigzag_encode((int64_t) (int32_t) rows[i].values[ch] - (int32_t) prev));
+        }
+    }
+
+    return len;
+}
+
+static int params_valid(const sample_codec_params_t *params)
+{
+    return params->channel_count <= SAMPLE_CODEC_MAX_CHANNELS && params->time_resolution_us > 0;
+}
+
+size_t sample_codec_fit(const sample_codec_params_t *params, const sample_codec_row_t *rows, size_t count, size_t budget)
+{
+    int64_t base;
+    int64_t prev_time;
+    size_t used;
+    size_t n;
+
+    if (count == 0 || !params_valid(params)) {
+        return 0;
+    }
+
+    base = quantize_time(params, rows[0].time_us);
+    prev_time = base;
+    used = 0;
+
+    for (n = 0; n < count; n++) {
+        used += row_len(params, rows, n, prev_time);
+        if (header_len(params, n + 1, base) + used > budget) {
+            break;
+        }
+        prev_time = quantize_time(params, rows[n].time_us);
+    }
+
+    return n;
+}
+
+sample_codec_err_t sample_codec_encode(const sample_codec_params_t *params, const sample_codec_row_t *rows, size_t count,
+                                       uint8_t *buf, size_t buf_size, size_t *len_out)
+{
+    codec_writer_t w = { .buf = buf, .size = buf_size };
+    int64_t base;
+    int64_t prev_time;
+    int64_t time;
+    uint32_t prev;
+
+    if (count == 0 || !params_valid(params)) {
+        return SAMPLE_CODEC_ERR_ARG;
+    }
+
+    base = quantize_time(params, rows[0].time_us);
+
+    put_u8(&w, SAMPLE_CODEC_MAGIC);
+    put_u8(&w, SAMPLE_CODEC_VERSION);
+    put_u8(&w, params->flags);
+    put_u8(&w, params->channel_count);
+    put_varint(&w, count);
+    put_varint(&w, params->time_resolution_us);
+    put_varint(&w, zigzag_encode(base));
+
+    for (size_t i = 0; i < count; i++) {
+        put_u8(&w, rows[i].sensor_id);
+    }
+
+    prev_time = base;
+    for (size_t i = 0; i < count; i++) {
+        time = quantize_time(params, rows[i].time_us);
+        put_varint(&w, zigzag_encode(time - prev_time));
+        prev_time = time;
+    }
+
+    for (uint8_t ch = 0; ch < params->channel_count; ch++) {
+        prev = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (params->flags & SAMPLE_CODEC_FLAG_XOR) {
+                put_xor(&w, rows[i].values[ch] ^ prev);
+            } else {
+                put_varint(&w, zigzag_encode((int64_t) (int32_t) rows[i].values[ch] - (int32_t) prev));
+            }
+            prev = rows[i].values[ch];
+        }
+    }
+
+    if (w.overflow) {
+        return SAMPLE_CODEC_ERR_NO_SPACE;
+    }
+
+    *len_out = w.pos;
+    return SAMPLE_CODEC_OK;
+}
+
+sample_codec_err_t sample_codec_decode(const uint8_t *buf, size_t len, sample_codec_params_t *params_out,
+                                       sample_codec_row_t *rows_out, size_t max_rows, size_t *count_out)
+{
+    codec_reader_t r = { .buf = buf, .len = len };
+    sample_codec_params_t params;
+    uint64_t count;
+    uint64_t time;
+    uint32_t prev;
+
+    if (get_u8(&r) != SAMPLE_CODEC_MAGIC || get_u8(&r) != SAMPLE_CODEC_VERSION) {
+        return SAMPLE_CODEC_ERR_CORRUPT;
+    }
+
+    params.flags = get_u8(&r);
+    params.channel_count = get_u8(&r);
+    count = get_varint(&r);
+    params.time_resolution_us = (uint32_t) get_varint(&r);
+    time = (uint64_t) zigzag_decode(get_varint(&r));
+
+    if (r.corrupt || !params_valid(&params)) {
+        return SAMPLE_CODEC_ERR_CORRUPT;
+    }
+    if (count > max_rows) {
+        return SAMPLE_CODEC_ERR_NO_SPACE;
+    }
+
+    memset(rows_out, 0, (size_t) count * sizeof(*rows_out));
+
+    for (size_t i = 0; i < count; i++) {
+        rows_out[i].sensor_id = get_u8(&r);
+    }
+
+    // Unsigned, modulo 2^64 and 2^32: the input is untrusted, and a
+    // well-formed batch never wraps
+    for (size_t i = 0; i < count; i++) {
+        time += (uint64_t) zigzag_decode(get_varint(&r));
+        rows_out[i].time_us = (int64_t) (time * params.time_resolution_us);
+    }
+
+    for (uint8_t ch = 0; ch < params.channel_count; ch++) {
+        prev = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (params.flags & SAMPLE_CODEC_FLAG_XOR) {
+                prev ^= get_xor(&r);
+            } else {
+                prev += (uint32_t) zigzag_decode(get_varint(&r));
+            }
+            rows_out[i].values[ch] = prev;
+        }
+    }
+
+    if (r.corrupt) {
+        return SAMPLE_CODEC_ERR_CORRUPT;
+    }
+
+    *params_out = params;
+    *count_out = (size_t) count;
+    return SAMPLE_CODEC_OK;
+}
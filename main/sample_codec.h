@@ -0,0 +1,89 @@
+// sample_codec.h
+#ifndef SAMPLE_CODEC_H
+#define SAMPLE_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Compact columnar batch format. Plain C with no ESP-IDF dependencies, so the
+ * collector can compile this file as is and decode what the firmware sends.
+ *
+ * Layout, all integers LEB128 varints unless noted:
+ *
+ *   magic (u8 0xFF, never a valid first CBOR byte), version (u8), flags (u8),
+ *   channel count (u8), row count, time resolution in us,
+ *   base time (zigzag, in resolution units),
+ *   sensor ID column: one u8 per row,
+ *   time column: zigzag deltas from the previous row,
+ *   one column per channel: zigzag deltas of the quantized integers, or with
+ *   SAMPLE_CODEC_FLAG_XOR, byte-aligned XOR coding of 32-bit float patterns.
+ *
+ * Deltas are taken against the previous row, so rows grouped by sensor and
+ * ordered by time compress best.
+ */
+
+#define SAMPLE_CODEC_MAGIC          0xFF
+#define SAMPLE_CODEC_VERSION        1
+#define SAMPLE_CODEC_MAX_CHANNELS   4
+
+#define SAMPLE_CODEC_FLAG_XOR       0x01    // Channel values are IEEE-754 float bit patterns
+
+/** Upper bound on the encoded size of @p rows rows, for sizing buffers. */
+#define SAMPLE_CODEC_MAX_SIZE(rows) (4 + 5 + 5 + 10 + (rows) * (1 + 10 + 5 * SAMPLE_CODEC_MAX_CHANNELS))
+
+typedef enum {
+    SAMPLE_CODEC_OK = 0,
+    SAMPLE_CODEC_ERR_NO_SPACE,      // Output buffer too small
+    SAMPLE_CODEC_ERR_CORRUPT,       // Truncated or malformed input
+    SAMPLE_CODEC_ERR_ARG,
+} sample_codec_err_t;
+
+typedef struct {
+    int64_t  time_us;
+    uint8_t  sensor_id;
+    uint32_t values[SAMPLE_CODEC_MAX_CHANNELS];    // int32 readings, or float bits with SAMPLE_CODEC_FLAG_XOR
+} sample_codec_row_t;
+
+typedef struct {
+    uint8_t  flags;
+    uint8_t  channel_count;
+    uint32_t time_resolution_us;    // Timestamps are rounded down to multiples of this
+} sample_codec_params_t;
+
+/**
+ * @brief Returns how many leading rows fit in @p budget bytes.
+ *
+ * Each row's cost is independent of the rows after it, so this is a single
+ * pass; pass the result to sample_codec_encode().
+ */
+size_t sample_codec_fit(const sample_codec_params_t *params, const sample_codec_row_t *rows, size_t count, size_t budget);
+
+/**
+ * @brief Encodes @p count rows.
+ *
+ * @param len_out Receives the number of bytes written.
+ */
+sample_codec_err_t sample_codec_encode(const sample_codec_params_t *params, const sample_codec_row_t *rows, size_t count,
+                                       uint8_t *buf, size_t buf_size, size_t *len_out);
+
+/**
+ * @brief Decodes a batch.
+ *
+ * @param params_out Receives the batch's parameters.
+ * @param rows_out Receives up to @p max_rows rows, time_us in microseconds.
+ * @param count_out Receives the number of rows decoded.
+ * @return SAMPLE_CODEC_ERR_NO_SPACE if the batch holds more than @p max_rows rows.
+ */
+sample_codec_err_t sample_codec_decode(const uint8_t *buf, size_t len, sample_codec_params_t *params_out,
+                                       sample_codec_row_t *rows_out, size_t max_rows, size_t *count_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SAMPLE_CODEC_H
@@ -0,0 +1,131 @@
+#include <inttypes.h>
+#include <string.h>
+#include "esp_check.h"
+#include "sample_ring.h"
+
+const static char *TAG = "SAMPLE_RING";
+
+esp_err_t sample_ring_init(sample_ring_t *ring, sensor_sample_t *slots, uint32_t capacity,
+                           sample_ring_policy_t policy, TickType_t block_ticks)
+{
+    ESP_RETURN_ON_FALSE(capacity > 0 && (capacity & (capacity - 1)) == 0, ESP_ERR_INVALID_ARG, TAG,
+                        "Ring capacity %" PRIu32 " is not a power of two", capacity);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->slots = slots;
+    ring->mask = capacity - 1;
+    ring->policy = policy;
+    ring->block_ticks = block_ticks;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->blocked_producer, NULL);
+    atomic_init(&ring->overwritten, 0);
+
+    return ESP_OK;
+}
+
+void sample_ring_set_consumer(sample_ring_t *ring, TaskHandle_t consumer, uint32_t wake_threshold)
+{
+    ring->consumer = consumer;
+    ring->wake_threshold = wake_threshold;
+}
+
+// Makes room in a full ring according to its policy. Returns false if the
+// sample has to be dropped.
+static bool sample_ring_make_room(sample_ring_t *ring, uint32_t head, uint32_t tail)
+{
+    TaskHandle_t self;
+
+    switch (ring->policy) {
+    case SAMPLE_RING_OVERWRITE_OLDEST:
+        // Losing this race means the consumer just freed the slot itself
+        if (atomic_compare_exchange_strong(&ring->tail, &tail, tail + 1)) {
+            atomic_fetch_add_explicit(&ring->overwritten, 1, memory_order_relaxed);
+        }
+        return true;
+
+    case SAMPLE_RING_BLOCK:
+        self = xTaskGetCurrentTaskHandle();
+        ulTaskNotifyValueClearIndexed(self, SAMPLE_RING_NOTIFY_INDEX, UINT32_MAX);
+        atomic_store(&ring->blocked_producer, self);
+
+        // Re-check after publishing the handle so a pop in between is not missed
+        if (head - atomic_load(&ring->tail) > ring->mask) {
+            ulTaskNotifyTakeIndexed(SAMPLE_RING_NOTIFY_INDEX, pdTRUE, ring->block_ticks);
+        }
+
+        atomic_store(&ring->blocked_producer, NULL);
+        return head - atomic_load(&ring->tail) <= ring->mask;
+
+    case SAMPLE_RING_DROP_NEWEST:
+    default:
+        return false;
+    }
+}
+
+esp_err_t sample_ring_push(sample_ring_t *ring, const sensor_sample_t *sample)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t used;
+
+    if (head - tail > ring->mask && !sample_ring_make_room(ring, head, tail)) {
+        ring->dropped++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    ring->slots[head & ring->mask] = *sample;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    ring->pushed++;
+
+    used = head + 1 - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (used > ring->high_water) {
+        ring->high_water = used;
+    }
+
+    if (ring->consumer && (used == 1 || used == ring->wake_threshold)) {
+        xTaskNotifyGiveIndexed(ring->consumer, SAMPLE_RING_WAKE_NOTIFY_INDEX);
+    }
+
+    return ESP_OK;
+}
+
+bool sample_ring_pop(sample_ring_t *ring, sensor_sample_t *sample_out)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    TaskHandle_t producer;
+
+    do {
+        if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+            return false;
+        }
+        *sample_out = ring->slots[tail & ring->mask];
+        // Fails only if an overwriting producer moved tail past this slot
+        // while it was being copied; the copy is stale, take the next one
+    } while (!atomic_compare_exchange_weak(&ring->tail, &tail, tail + 1));
+
+    ring->popped++;
+
+    producer = atomic_load(&ring->blocked_producer);
+    if (producer) {
+        xTaskNotifyGiveIndexed(producer, SAMPLE_RING_NOTIFY_INDEX);
+    }
+
+    return true;
+}
+
+uint32_t sample_ring_count(sample_ring_t *ring)
+{
+    return atomic_load(&ring->head) - atomic_load(&ring->tail);
+}
+
+void sample_ring_get_stats(sample_ring_t *ring, sample_ring_stats_t *stats_out)
+{
+    *stats_out = (sample_ring_stats_t) {
+        .pushed = ring->pushed,
+        .popped = ring->popped,
+        .dropped = ring->dropped,
+        .overwritten = atomic_load(&ring->overwritten),
+        .high_water = ring->high_water,
+    };
+}
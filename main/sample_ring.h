@@ -0,0 +1,115 @@
+// sample_ring.h
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "sensor_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Notification slot a producer blocked on a full ring waits on. */
+#define SAMPLE_RING_NOTIFY_INDEX    2
+
+/** Notification slot the consumer is woken on, see sample_ring_set_consumer(). */
+#define SAMPLE_RING_WAKE_NOTIFY_INDEX   0
+
+typedef enum {
+    SAMPLE_RING_OVERWRITE_OLDEST,   // A full ring discards its oldest sample
+    SAMPLE_RING_DROP_NEWEST,        // A full ring rejects the new sample
+    SAMPLE_RING_BLOCK,              // The producer waits for space, up to a timeout
+} sample_ring_policy_t;
+
+typedef struct {
+    uint32_t pushed;
+    uint32_t popped;
+    uint32_t dropped;               // Rejected under DROP_NEWEST or after a BLOCK timeout
+    uint32_t overwritten;           // Discarded under OVERWRITE_OLDEST
+    uint32_t high_water;            // Highest fill level seen
+} sample_ring_stats_t;
+
+/**
+ * Single-producer/single-consumer ring of samples. Indices run freely and are
+ * masked on access, so the capacity must be a power of two. The producer only
+ * ever writes @c head and the consumer @c tail, except that an overwriting
+ * producer may advance @c tail with a compare-and-swap; the consumer detects
+ * that and retries, so neither side takes a lock.
+ */
+typedef struct {
+    sensor_sample_t             *slots;
+    uint32_t                    mask;
+    sample_ring_policy_t        policy;
+    TickType_t                  block_ticks;
+    _Atomic uint32_t            head;
+    _Atomic uint32_t            tail;
+    _Atomic(TaskHandle_t)       blocked_producer;
+    TaskHandle_t                consumer;
+    uint32_t                    wake_threshold;
+    uint32_t                    pushed;         // Producer-owned counters
+    uint32_t                    dropped;
+    uint32_t                    high_water;
+    _Atomic uint32_t            overwritten;
+    uint32_t                    popped;         // Consumer-owned
+} sample_ring_t;
+
+/**
+ * @brief Prepares a ring over caller-provided storage.
+ *
+ * @param slots Storage for @p capacity samples; must outlive the ring.
+ * @param capacity Number of slots, a power of two.
+ * @param block_ticks How long a BLOCK producer waits for space.
+ * @return ESP_OK, or ESP_ERR_INVALID_ARG if @p capacity is not a power of two.
+ */
+esp_err_t sample_ring_init(sample_ring_t *ring, sensor_sample_t *slots, uint32_t capacity,
+                           sample_ring_policy_t policy, TickType_t block_ticks);
+
+/**
+ * @brief Registers the task that drains the ring, so pushes can wake it.
+ *
+ * A push notifies @p consumer on SAMPLE_RING_WAKE_NOTIFY_INDEX only when it
+ * matters: the ring goes from empty to non-empty (so the consumer can arm
+ * its latency deadline) or the fill level reaches @p wake_threshold. Call
+ * before the producer starts.
+ */
+void sample_ring_set_consumer(sample_ring_t *ring, TaskHandle_t consumer, uint32_t wake_threshold);
+
+/**
+ * @brief Adds a sample. Producer side only.
+ *
+ * Wait-free while the ring has room: one copy and one release store, plus a
+ * task notification when a wake condition is met.
+ *
+ * @return ESP_OK if the sample was stored (possibly overwriting the oldest
+ *         one), ESP_ERR_NO_MEM if it was dropped.
+ */
+esp_err_t sample_ring_push(sample_ring_t *ring, const sensor_sample_t *sample);
+
+/**
+ * @brief Takes the oldest sample without blocking. Consumer side only.
+ *
+ * @return true if @p sample_out was filled, false if the ring is empty.
+ */
+bool sample_ring_pop(sample_ring_t *ring, sensor_sample_t *sample_out);
+
+/**
+ * @brief Returns the number of samples currently queued.
+ */
+uint32_t sample_ring_count(sample_ring_t *ring);
+
+/**
+ * @brief Copies the counters. Each one has a single writer, so this is safe
+ * from any task; the copy is not a consistent snapshot across fields.
+ */
+void sample_ring_get_stats(sample_ring_t *ring, sample_ring_stats_t *stats_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SAMPLE_RING_H
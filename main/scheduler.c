@@ -0,0 +1,87 @@
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "scheduler.h"
+
+const static char *TAG = "SCHEDULER";
+
+static esp_timer_handle_t period_timer;
+static TaskHandle_t sampler;
+static int64_t start_us;
+static uint64_t period_us;
+static uint64_t next_boundary;      // Index of the boundary the task waits for next
+static scheduler_stats_t stats;
+
+static void scheduler_on_period(void *arg)
+{
+    xTaskNotifyGiveIndexed(sampler, SCHEDULER_NOTIFY_INDEX);
+}
+
+esp_err_t scheduler_start(uint64_t period)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = scheduler_on_period,
+        .name = "sample_period",
+    };
+
+    ESP_RETURN_ON_FALSE(period > 0, ESP_ERR_INVALID_ARG, TAG, "Sampling period must be non-zero");
+
+    sampler = xTaskGetCurrentTaskHandle();
+    period_us = period;
+    next_boundary = 0;
+    stats = (scheduler_stats_t) { 0 };
+
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &period_timer), TAG, "Unable to create period timer");
+    start_us = esp_timer_get_time();
+    ESP_RETURN_ON_ERROR(esp_timer_start_periodic(period_timer, period_us), TAG, "Unable to start period timer");
+
+    // The first period starts right away
+    xTaskNotifyGiveIndexed(sampler, SCHEDULER_NOTIFY_INDEX);
+    return ESP_OK;
+}
+
+void scheduler_wait(int64_t *boundary_us_out)
+{
+    uint32_t ticks;
+    uint64_t boundary;
+    int64_t boundary_us;
+    int32_t jitter_us;
+
+    ticks = ulTaskNotifyTakeIndexed(SCHEDULER_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+
+    // Every boundary but the most recent one went by while the task was busy
+    boundary = next_boundary + ticks - 1;
+    next_boundary = boundary + 1;
+    stats.missed += ticks - 1;
+
+    boundary_us = start_us + (int64_t) (boundary * period_us);
+    jitter_us = (int32_t) (esp_timer_get_time() - boundary_us);
+
+    stats.last_jitter_us = jitter_us;
+    if (stats.periods == 0 || jitter_us < stats.min_jitter_us) {
+        stats.min_jitter_us = jitter_us;
+    }
+    if (stats.periods == 0 || jitter_us > stats.max_jitter_us) {
+        stats.max_jitter_us = jitter_us;
+    }
+    stats.mean_jitter_us = stats.periods == 0 ? jitter_us : stats.mean_jitter_us + (jitter_us - stats.mean_jitter_us) / 16;
+    stats.periods++;
+
+    if (boundary_us_out) {
+        *boundary_us_out = boundary_us;
+    }
+}
+
+void scheduler_get_stats(scheduler_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
+
+void scheduler_log_stats(void)
+{
+    ESP_LOGI(TAG, "%" PRIu32 " periods, %" PRIu32 " missed, jitter last %" PRId32 " us, min %" PRId32 " us, max %" PRId32 " us, mean %" PRId32 " us",
+             stats.periods, stats.missed, stats.last_jitter_us, stats.min_jitter_us, stats.max_jitter_us, stats.mean_jitter_us);
+}
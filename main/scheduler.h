@@ -0,0 +1,63 @@
+// scheduler.h
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Notification slot used to release the sampling task. Slot 0 belongs to the
+ * sensor drivers' completion wakeups, which must not eat period ticks.
+ */
+#define SCHEDULER_NOTIFY_INDEX  1
+
+typedef struct {
+    uint32_t periods;           // Boundaries the task has woken up for
+    uint32_t missed;            // Boundaries that passed while the task was still busy
+    int32_t  last_jitter_us;    // Wake-up time minus boundary, for the last period
+    int32_t  min_jitter_us;
+    int32_t  max_jitter_us;
+    int32_t  mean_jitter_us;    // EMA, alpha = 1/16
+} scheduler_stats_t;
+
+/**
+ * @brief Starts a periodic esp_timer that releases the calling task on exact
+ * multiples of @p period_us from now.
+ *
+ * The timer is re-armed from its own alarm time, not from when the task gets
+ * around to running, so the period does not drift with acquisition time or
+ * tick rounding.
+ *
+ * @return ESP_OK, or the esp_timer error.
+ */
+esp_err_t scheduler_start(uint64_t period_us);
+
+/**
+ * @brief Blocks until the next period boundary and records the wake-up jitter.
+ *
+ * If the task overran one or more boundaries it returns immediately and the
+ * overrun is counted as missed periods.
+ *
+ * @param boundary_us_out Optional; receives the esp_timer time of the boundary.
+ */
+void scheduler_wait(int64_t *boundary_us_out);
+
+/**
+ * @brief Copies the jitter statistics gathered so far.
+ */
+void scheduler_get_stats(scheduler_stats_t *stats_out);
+
+/**
+ * @brief Logs the jitter statistics.
+ */
+void scheduler_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SCHEDULER_H
@@ -0,0 +1,22 @@
+#include "sensor_driver.h"
+
+const sensor_channel_schema_t SENSOR_CHANNEL_SCHEMA[SENSOR_CHANNEL_COUNT] = {
+    [SENSOR_CHANNEL_TEMPERATURE] = { .key = "temp_c", .spread_key = "temp_c_sprd", .unit = SENSOR_UNIT_CELSIUS },
+    [SENSOR_CHANNEL_HUMIDITY]    = { .key = "hmd",    .spread_key = "hmd_sprd",    .unit = SENSOR_UNIT_PERCENT_RH },
+};
+
+int32_t sensor_code_delta_to_centi(const sensor_raw_channel_t *raw, int32_t delta)
+{
+    int64_t scaled = (int64_t) delta * raw->centi_mul;
+
+    if (raw->centi_shift > 0) {
+        scaled = (scaled + ((int64_t) 1 << (raw->centi_shift - 1))) >> raw->centi_shift;
+    }
+
+    return (int32_t) scaled;
+}
+
+int32_t sensor_code_to_centi(const sensor_raw_channel_t *raw, int32_t code)
+{
+    return sensor_code_delta_to_centi(raw, code) + raw->centi_offset;
+}
@@ -0,0 +1,144 @@
+// sensor_driver.h
+#ifndef SENSOR_DRIVER_H
+#define SENSOR_DRIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_bit_defs.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SENSOR_MAX_RECORDS  4
+
+typedef enum {
+    SENSOR_UNIT_CELSIUS,
+    SENSOR_UNIT_PERCENT_RH,
+} sensor_unit_t;
+
+/**
+ * Every quantity any driver can report. Adding a sensor type that measures
+ * something new means adding a channel here and a row to SENSOR_CHANNEL_SCHEMA.
+ */
+typedef enum {
+    SENSOR_CHANNEL_TEMPERATURE,
+    SENSOR_CHANNEL_HUMIDITY,
+    SENSOR_CHANNEL_COUNT,
+} sensor_channel_t;
+
+typedef struct {
+    const char    *key;         // Key used for the channel on the wire
+    const char    *spread_key;  // Key for the channel's burst spread, when reported
+    sensor_unit_t unit;
+} sensor_channel_schema_t;
+
+extern const sensor_channel_schema_t SENSOR_CHANNEL_SCHEMA[SENSOR_CHANNEL_COUNT];
+
+#define SENSOR_RECORD_HAS_SPREAD    BIT0
+#define SENSOR_RECORD_FIXED         BIT1    // value and spread hold integers, see sensor_value_t
+
+/**
+ * A float in the channel's unit, or an integer when the record carries
+ * SENSOR_RECORD_FIXED: centi-units or the sensor's raw code, as selected by
+ * CONFIG_SENSOR_VALUE_FORMAT.
+ */
+typedef union {
+    float   f;
+    int32_t i;
+} sensor_value_t;
+
+typedef struct {
+    uint8_t        channel;     // sensor_channel_t
+    uint8_t        unit;        // sensor_unit_t
+    uint8_t        flags;       // SENSOR_RECORD_* bits
+    sensor_value_t value;
+    sensor_value_t spread;      // Max - min over an oversampled burst, same representation as value
+} sensor_record_t;
+
+/**
+ * A channel the driver can hand out as an unconverted integer code, with the
+ * linear conversion to its unit: value = code * scale + offset. The same
+ * conversion in fixed point gives centi-units:
+ * centi = ((code * centi_mul) >> centi_shift) + centi_offset.
+ */
+typedef struct {
+    uint8_t channel;        // sensor_channel_t
+    float   scale;
+    float   offset;
+    int32_t centi_mul;
+    uint8_t centi_shift;
+    int32_t centi_offset;
+} sensor_raw_channel_t;
+
+/**
+ * @brief Converts a raw code to centi-units with integer arithmetic only,
+ * rounding to nearest.
+ */
+int32_t sensor_code_to_centi(const sensor_raw_channel_t *raw, int32_t code);
+
+/**
+ * @brief Converts a difference between two raw codes to centi-units.
+ */
+int32_t sensor_code_delta_to_centi(const sensor_raw_channel_t *raw, int32_t delta);
+
+/**
+ * One reading from one sensor, as it travels through the pipeline. The flash
+ * journal stores it as is: a layout change needs a JOURNAL_FORMAT_VERSION bump.
+ */
+typedef struct {
+    int64_t         acquired_us;    // esp_timer time at which the reading was taken
+    uint8_t         sensor_id;
+    uint8_t         record_count;
+    sensor_record_t records[SENSOR_MAX_RECORDS];
+} sensor_sample_t;
+
+/**
+ * Operations a sensor type provides to the acquisition pipeline. @p ctx is
+ * the driver's own per-sensor state.
+ */
+typedef struct {
+    const char *name;
+
+    /** Prepares the sensor; called once at startup. */
+    esp_err_t (*init)(void *ctx);
+
+    /** Starts a conversion without blocking. */
+    esp_err_t (*start)(void *ctx);
+
+    /**
+     * Advances the conversion. Returns ESP_OK once a validated raw reading is
+     * held in @p ctx, ESP_ERR_NOT_FINISHED while still in progress, or an error.
+     */
+    esp_err_t (*poll)(void *ctx);
+
+    /** Converts the held raw reading into records; returns how many were written. */
+    size_t (*decode)(void *ctx, sensor_record_t *records_out);
+
+    /** Ticks the caller can wait for a task notification before polling again. */
+    TickType_t (*ticks_until_ready)(void *ctx);
+
+    /**
+     * Optional. Copies the held raw reading as one integer code per entry of
+     * @c raw_channels. Drivers that provide it can be oversampled and filtered
+     * before conversion.
+     */
+    void (*read_raw)(void *ctx, int32_t *codes_out);
+
+    const sensor_raw_channel_t *raw_channels;
+    uint8_t                    raw_channel_count;
+
+    /**
+     * Optional. Copies the held reading exactly as it came off the bus, minus
+     * its already-checked CRC, for capture mode. Returns the bytes written.
+     */
+    size_t (*read_frame)(void *ctx, uint8_t *buf, size_t buf_size);
+} sensor_driver_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SENSOR_DRIVER_H
@@ -0,0 +1,488 @@
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "filter.h"
+#include "sensor_set.h"
+
+#ifdef CONFIG_AHT20_HEAP_TRACE_SELFTEST
+#include "esp_heap_trace.h"
+#endif
+
+#ifdef CONFIG_CAPTURE_MODE
+#include "capture.h"
+#endif
+
+const static char *TAG = "SENSOR_SET";
+
+typedef struct {
+    aht20_bus_config_t bus;
+    uint8_t            mux_channels;   // Bitmask of populated mux channels, unused without a mux
+} sensor_bus_layout_t;
+
+static const sensor_bus_layout_t bus_layouts[] = {
+    {
+        .bus = {
+            .i2c_port = I2C_NUM_0,
+            .sda_io_num = CONFIG_AHT20_BUS0_SDA,
+            .scl_io_num = CONFIG_AHT20_BUS0_SCL,
+#ifdef CONFIG_AHT20_BUS0_MUX
+            .mux_addr = CONFIG_AHT20_BUS0_MUX_ADDR,
+#endif
+        },
+#ifdef CONFIG_AHT20_BUS0_MUX
+        .mux_channels = CONFIG_AHT20_BUS0_MUX_CHANNELS,
+#endif
+    },
+#ifdef CONFIG_AHT20_BUS1_ENABLE
+    {
+        .bus = {
+            .i2c_port = I2C_NUM_1,
+            .sda_io_num = CONFIG_AHT20_BUS1_SDA,
+            .scl_io_num = CONFIG_AHT20_BUS1_SCL,
+#ifdef CONFIG_AHT20_BUS1_MUX
+            .mux_addr = CONFIG_AHT20_BUS1_MUX_ADDR,
+#endif
+        },
+#ifdef CONFIG_AHT20_BUS1_MUX
+        .mux_channels = CONFIG_AHT20_BUS1_MUX_CHANNELS,
+#endif
+    },
+#endif
+};
+
+typedef struct {
+    const sensor_driver_t *driver;
+    void                  *ctx;
+    uint8_t                sensor_id;
+    uint8_t                failures;        // Consecutive failed readings
+    int64_t                retry_at_us;     // Skipped until then while backing off
+} sensor_instance_t;
+
+#define SENSOR_SET_OVERSAMPLE   CONFIG_SENSOR_OVERSAMPLE_COUNT
+
+#if defined(CONFIG_SENSOR_OVERSAMPLE_FILTER_TRIMMED_MEAN)
+#define SENSOR_SET_FILTER(codes, n) filter_trimmed_mean((codes), (n), CONFIG_SENSOR_OVERSAMPLE_TRIM)
+#elif defined(CONFIG_SENSOR_OVERSAMPLE_FILTER_EMA)
+#define SENSOR_SET_FILTER(codes, n) filter_ema((codes), (n), CONFIG_SENSOR_OVERSAMPLE_EMA_SHIFT)
+#else
+#define SENSOR_SET_FILTER(codes, n) filter_median((codes), (n))
+#endif
+
+static aht20_bus_t buses[SENSOR_SET_MAX_BUSES];
+static aht20_dev_t aht20_sensors[SENSOR_SET_MAX_SENSORS];
+static size_t aht20_count;
+static sensor_instance_t sensors[SENSOR_SET_MAX_SENSORS];
+static size_t sensor_count;
+
+#if SENSOR_SET_OVERSAMPLE > 1
+// Raw codes of the burst in progress, [sensor][raw channel][conversion]
+static int32_t burst_codes[SENSOR_SET_MAX_SENSORS][SENSOR_MAX_RECORDS][SENSOR_SET_OVERSAMPLE];
+static uint8_t burst_len[SENSOR_SET_MAX_SENSORS];
+static int64_t burst_first_us[SENSOR_SET_MAX_SENSORS];
+static int64_t burst_last_us[SENSOR_SET_MAX_SENSORS];
+#endif
+
+esp_err_t sensor_set_register(const sensor_driver_t *driver, void *ctx, uint8_t sensor_id)
+{
+    ESP_RETURN_ON_FALSE(sensor_count < SENSOR_SET_MAX_SENSORS, ESP_ERR_NO_MEM, TAG, "Sensor set is full");
+    ESP_RETURN_ON_FALSE(driver->raw_channel_count <= SENSOR_MAX_RECORDS, ESP_ERR_INVALID_ARG, TAG, "%s has too many raw channels", driver->name);
+    ESP_RETURN_ON_ERROR(driver->init(ctx), TAG, "Unable to initialize %s %u", driver->name, sensor_id);
+
+    sensors[sensor_count] = (sensor_instance_t) {
+        .driver = driver,
+        .ctx = ctx,
+        .sensor_id = sensor_id,
+    };
+    sensor_count++;
+
+    return ESP_OK;
+}
+
+static esp_err_t sensor_set_add_aht20(aht20_bus_t *bus, int port, uint8_t mux_channel)
+{
+    aht20_dev_t *dev = &aht20_sensors[aht20_count];
+    uint8_t sensor_id = port * TCA9548A_CHANNELS + (mux_channel == AHT20_NO_MUX ? 0 : mux_channel);
+
+    dev->bus = bus;
+    dev->mux_channel = mux_channel;
+    ESP_RETURN_ON_ERROR(sensor_set_register(&aht20_sensor_driver, dev, sensor_id), TAG, "Unable to add AHT20 on port %d", port);
+    aht20_count++;
+
+    ESP_LOGI(TAG, "AHT20 %u on I2C port %d, mux channel %d", sensor_id, port,
+             mux_channel == AHT20_NO_MUX ? -1 : mux_channel);
+    return ESP_OK;
+}
+
+esp_err_t sensor_set_init(void)
+{
+    const sensor_bus_layout_t *layout;
+
+    sensor_count = 0;
+    aht20_count = 0;
+
+    for (size_t b = 0; b < sizeof(bus_layouts) / sizeof(bus_layouts[0]); b++) {
+        layout = &bus_layouts[b];
+        ESP_RETURN_ON_ERROR(aht20_bus_init(&layout->bus, &buses[b]), TAG, "Unable to bring up I2C port %d", layout->bus.i2c_port);
+
+        if (!layout->bus.mux_addr) {
+            ESP_RETURN_ON_ERROR(sensor_set_add_aht20(&buses[b], layout->bus.i2c_port, AHT20_NO_MUX), TAG, "Sensor setup failed");
+            continue;
+        }
+
+        for (uint8_t ch = 0; ch < TCA9548A_CHANNELS; ch++) {
+            if (layout->mux_channels & BIT(ch)) {
+                ESP_RETURN_ON_ERROR(sensor_set_add_aht20(&buses[b], layout->bus.i2c_port, ch), TAG, "Sensor setup failed");
+            }
+        }
+    }
+
+    return ESP_OK;
+}
+
+size_t sensor_set_count(void)
+{
+    return sensor_count;
+}
+
+esp_err_t sensor_set_record_centi(uint8_t sensor_id, const sensor_record_t *record, int32_t *centi_out)
+{
+    if (!(record->flags & SENSOR_RECORD_FIXED)) {
+        *centi_out = (int32_t) lroundf(record->value.f * 100.0f);
+        return ESP_OK;
+    }
+
+#if defined(CONFIG_SENSOR_VALUE_FORMAT_RAW)
+    // Raw codes only mean something next to the driver's conversion
+    for (size_t i = 0; i < sensor_count; i++) {
+        const sensor_driver_t *driver = sensors[i].driver;
+
+        if (sensors[i].sensor_id != sensor_id) {
+            continue;
+        }
+        for (uint8_t ch = 0; ch < driver->raw_channel_count; ch++) {
+            if (driver->raw_channels[ch].channel == record->channel) {
+                *centi_out = sensor_code_to_centi(&driver->raw_channels[ch], record->value.i);
+                return ESP_OK;
+            }
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+#else
+    *centi_out = record->value.i;
+    return ESP_OK;
+#endif
+}
+
+// Past CONFIG_SENSOR_RETRY_BUDGET consecutive failures a sensor is skipped
+// for an exponentially growing interval, so a dead sensor costs next to
+// nothing while the others keep their rate
+static void sensor_set_note_failure(sensor_instance_t *sensor)
+{
+    uint32_t backoff_ms;
+    uint8_t excess;
+
+    if (sensor->failures < UINT8_MAX) {
+        sensor->failures++;
+    }
+    if (sensor->failures <= CONFIG_SENSOR_RETRY_BUDGET) {
+        return;
+    }
+
+    excess = sensor->failures - CONFIG_SENSOR_RETRY_BUDGET - 1;
+    backoff_ms = CONFIG_SENSOR_BACKOFF_MAX_MS;
+    if (excess < 16 && ((uint32_t) CONFIG_SENSOR_BACKOFF_MIN_MS << excess) < CONFIG_SENSOR_BACKOFF_MAX_MS) {
+        backoff_ms = (uint32_t) CONFIG_SENSOR_BACKOFF_MIN_MS << excess;
+    }
+
+    sensor->retry_at_us = esp_timer_get_time() + backoff_ms * 1000LL;
+    ESP_LOGW(TAG, "%s %u failed %u times in a row, backing off %" PRIu32 " ms", sensor->driver->name, sensor->sensor_id,
+             sensor->failures, backoff_ms);
+}
+
+static void sensor_set_note_success(sensor_instance_t *sensor)
+{
+    if (sensor->failures > CONFIG_SENSOR_RETRY_BUDGET) {
+        ESP_LOGI(TAG, "%s %u recovered", sensor->driver->name, sensor->sensor_id);
+    }
+    sensor->failures = 0;
+    sensor->retry_at_us = 0;
+}
+
+// Triggers the sensors, then polls until each one has finished. ok[i] is set
+// when sensor i holds a fresh reading, and done_us[i] to when it was read.
+// With raw_only, sensors that cannot be oversampled are left out.
+static void sensor_set_run_round(bool *ok, int64_t *done_us, bool raw_only)
+{
+    bool pending[SENSOR_SET_MAX_SENSORS];
+    size_t remaining = 0;
+    sensor_instance_t *sensor;
+    int64_t now = esp_timer_get_time();
+    TickType_t wait;
+    TickType_t ticks;
+    esp_err_t ret;
+
+    // Trigger everything first so the conversions overlap
+    for (size_t i = 0; i < sensor_count; i++) {
+        sensor = &sensors[i];
+        ok[i] = false;
+        pending[i] = false;
+
+        if ((raw_only && !sensor->driver->read_raw) || now < sensor->retry_at_us) {
+            continue;
+        }
+
+        ret = sensor->driver->start(sensor->ctx);
+        pending[i] = (ret == ESP_OK);
+        if (pending[i]) {
+            remaining++;
+        } else {
+            ESP_LOGE(TAG, "Unable to trigger %s %u: %s", sensor->driver->name, sensor->sensor_id, esp_err_to_name(ret));
+            sensor_set_note_failure(sensor);
+        }
+    }
+
+    // Collect in trigger order; every completion or poll timer wakes this task
+    while (remaining > 0) {
+        wait = portMAX_DELAY;
+
+        for (size_t i = 0; i < sensor_count; i++) {
+            if (!pending[i]) {
+                continue;
+            }
+
+            sensor = &sensors[i];
+            ret = sensor->driver->poll(sensor->ctx);
+            if (ret == ESP_ERR_NOT_FINISHED) {
+                ticks = sensor->driver->ticks_until_ready(sensor->ctx);
+                if (ticks < wait) {
+                    wait = ticks;
+                }
+                continue;
+            }
+
+            pending[i] = false;
+            remaining--;
+
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Unable to acquire reading from %s %u: %s", sensor->driver->name, sensor->sensor_id, esp_err_to_name(ret));
+                sensor_set_note_failure(sensor);
+            } else {
+                ok[i] = true;
+                sensor_set_note_success(sensor);
+                done_us[i] = esp_timer_get_time();
+            }
+        }
+
+        if (remaining > 0) {
+            ulTaskNotifyTake(pdTRUE, wait);
+        }
+    }
+}
+
+// Converts one raw code, and optionally its burst spread, into the
+// representation selected by CONFIG_SENSOR_VALUE_FORMAT
+static void sensor_set_make_record(const sensor_raw_channel_t *raw, int32_t code, bool has_spread, int32_t spread,
+                                   sensor_record_t *record)
+{
+    *record = (sensor_record_t) {
+        .channel = raw->channel,
+        .unit = SENSOR_CHANNEL_SCHEMA[raw->channel].unit,
+        .flags = has_spread ? SENSOR_RECORD_HAS_SPREAD : 0,
+    };
+
+#if defined(CONFIG_SENSOR_VALUE_FORMAT_RAW)
+    record->flags |= SENSOR_RECORD_FIXED;
+    record->value.i = code;
+    record->spread.i = spread;
+#elif defined(CONFIG_SENSOR_VALUE_FORMAT_CENTI)
+    record->flags |= SENSOR_RECORD_FIXED;
+    record->value.i = sensor_code_to_centi(raw, code);
+    record->spread.i = sensor_code_delta_to_centi(raw, spread);
+#else
+    record->value.f = (float) code * raw->scale + raw->offset;
+    record->spread.f = (float) spread * raw->scale;
+#endif
+}
+
+static void sensor_set_decode(const sensor_instance_t *sensor, int64_t acquired_us, sensor_sample_t *sample)
+{
+    const sensor_driver_t *driver = sensor->driver;
+    int32_t codes[SENSOR_MAX_RECORDS];
+
+    sample->sensor_id = sensor->sensor_id;
+    sample->acquired_us = acquired_us;
+
+    // Drivers without raw access convert on their own, always to float
+    if (!driver->read_raw) {
+        sample->record_count = driver->decode(sensor->ctx, sample->records);
+        return;
+    }
+
+    driver->read_raw(sensor->ctx, codes);
+    sample->record_count = driver->raw_channel_count;
+    for (uint8_t ch = 0; ch < driver->raw_channel_count; ch++) {
+        sensor_set_make_record(&driver->raw_channels[ch], codes[ch], false, 0, &sample->records[ch]);
+    }
+}
+
+#if SENSOR_SET_OVERSAMPLE > 1
+static void sensor_set_store_raw(size_t i, int64_t acquired_us)
+{
+    const sensor_driver_t *driver = sensors[i].driver;
+    int32_t codes[SENSOR_MAX_RECORDS];
+
+    if (burst_len[i] == 0) {
+        burst_first_us[i] = acquired_us;
+    }
+    burst_last_us[i] = acquired_us;
+
+    driver->read_raw(sensors[i].ctx, codes);
+    for (uint8_t ch = 0; ch < driver->raw_channel_count; ch++) {
+        burst_codes[i][ch][burst_len[i]] = codes[ch];
+    }
+    burst_len[i]++;
+}
+
+// Filters each raw channel of the burst down to one code, and only then
+// converts it
+static void sensor_set_decimate(size_t i, sensor_sample_t *sample)
+{
+    const sensor_driver_t *driver = sensors[i].driver;
+    int32_t *codes;
+    int32_t spread;
+    int32_t code;
+#ifdef CONFIG_SENSOR_OVERSAMPLE_SPREAD
+    const bool has_spread = true;
+#else
+    const bool has_spread = false;
+#endif
+
+    // Stamped at the middle of the burst, the centre of the filter's window
+    sample->sensor_id = sensors[i].sensor_id;
+    sample->acquired_us = burst_first_us[i] + (burst_last_us[i] - burst_first_us[i]) / 2;
+    sample->record_count = driver->raw_channel_count;
+
+    for (uint8_t ch = 0; ch < driver->raw_channel_count; ch++) {
+        codes = burst_codes[i][ch];
+
+        // Spread first: the order-statistic filters sort the burst in place
+        spread = filter_spread(codes, burst_len[i]);
+        code = SENSOR_SET_FILTER(codes, burst_len[i]);
+
+        sensor_set_make_record(&driver->raw_channels[ch], code, has_spread, spread, &sample->records[ch]);
+    }
+}
+#endif
+
+esp_err_t sensor_set_acquire(sensor_sample_t *samples_out, size_t max_samples, size_t *count_out)
+{
+    bool ok[SENSOR_SET_MAX_SENSORS];
+    int64_t done_us[SENSOR_SET_MAX_SENSORS];
+    size_t count = 0;
+
+#if SENSOR_SET_OVERSAMPLE > 1
+    memset(burst_len, 0, sizeof(burst_len));
+
+    // Sensors without raw access only take part in the first round
+    for (size_t round = 0; round < SENSOR_SET_OVERSAMPLE; round++) {
+        sensor_set_run_round(ok, done_us, round > 0);
+
+        for (size_t i = 0; i < sensor_count; i++) {
+            if (!ok[i]) {
+                continue;
+            }
+
+            if (sensors[i].driver->read_raw) {
+                sensor_set_store_raw(i, done_us[i]);
+            } else if (count < max_samples) {
+                sensor_set_decode(&sensors[i], done_us[i], &samples_out[count++]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < sensor_count && count < max_samples; i++) {
+        if (burst_len[i] > 0) {
+            sensor_set_decimate(i, &samples_out[count++]);
+        }
+    }
+#else
+    sensor_set_run_round(ok, done_us, false);
+
+    // Decode straight into the caller's batch
+    for (size_t i = 0; i < sensor_count && count < max_samples; i++) {
+        if (ok[i]) {
+            sensor_set_decode(&sensors[i], done_us[i], &samples_out[count++]);
+        }
+    }
+#endif
+
+    *count_out = count;
+    return count > 0 ? ESP_OK : ESP_FAIL;
+}
+
+#ifdef CONFIG_CAPTURE_MODE
+esp_err_t sensor_set_capture(size_t *count_out)
+{
+    bool ok[SENSOR_SET_MAX_SENSORS];
+    int64_t done_us[SENSOR_SET_MAX_SENSORS];
+    uint8_t frame[CAPTURE_FRAME_LEN];
+    sensor_instance_t *sensor;
+    size_t count = 0;
+    size_t len;
+
+    sensor_set_run_round(ok, done_us, false);
+
+    for (size_t i = 0; i < sensor_count; i++) {
+        sensor = &sensors[i];
+        if (!ok[i] || !sensor->driver->read_frame) {
+            continue;
+        }
+
+        len = sensor->driver->read_frame(sensor->ctx, frame, sizeof(frame));
+        if (capture_append(sensor->sensor_id, done_us[i], frame, len) == ESP_OK) {
+            count++;
+        }
+    }
+
+    *count_out = count;
+    return count > 0 ? ESP_OK : ESP_FAIL;
+}
+#endif
+
+#ifdef CONFIG_AHT20_HEAP_TRACE_SELFTEST
+#define SENSOR_SET_HEAP_TRACE_RECORDS 16
+
+static heap_trace_record_t trace_records[SENSOR_SET_HEAP_TRACE_RECORDS];
+
+esp_err_t sensor_set_heap_selftest(size_t batches)
+{
+    sensor_sample_t samples[SENSOR_SET_MAX_SENSORS];
+    size_t count;
+    size_t allocations;
+
+    ESP_RETURN_ON_ERROR(heap_trace_init_standalone(trace_records, SENSOR_SET_HEAP_TRACE_RECORDS), TAG, "Unable to init heap trace");
+    ESP_RETURN_ON_ERROR(heap_trace_start(HEAP_TRACE_ALL), TAG, "Unable to start heap trace");
+
+    for (size_t i = 0; i < batches; i++) {
+        sensor_set_acquire(samples, SENSOR_SET_MAX_SENSORS, &count);
+    }
+
+    heap_trace_stop();
+    allocations = heap_trace_get_count();
+
+    if (allocations != 0) {
+        ESP_LOGE(TAG, "Read path allocated %u time(s) over %u batches", (unsigned) allocations, (unsigned) batches);
+        heap_trace_dump();
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Read path heap self-test passed (%u batches, 0 allocations)", (unsigned) batches);
+    return ESP_OK;
+}
+#endif
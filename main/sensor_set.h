@@ -0,0 +1,100 @@
+// sensor_set.h
+#ifndef SENSOR_SET_H
+#define SENSOR_SET_H
+
+#include <stddef.h>
+#include "esp_err.h"
+#include "aht.h"
+#include "sensor_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SENSOR_SET_MAX_BUSES    2
+#define SENSOR_SET_MAX_SENSORS  (SENSOR_SET_MAX_BUSES * TCA9548A_CHANNELS)
+
+/**
+ * @brief Adds a sensor of any type to the set and runs its driver's init.
+ *
+ * @param driver Operations for the sensor type.
+ * @param ctx Driver-owned per-sensor state; must outlive the set.
+ * @param sensor_id Tag carried by every sample from this sensor.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the set is full, or the
+ *         driver's init error.
+ */
+esp_err_t sensor_set_register(const sensor_driver_t *driver, void *ctx, uint8_t sensor_id);
+
+/**
+ * @brief Brings up every I2C bus, mux and AHT20 described in menuconfig.
+ *
+ * Sensors are tagged with a stable ID derived from their position:
+ * `port * 8 + mux channel` (or `port * 8` on a bus without a mux).
+ *
+ * @return ESP_OK if every configured sensor was registered.
+ */
+esp_err_t sensor_set_init(void);
+
+/**
+ * @brief Returns the number of sensors registered by sensor_set_init().
+ */
+size_t sensor_set_count(void);
+
+/**
+ * @brief Converts one record of a sample from this set to hundredths of its
+ * unit, whatever CONFIG_SENSOR_VALUE_FORMAT is.
+ *
+ * @param sensor_id The sample's sensor, needed to convert raw codes.
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if a raw code belongs to no known
+ *         sensor channel.
+ */
+esp_err_t sensor_set_record_centi(uint8_t sensor_id, const sensor_record_t *record, int32_t *centi_out);
+
+/**
+ * @brief Triggers every sensor, then collects the results as they complete.
+ *
+ * All conversions run in parallel, so a batch takes roughly one conversion
+ * time regardless of how many sensors are attached. Sensors that fail are
+ * logged and left out of the batch; after CONFIG_SENSOR_RETRY_BUDGET
+ * consecutive failures a sensor is skipped with exponential backoff.
+ *
+ * With CONFIG_SENSOR_OVERSAMPLE_COUNT > 1 this repeats back to back and each
+ * sensor's burst of raw codes is filtered down to a single sample; a sensor
+ * is reported if any conversion of its burst succeeded.
+ *
+ * Each sample's @c acquired_us is the esp_timer time at which its frame was
+ * read (the middle of the burst when oversampling), not when it is sent.
+ *
+ * @param samples_out Receives one tagged sample per successful sensor.
+ * @param max_samples Capacity of @p samples_out.
+ * @param count_out Receives the number of samples written.
+ * @return ESP_OK if at least one sensor produced a reading, ESP_FAIL otherwise.
+ */
+esp_err_t sensor_set_acquire(sensor_sample_t *samples_out, size_t max_samples, size_t *count_out);
+
+#ifdef CONFIG_CAPTURE_MODE
+/**
+ * @brief Runs one acquisition round and stores every sensor's raw frame in
+ * the capture ring, stamped with the time it was read. Nothing is decoded.
+ *
+ * @param count_out Receives the number of frames stored.
+ * @return ESP_OK if at least one frame was stored, ESP_FAIL otherwise.
+ */
+esp_err_t sensor_set_capture(size_t *count_out);
+#endif
+
+#ifdef CONFIG_AHT20_HEAP_TRACE_SELFTEST
+/**
+ * @brief Runs @p batches acquisitions under the heap tracer and checks that
+ * none of them touched the heap.
+ *
+ * @return ESP_OK if no allocations were recorded, ESP_FAIL otherwise.
+ */
+esp_err_t sensor_set_heap_selftest(size_t batches);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SENSOR_SET_H
@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <sys/time.h>
 #include <time.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_netif_sntp.h"
 #include "portmacro.h"
 #include "config.h"
@@ -35,3 +37,16 @@ void sync_time(void)
     setenv("TZ", TIMEZONE, 1);
     tzset();
 }
+
+int64_t time_sync_epoch_offset_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec - esp_timer_get_time();
+}
+
+int64_t time_sync_epoch_us(int64_t mono_us)
+{
+    return mono_us + time_sync_epoch_offset_us();
+}
@@ -2,6 +2,8 @@
 #ifndef TIME_SYNC_H
 #define TIME_SYNC_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,6 +13,20 @@ extern "C" {
  */
 void sync_time(void);
 
+/**
+ * @brief Converts an esp_timer timestamp to wall-clock time.
+ *
+ * @param mono_us A time from esp_timer_get_time(), in the past or future.
+ * @return Microseconds since the Unix epoch at that instant.
+ */
+int64_t time_sync_epoch_us(int64_t mono_us);
+
+/**
+ * @brief Returns what to add to an esp_timer timestamp to get microseconds
+ * since the Unix epoch. Changes slowly as SNTP slews the clock.
+ */
+int64_t time_sync_epoch_offset_us(void);
+
 #ifdef __cplusplus
 }
 #endif
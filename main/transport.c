@@ -0,0 +1,936 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <socket.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_check.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "config.h"
+#include "rto.h"
+#include "sample_ring.h"
+#include "transport.h"
+
+#ifdef CONFIG_UPLINK_DTLS
+#include "dtls_session.h"
+#endif
+
+#ifdef CONFIG_UPLINK_TRANSPORT_LWIP_RAW
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "lwip/priv/tcpip_priv.h"
+#endif
+
+#ifdef CONFIG_UPLINK_TRANSPORT_MQTT
+#include "freertos/queue.h"
+#include "mqtt_client.h"
+#ifdef CONFIG_UPLINK_MQTT_FLASH_OUTBOX
+#include "mqtt_outbox_flash.h"
+#endif
+#endif
+
+const static char *TAG = "TRANSPORT";
+
+#define TRANSPORT_LOCAL_PORT        9999
+#ifdef CONFIG_UPLINK_DTLS
+#define TRANSPORT_MTU               (CONFIG_UPLINK_MTU_BYTES - DTLS_SESSION_OVERHEAD)
+#else
+#define TRANSPORT_MTU               CONFIG_UPLINK_MTU_BYTES
+#endif
+#define TRANSPORT_DATAGRAM_MAX      (TRANSPORT_MTU < MAX_CBOR_BUFFER_SIZE ? TRANSPORT_MTU : MAX_CBOR_BUFFER_SIZE)
+#define TRANSPORT_ACK_MAX           (TRANSPORT_ACK_SIZE + 1)    // Room to notice oversized frames
+#define TRANSPORT_NO_SLOT           (-1)
+
+#ifdef CONFIG_UPLINK_ARQ
+#define TRANSPORT_WINDOW            (CONFIG_UPLINK_ARQ_WINDOW + 1)     // Plus the slot kept for transport_send()
+#else
+#define TRANSPORT_WINDOW            1
+#endif
+
+_Static_assert(TRANSPORT_MTU > TRANSPORT_DATA_HEADER_SIZE, "UPLINK_MTU_BYTES leaves no room for samples");
+_Static_assert(TRANSPORT_WINDOW <= 32, "The selective-ACK bitmap covers 32 sequences past the cumulative ACK");
+
+typedef enum {
+    TRANSPORT_SLOT_FREE,
+    TRANSPORT_SLOT_BUILDING,        // Handed out by transport_buffer()
+    TRANSPORT_SLOT_SENT,            // Waiting for its acknowledgement
+    TRANSPORT_SLOT_ACKED,           // Resolved, waiting for transport_send() to collect it
+    TRANSPORT_SLOT_LOST,
+} transport_slot_state_t;
+
+typedef struct {
+    transport_slot_state_t state;
+    uint32_t    seq;
+    size_t      len;                // Header included
+    size_t      sample_count;
+    int         attempts;
+    int         max_attempts;
+    uint32_t    timeout_ms;
+    int64_t     sent_us;            // Latest transmission
+    bool        submitted;          // Owned by the window rather than a waiting caller
+    bool        adaptive;           // Timer follows the RTT estimate
+#ifdef CONFIG_UPLINK_ARQ
+    int64_t     epoch_offset_us;
+    uint32_t    tag;
+    sensor_sample_t samples[CONFIG_UPLINK_MAX_BATCH_SAMPLES];
+#endif
+} transport_slot_t;
+
+static transport_slot_t slots[TRANSPORT_WINDOW];
+static int building = TRANSPORT_NO_SLOT;
+static uint32_t next_seq;
+static uint8_t device_id[TRANSPORT_DEVICE_ID_SIZE];
+static bool link_up = true;
+static transport_done_cb_t on_done;
+static transport_stats_t stats;
+static uint32_t buffer_cycles;      // Spent handing out the current buffer
+static rto_estimator_t rtt;
+
+static void transport_note_handoff(uint32_t cycles)
+{
+    cycles += buffer_cycles;
+
+    if (stats.datagrams == 0) {
+        stats.min_cycles = cycles;
+        stats.max_cycles = cycles;
+        stats.mean_cycles = cycles;
+    } else {
+        if (cycles < stats.min_cycles) {
+            stats.min_cycles = cycles;
+        }
+        if (cycles > stats.max_cycles) {
+            stats.max_cycles = cycles;
+        }
+        stats.mean_cycles = (uint32_t) ((int32_t) stats.mean_cycles + ((int32_t) (cycles - stats.mean_cycles) / 16));
+    }
+    stats.last_cycles = cycles;
+    stats.datagrams++;
+}
+
+static void transport_put_be32(uint8_t *out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static uint32_t transport_get_be32(const uint8_t *in)
+{
+    return ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) | ((uint32_t) in[2] << 8) | in[3];
+}
+
+/*
+ * Backends. Each datagram slot owns one datagram-sized buffer; the
+ * transport writes the sequence header at its start and hands out the rest.
+ * Received acknowledgements come with the time they arrived, or 0 if the
+ * backend cannot tell.
+ */
+
+#ifdef CONFIG_UPLINK_TRANSPORT_LWIP_RAW
+
+typedef struct {
+    struct tcpip_api_call_data call;    // Must come first, lwIP casts back to it
+    struct pbuf *p;
+    uint8_t *payload;
+    err_t err;
+} transport_call_t;
+
+static struct udp_pcb *pcb;
+static struct pbuf *slot_pbufs[TRANSPORT_WINDOW];
+static uint8_t *slot_payloads[TRANSPORT_WINDOW];
+static TaskHandle_t sender;
+static portMUX_TYPE ack_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t ack_latest[TRANSPORT_ACK_MAX];
+static size_t ack_latest_len;
+static int64_t ack_latest_us;
+
+// Runs in the tcpip thread. Only the latest acknowledgement is kept: with
+// cumulative ACKs each one supersedes the ones before it.
+static void transport_on_recv(void *arg, struct udp_pcb *recv_pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    taskENTER_CRITICAL(&ack_lock);
+    ack_latest_len = pbuf_copy_partial(p, ack_latest, sizeof(ack_latest), 0);
+    ack_latest_us = esp_timer_get_time();
+    taskEXIT_CRITICAL(&ack_lock);
+
+    pbuf_free(p);
+    xTaskNotifyIndexed(sender, TRANSPORT_ACK_NOTIFY_INDEX, 0, eSetBits);
+#ifdef CONFIG_UPLINK_ARQ
+    // Also end the sender's idle sleep, so the window slides right away
+    xTaskNotifyGiveIndexed(sender, SAMPLE_RING_WAKE_NOTIFY_INDEX);
+#endif
+}
+
+static err_t transport_do_open(struct tcpip_api_call_data *call)
+{
+    ip_addr_t server;
+    err_t err;
+
+    if (!ipaddr_aton(UDP_SERVER_IP, &server)) {
+        return ERR_ARG;
+    }
+
+    pcb = udp_new();
+    if (pcb == NULL) {
+        return ERR_MEM;
+    }
+
+    err = udp_bind(pcb, IP_ANY_TYPE, TRANSPORT_LOCAL_PORT);
+    if (err == ERR_OK) {
+        err = udp_connect(pcb, &server, UDP_SERVER_PORT);
+    }
+    if (err != ERR_OK) {
+        udp_remove(pcb);
+        pcb = NULL;
+        return err;
+    }
+
+    udp_recv(pcb, transport_on_recv, NULL);
+    return ERR_OK;
+}
+
+// udp_send() prepends the UDP and IP headers in the pbuf's headroom; moving
+// the payload pointer back afterwards lets a retry reuse the same pbuf
+static err_t transport_do_send(struct tcpip_api_call_data *call)
+{
+    transport_call_t *send = (transport_call_t *) call;
+
+    send->err = udp_send(pcb, send->p);
+    pbuf_remove_header(send->p, send->payload - (uint8_t *) send->p->payload);
+    return send->err;
+}
+
+static esp_err_t transport_io_open(void)
+{
+    struct tcpip_api_call_data call = { 0 };
+
+    sender = xTaskGetCurrentTaskHandle();
+    ESP_RETURN_ON_FALSE(tcpip_api_call(transport_do_open, &call) == ERR_OK, ESP_FAIL, TAG, "Unable to open UDP PCB");
+    return ESP_OK;
+}
+
+static uint8_t *transport_io_buffer(int slot)
+{
+    // PBUF_TRANSPORT reserves room for every header below UDP
+    if (slot_pbufs[slot] == NULL) {
+        slot_pbufs[slot] = pbuf_alloc(PBUF_TRANSPORT, TRANSPORT_DATAGRAM_MAX, PBUF_RAM);
+        if (slot_pbufs[slot] == NULL) {
+            return NULL;
+        }
+        slot_payloads[slot] = slot_pbufs[slot]->payload;
+    }
+
+    return slot_payloads[slot];
+}
+
+// The driver may still hold the pbuf from the last attempt; then neither its
+// header nor its headroom is ours to rewrite
+static uint8_t *transport_io_writable(int slot, size_t len)
+{
+    struct pbuf *copy;
+
+    pbuf_realloc(slot_pbufs[slot], len);
+
+    if (slot_pbufs[slot]->ref > 1 && (copy = pbuf_clone(PBUF_TRANSPORT, PBUF_RAM, slot_pbufs[slot])) != NULL) {
+        pbuf_free(slot_pbufs[slot]);
+        slot_pbufs[slot] = copy;
+        slot_payloads[slot] = copy->payload;
+    }
+
+    return slot_payloads[slot];
+}
+
+static bool transport_io_transmit(int slot, size_t len)
+{
+    transport_call_t send = { 0 };
+
+    send.p = slot_pbufs[slot];
+    send.payload = slot_payloads[slot];
+    tcpip_api_call(transport_do_send, &send.call);
+    return send.err == ERR_OK;
+}
+
+static ssize_t transport_io_receive(uint8_t *buf, size_t size, uint32_t timeout_ms, int64_t *at_us)
+{
+    size_t len;
+
+    if (xTaskNotifyWaitIndexed(TRANSPORT_ACK_NOTIFY_INDEX, 0, UINT32_MAX, NULL, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        return -1;
+    }
+
+    taskENTER_CRITICAL(&ack_lock);
+    len = ack_latest_len < size ? ack_latest_len : size;
+    memcpy(buf, ack_latest, len);
+    *at_us = ack_latest_us;
+    ack_latest_len = 0;
+    taskEXIT_CRITICAL(&ack_lock);
+
+    return len > 0 ? (ssize_t) len : -1;
+}
+
+static void transport_io_release(int slot)
+{
+    if (slot_pbufs[slot] != NULL) {
+        pbuf_free(slot_pbufs[slot]);
+        slot_pbufs[slot] = NULL;
+    }
+}
+
+#elif defined(CONFIG_UPLINK_TRANSPORT_MQTT)
+
+// What the MQTT task reports about a publish: its PUBACK, or its removal
+// from the outbox unacknowledged. This is the backend's acknowledgement.
+typedef struct {
+    int     msg_id;
+    bool    published;
+    int64_t at_us;
+} transport_outcome_t;
+
+_Static_assert(sizeof(transport_outcome_t) <= TRANSPORT_ACK_MAX, "An outcome must fit the acknowledgement buffer");
+
+static esp_mqtt_client_handle_t client;
+static TaskHandle_t sender;
+static QueueHandle_t outcomes;
+static volatile bool connected;
+static int slot_msg_ids[TRANSPORT_WINDOW];
+static uint8_t datagrams[TRANSPORT_WINDOW][TRANSPORT_DATAGRAM_MAX];
+
+#ifdef CONFIG_STATIC_MEMORY
+// A static queue cannot grow with the outbox, so restored publishes get at
+// most this many outcomes of room on top of the window
+#define TRANSPORT_RESTORED_OUTCOMES_MAX     16
+
+static StaticQueue_t outcomes_queue;
+static uint8_t outcomes_storage[(TRANSPORT_WINDOW + TRANSPORT_RESTORED_OUTCOMES_MAX) * sizeof(transport_outcome_t)];
+#endif
+
+// Runs in the MQTT task, which holds the client lock: blocking here would
+// deadlock a sender waiting in esp_mqtt_client_enqueue(). The queue holds
+// an outcome per slot and per restored publish; one that still does not fit,
+// behind the late outcomes of publishes already given up on, is dropped and
+// its slot's timer gives up on it in turn
+static void transport_on_mqtt_event(void *arg, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+    transport_outcome_t outcome = {
+        .msg_id = event->msg_id,
+        .at_us = esp_timer_get_time(),
+    };
+
+    switch ((esp_mqtt_event_id_t) event_id) {
+    case MQTT_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "Connected to the broker.");
+        connected = true;
+        return;
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGI(TAG, "Disconnected from the broker.");
+        connected = false;
+        return;
+    case MQTT_EVENT_PUBLISHED:
+        outcome.published = true;
+        break;
+    case MQTT_EVENT_DELETED:
+        outcome.published = false;
+        break;
+    default:
+        return;
+    }
+
+    if (xQueueSend(outcomes, &outcome, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Outcome of message %d dropped", outcome.msg_id);
+        return;
+    }
+    xTaskNotifyGiveIndexed(sender, SAMPLE_RING_WAKE_NOTIFY_INDEX);
+}
+
+static esp_err_t transport_io_open(void)
+{
+    const esp_mqtt_client_config_t config = {
+        .broker.address.uri = MQTT_BROKER_URI,
+#ifdef CONFIG_UPLINK_MQTT_PROTOCOL_5
+        .session.protocol_ver = MQTT_PROTOCOL_V_5,
+#else
+        .session.protocol_ver = MQTT_PROTOCOL_V_3_1_1,
+#endif
+        // Room for a whole publish, so none is split across writes
+        .buffer.out_size = TRANSPORT_DATAGRAM_MAX + sizeof(CONFIG_UPLINK_MQTT_TOPIC) + 8,
+    };
+    size_t depth = TRANSPORT_WINDOW;
+
+    sender = xTaskGetCurrentTaskHandle();
+
+    client = esp_mqtt_client_init(&config);
+    ESP_RETURN_ON_FALSE(client != NULL, ESP_FAIL, TAG, "Unable to create MQTT client");
+
+#ifdef CONFIG_UPLINK_MQTT_FLASH_OUTBOX
+    // Publishes restored from flash are acknowledged too, once each
+    depth += mqtt_outbox_flash_restored();
+#endif
+#ifdef CONFIG_STATIC_MEMORY
+    if (depth > TRANSPORT_WINDOW + TRANSPORT_RESTORED_OUTCOMES_MAX) {
+        depth = TRANSPORT_WINDOW + TRANSPORT_RESTORED_OUTCOMES_MAX;
+    }
+    outcomes = xQueueCreateStatic(depth, sizeof(transport_outcome_t), outcomes_storage, &outcomes_queue);
+#else
+    outcomes = xQueueCreate(depth, sizeof(transport_outcome_t));
+#endif
+    ESP_RETURN_ON_FALSE(outcomes != NULL, ESP_ERR_NO_MEM, TAG, "Unable to create outcome queue");
+
+    ESP_RETURN_ON_ERROR(esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, transport_on_mqtt_event, NULL),
+                        TAG, "Unable to register MQTT events");
+    return esp_mqtt_client_start(client);
+}
+
+static uint8_t *transport_io_buffer(int slot)
+{
+    return datagrams[slot];
+}
+
+static uint8_t *transport_io_writable(int slot, size_t len)
+{
+    return datagrams[slot];
+}
+
+// Copies the datagram into the client's outbox and returns: the MQTT task
+// sends it, so any number of publishes are in flight at once
+static bool transport_io_transmit(int slot, size_t len)
+{
+    slot_msg_ids[slot] = esp_mqtt_client_enqueue(client, CONFIG_UPLINK_MQTT_TOPIC, (const char *) datagrams[slot], len, 1, 0, true);
+    return slot_msg_ids[slot] > 0;
+}
+
+static ssize_t transport_io_receive(uint8_t *buf, size_t size, uint32_t timeout_ms, int64_t *at_us)
+{
+    transport_outcome_t outcome;
+
+    if (xQueueReceive(outcomes, &outcome, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        return -1;
+    }
+
+    *at_us = outcome.at_us;
+    memcpy(buf, &outcome, sizeof(outcome));
+    return sizeof(outcome);
+}
+
+static void transport_io_release(int slot)
+{
+}
+
+#else
+
+static int socketfd = -1;
+static struct sockaddr_in server_addr;
+#ifndef CONFIG_UPLINK_DTLS
+static uint32_t socket_timeout_ms = UINT32_MAX;
+#endif
+static uint8_t datagrams[TRANSPORT_WINDOW][TRANSPORT_DATAGRAM_MAX];
+
+static esp_err_t transport_io_open(void)
+{
+    struct sockaddr_in local_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(TRANSPORT_LOCAL_PORT),
+    };
+
+    socketfd = socket(AF_INET, SOCK_DGRAM, 0);
+    ESP_RETURN_ON_FALSE(socketfd >= 0, ESP_FAIL, TAG, "Unable to establish socket connection");
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(UDP_SERVER_IP);
+    server_addr.sin_port = htons(UDP_SERVER_PORT);
+
+    bind(socketfd, (struct sockaddr *) &local_addr, sizeof(local_addr));
+
+    if (connect(socketfd, (const struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+        ESP_LOGI(TAG, "UDP connection failed.");
+    }
+#ifdef CONFIG_UPLINK_DTLS
+    return dtls_session_open(socketfd);
+#else
+    return ESP_OK;
+#endif
+}
+
+static uint8_t *transport_io_buffer(int slot)
+{
+    // Encoders write every byte they report, so the buffer is never cleared
+    return datagrams[slot];
+}
+
+static uint8_t *transport_io_writable(int slot, size_t len)
+{
+    return datagrams[slot];
+}
+
+static bool transport_io_transmit(int slot, size_t len)
+{
+#ifdef CONFIG_UPLINK_DTLS
+    return dtls_session_send(datagrams[slot], len);
+#else
+    return sendto(socketfd, datagrams[slot], len, 0, (const struct sockaddr *) &server_addr, sizeof(server_addr)) >= 0;
+#endif
+}
+
+// Only an ACK that arrives while the sender blocks for it is timed. One
+// already queued has waited there since some point after the last poll, up
+// to CONFIG_UPLINK_ARQ_ACK_POLL_MS, which would inflate the RTT by as much.
+static ssize_t transport_io_receive(uint8_t *buf, size_t size, uint32_t timeout_ms, int64_t *at_us)
+{
+    uint8_t probe;
+    bool queued = recv(socketfd, &probe, sizeof(probe), MSG_PEEK | MSG_DONTWAIT) >= 0;
+    ssize_t len;
+
+#ifdef CONFIG_UPLINK_DTLS
+    len = dtls_session_receive(buf, size, timeout_ms);
+#else
+    // A zero SO_RCVTIMEO would block forever
+    if (timeout_ms == 0) {
+        len = recvfrom(socketfd, buf, size, MSG_DONTWAIT, NULL, NULL);
+    } else {
+        if (timeout_ms != socket_timeout_ms) {
+            struct timeval tv = {
+                .tv_sec = timeout_ms / 1000,
+                .tv_usec = (timeout_ms % 1000) * 1000,
+            };
+
+            setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, (const char *) &tv, sizeof(tv));
+            socket_timeout_ms = timeout_ms;
+        }
+        len = recvfrom(socketfd, buf, size, 0, NULL, NULL);
+    }
+#endif
+
+    // Taken as the blocked sender wakes, so the RTT still includes the
+    // mailbox hop from the tcpip thread and the wakeup itself
+    *at_us = queued ? 0 : esp_timer_get_time();
+    return len;
+}
+
+static void transport_io_release(int slot)
+{
+}
+
+#endif
+
+/*
+ * Window
+ */
+
+static int transport_free_slot(void)
+{
+    for (int i = 0; i < TRANSPORT_WINDOW; i++) {
+        if (slots[i].state == TRANSPORT_SLOT_FREE) {
+            return i;
+        }
+    }
+
+    return TRANSPORT_NO_SLOT;
+}
+
+static void transport_resolve(int slot, bool acked)
+{
+    transport_slot_t *s = &slots[slot];
+
+    link_up = acked;
+    if (acked) {
+        stats.acked++;
+        ESP_LOGI(TAG, "ACK received. Data sent successfully.");
+    } else {
+        stats.lost++;
+        ESP_LOGI(TAG, "Failed to send data after %d attempts.", s->attempts);
+    }
+
+    if (!s->submitted) {
+        // transport_send() collects the outcome
+        s->state = acked ? TRANSPORT_SLOT_ACKED : TRANSPORT_SLOT_LOST;
+        return;
+    }
+
+#ifdef CONFIG_UPLINK_ARQ
+    if (on_done) {
+        on_done(s->samples, s->sample_count, s->epoch_offset_us, s->tag, acked);
+    }
+#endif
+    transport_io_release(slot);
+    s->state = TRANSPORT_SLOT_FREE;
+}
+
+// Sequence numbers wrap, so order is decided by the signed distance
+static bool transport_seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+// Oldest sequence still in flight; the collector need not wait for anything before it
+static uint32_t transport_window_base(void)
+{
+    uint32_t base = next_seq;
+
+    for (int i = 0; i < TRANSPORT_WINDOW; i++) {
+        if (slots[i].state == TRANSPORT_SLOT_SENT && transport_seq_before(slots[i].seq, base)) {
+            base = slots[i].seq;
+        }
+    }
+
+    return base;
+}
+
+static bool transport_transmit(int slot)
+{
+    transport_slot_t *s = &slots[slot];
+    uint8_t *header = transport_io_writable(slot, s->len);
+    uint32_t start;
+    bool sent;
+
+    // The base changes as the window slides, so every attempt restamps it
+    header[0] = TRANSPORT_DATA_MAGIC;
+    header[1] = TRANSPORT_PROTOCOL_VERSION;
+    memcpy(&header[2], device_id, TRANSPORT_DEVICE_ID_SIZE);
+    transport_put_be32(&header[8], s->seq);
+    transport_put_be32(&header[12], transport_window_base());
+
+    ESP_LOGI(TAG, "Sending %u sample(s), seq %" PRIu32 "...", (unsigned) s->sample_count, s->seq);
+    start = esp_cpu_get_cycle_count();
+    sent = transport_io_transmit(slot, s->len);
+    if (s->attempts == 0) {
+        transport_note_handoff(esp_cpu_get_cycle_count() - start);
+    }
+
+    s->attempts++;
+    s->sent_us = esp_timer_get_time();
+    stats.attempts++;
+    return sent;
+}
+
+static void transport_start(size_t len, size_t sample_count, int max_attempts, uint32_t timeout_ms, bool submitted)
+{
+    transport_slot_t *s = &slots[building];
+    int slot = building;
+
+    building = TRANSPORT_NO_SLOT;
+
+#ifdef CONFIG_UPLINK_TRANSPORT_MQTT
+    // The client retransmits by itself; the timer only bounds how long a
+    // publish may hold its slot
+    max_attempts = 1;
+    timeout_ms = CONFIG_UPLINK_MQTT_ACK_TIMEOUT_MS;
+#endif
+
+    s->seq = next_seq++;
+    s->len = len + TRANSPORT_DATA_HEADER_SIZE;
+    s->sample_count = sample_count;
+    s->attempts = 0;
+    s->max_attempts = max_attempts;
+    s->adaptive = timeout_ms == TRANSPORT_TIMEOUT_ADAPTIVE;
+    s->timeout_ms = s->adaptive ? rto_timeout_ms(&rtt) : timeout_ms;
+    s->submitted = submitted;
+    s->state = TRANSPORT_SLOT_SENT;
+
+#ifdef CONFIG_UPLINK_TRANSPORT_MQTT
+    // A publish the outbox refused is never retried
+    if (!transport_transmit(slot)) {
+        transport_resolve(slot, false);
+    }
+#else
+    transport_transmit(slot);
+#endif
+}
+
+// Karn's rule: after a retransmission the ACK may answer any of the
+// attempts, so only datagrams sent once give an RTT sample
+static void transport_sample_rtt(int slot, int64_t ack_us)
+{
+    if (slots[slot].attempts == 1 && ack_us != 0) {
+        rto_sample(&rtt, ack_us - slots[slot].sent_us);
+    }
+}
+
+#ifdef CONFIG_UPLINK_TRANSPORT_MQTT
+static void transport_handle_ack(const uint8_t *ack, ssize_t len, int64_t ack_us)
+{
+    transport_outcome_t outcome;
+
+    // Publishes restored by the outbox after a reboot match no slot
+    memcpy(&outcome, ack, sizeof(outcome));
+    for (int i = 0; i < TRANSPORT_WINDOW; i++) {
+        if (slots[i].state == TRANSPORT_SLOT_SENT && slot_msg_ids[i] == outcome.msg_id) {
+            if (outcome.published) {
+                transport_sample_rtt(i, ack_us);
+            }
+            transport_resolve(i, outcome.published);
+            return;
+        }
+    }
+}
+#else
+// Anything not addressed to this device, or acknowledging a sequence that
+// was never sent, is dropped before it can resolve a datagram. Stale and
+// duplicate ACKs pass: they only cover datagrams that did arrive.
+static bool transport_ack_valid(const uint8_t *ack, ssize_t len)
+{
+    if (len != TRANSPORT_ACK_SIZE || ack[0] != TRANSPORT_ACK_MAGIC || ack[1] != TRANSPORT_PROTOCOL_VERSION) {
+        return false;
+    }
+    if (memcmp(&ack[2], device_id, TRANSPORT_DEVICE_ID_SIZE) != 0) {
+        return false;
+    }
+
+    return transport_seq_before(transport_get_be32(&ack[8]), next_seq)
+           && !transport_seq_before(next_seq, transport_get_be32(&ack[12]));
+}
+
+static void transport_handle_ack(const uint8_t *ack, ssize_t len, int64_t ack_us)
+{
+    uint32_t echoed;
+    uint32_t cumulative;
+    uint32_t sack;
+    uint32_t offset;
+
+    if (!transport_ack_valid(ack, len)) {
+        stats.rejected++;
+        ESP_LOGD(TAG, "Dropped malformed or foreign ACK (%d bytes)", (int) len);
+        return;
+    }
+
+    echoed = transport_get_be32(&ack[8]);
+    cumulative = transport_get_be32(&ack[12]);
+    sack = transport_get_be32(&ack[16]);
+
+    for (int i = 0; i < TRANSPORT_WINDOW; i++) {
+        if (slots[i].state != TRANSPORT_SLOT_SENT) {
+            continue;
+        }
+
+        // Only the datagram the ACK answers gives a sample; the others it
+        // covers arrived earlier
+        if (slots[i].seq == echoed) {
+            transport_sample_rtt(i, ack_us);
+        }
+
+        offset = slots[i].seq - cumulative - 1;
+        if (slots[i].seq == echoed || transport_seq_before(slots[i].seq, cumulative) || (offset < 32 && (sack & BIT(offset)))) {
+            transport_resolve(i, true);
+        }
+    }
+}
+#endif
+
+// An expired timer doubles the estimate once, however many datagrams of the
+// window timed out at the same RTO; each of them doubles its own timer
+static void transport_backoff(transport_slot_t *s)
+{
+    uint32_t doubled = s->timeout_ms < rtt.max_ms / 2 ? s->timeout_ms * 2 : rtt.max_ms;
+
+    if (s->timeout_ms >= rto_timeout_ms(&rtt)) {
+        rto_backoff(&rtt);
+    }
+    s->timeout_ms = doubled > rto_timeout_ms(&rtt) ? doubled : rto_timeout_ms(&rtt);
+}
+
+// Retransmits every datagram whose timer ran out, or gives up on it
+static void transport_retransmit_due(void)
+{
+    int64_t now = esp_timer_get_time();
+
+    for (int i = 0; i < TRANSPORT_WINDOW; i++) {
+        if (slots[i].state != TRANSPORT_SLOT_SENT || now < slots[i].sent_us + slots[i].timeout_ms * 1000LL) {
+            continue;
+        }
+
+        if (slots[i].adaptive) {
+            transport_backoff(&slots[i]);
+        }
+
+        if (slots[i].attempts >= slots[i].max_attempts) {
+            transport_resolve(i, false);
+        } else {
+            ESP_LOGI(TAG, "No ACK received. Resending data...");
+            transport_transmit(i);
+        }
+    }
+}
+
+int64_t transport_next_deadline_us(void)
+{
+    int64_t deadline_us = 0;
+    int64_t slot_deadline_us;
+
+    for (int i = 0; i < TRANSPORT_WINDOW; i++) {
+        if (slots[i].state != TRANSPORT_SLOT_SENT) {
+            continue;
+        }
+
+        slot_deadline_us = slots[i].sent_us + slots[i].timeout_ms * 1000LL;
+        if (deadline_us == 0 || slot_deadline_us < deadline_us) {
+            deadline_us = slot_deadline_us;
+        }
+    }
+
+    return deadline_us;
+}
+
+void transport_service(uint32_t wait_ms)
+{
+    uint8_t ack[TRANSPORT_ACK_MAX];
+    int64_t deadline_us = transport_next_deadline_us();
+    int64_t remaining_us;
+    int64_t ack_us;
+    ssize_t len;
+
+    if (deadline_us == 0) {
+        wait_ms = 0;
+    } else {
+        remaining_us = deadline_us - esp_timer_get_time();
+        if (remaining_us <= 0) {
+            wait_ms = 0;
+        } else if ((remaining_us + 999) / 1000 < wait_ms) {
+            wait_ms = (remaining_us + 999) / 1000;
+        }
+    }
+
+    // Every acknowledgement already queued is handled before any timer is
+    // checked, so nothing is resent that was acknowledged while we slept
+    len = transport_io_receive(ack, sizeof(ack), wait_ms, &ack_us);
+    while (len > 0) {
+        transport_handle_ack(ack, len, ack_us);
+        len = transport_io_receive(ack, sizeof(ack), 0, &ack_us);
+    }
+
+    transport_retransmit_due();
+}
+
+size_t transport_in_flight(void)
+{
+    size_t count = 0;
+
+    for (int i = 0; i < TRANSPORT_WINDOW; i++) {
+        count += slots[i].state == TRANSPORT_SLOT_SENT;
+    }
+
+    return count;
+}
+
+bool transport_link_up(void)
+{
+#ifdef CONFIG_UPLINK_TRANSPORT_MQTT
+    return link_up && connected;
+#else
+    return link_up;
+#endif
+}
+
+esp_err_t transport_open(transport_done_cb_t done_cb)
+{
+    on_done = done_cb;
+    ESP_RETURN_ON_ERROR(esp_read_mac(device_id, ESP_MAC_WIFI_STA), TAG, "Unable to read the device ID");
+    next_seq = esp_random();
+    rto_init(&rtt, CONFIG_UPLINK_RTO_MIN_MS, CONFIG_UPLINK_RTO_MAX_MS, CONFIG_UPLINK_RTO_INITIAL_MS);
+    return transport_io_open();
+}
+
+uint8_t *transport_buffer(size_t *size_out)
+{
+    uint32_t start = esp_cpu_get_cycle_count();
+    uint8_t *buf;
+
+    // A buffer whose contents failed to encode is handed out again
+    while (building == TRANSPORT_NO_SLOT && (building = transport_free_slot()) == TRANSPORT_NO_SLOT) {
+        transport_service(UINT32_MAX);
+    }
+
+    buf = transport_io_buffer(building);
+    if (buf == NULL) {
+        return NULL;
+    }
+    slots[building].state = TRANSPORT_SLOT_BUILDING;
+
+    *size_out = TRANSPORT_DATAGRAM_MAX - TRANSPORT_DATA_HEADER_SIZE;
+    buffer_cycles = esp_cpu_get_cycle_count() - start;
+    return buf + TRANSPORT_DATA_HEADER_SIZE;
+}
+
+bool transport_send(size_t len, size_t sample_count, int max_attempts, uint32_t ack_timeout_ms, int *attempts_out)
+{
+    int slot = building;
+    bool acked;
+
+    transport_start(len, sample_count, max_attempts, ack_timeout_ms, false);
+    while (slots[slot].state == TRANSPORT_SLOT_SENT) {
+        transport_service(UINT32_MAX);
+    }
+
+    acked = slots[slot].state == TRANSPORT_SLOT_ACKED;
+    if (attempts_out) {
+        *attempts_out = slots[slot].attempts;
+    }
+
+    transport_io_release(slot);
+    slots[slot].state = TRANSPORT_SLOT_FREE;
+    return acked;
+}
+
+#ifdef CONFIG_UPLINK_ARQ
+void transport_submit(size_t len, const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                      uint32_t tag, int max_attempts, uint32_t ack_timeout_ms)
+{
+    memcpy(slots[building].samples, samples, count * sizeof(samples[0]));
+    slots[building].epoch_offset_us = epoch_offset_us;
+    slots[building].tag = tag;
+    transport_start(len, count, max_attempts, ack_timeout_ms, true);
+}
+#endif
+
+void transport_get_stats(transport_stats_t *stats_out)
+{
+    *stats_out = stats;
+}
+
+void transport_get_rtt(rto_estimator_t *rtt_out)
+{
+    *rtt_out = rtt;
+}
+
+void transport_log_stats(void)
+{
+#if defined(CONFIG_UPLINK_TRANSPORT_LWIP_RAW)
+    const char *path = "lwIP raw";
+#elif defined(CONFIG_UPLINK_TRANSPORT_MQTT)
+    const char *path = "MQTT";
+#elif defined(CONFIG_UPLINK_DTLS)
+    const char *path = "DTLS";
+#else
+    const char *path = "socket";
+#endif
+    char histogram[RTO_HISTOGRAM_BINS * 24];
+    size_t used = 0;
+
+    ESP_LOGI(TAG, "%s: %" PRIu32 " datagrams, %" PRIu32 " attempts, %" PRIu32 " acked, %" PRIu32 " lost, %u in flight, %" PRIu32 " ACKs rejected, handoff cycles last %" PRIu32 ", min %" PRIu32 ", max %" PRIu32 ", mean %" PRIu32,
+             path, stats.datagrams, stats.attempts, stats.acked, stats.lost, (unsigned) transport_in_flight(), stats.rejected,
+             stats.last_cycles, stats.min_cycles, stats.max_cycles, stats.mean_cycles);
+#ifdef CONFIG_UPLINK_DTLS
+    dtls_session_log_stats();
+#endif
+
+    if (!rtt.has_sample) {
+        ESP_LOGI(TAG, "RTT: no samples, RTO %" PRIu32 " ms, %" PRIu32 " timeouts", rto_timeout_ms(&rtt), rtt.timeouts);
+        return;
+    }
+
+    ESP_LOGI(TAG, "RTT: srtt %" PRId64 " us, rttvar %" PRId64 " us, min %" PRId64 " us, max %" PRId64 " us, RTO %" PRIu32 " ms (%u backoffs), %" PRIu32 " samples, %" PRIu32 " timeouts",
+             rtt.srtt_us, rtt.rttvar_us, rtt.min_rtt_us, rtt.max_rtt_us, rto_timeout_ms(&rtt), rtt.backoffs, rtt.samples, rtt.timeouts);
+
+    for (int i = 0; i < RTO_HISTOGRAM_BINS; i++) {
+        used += snprintf(histogram + used, sizeof(histogram) - used, " %s%u:%" PRIu32,
+                         i < RTO_HISTOGRAM_BINS - 1 ? "<" : ">=", 1u << (i < RTO_HISTOGRAM_BINS - 1 ? i : i - 1), rtt.histogram[i]);
+    }
+    ESP_LOGI(TAG, "RTT histogram (ms):%s", histogram);
+}
@@ -0,0 +1,210 @@
+// transport.h
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "rto.h"
+#include "sdkconfig.h"
+#include "sensor_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Notification slot the lwIP backend wakes the sender on when an
+ * acknowledgement arrives. Slot 0 is the sample rings' wakeup; slot 1 is only
+ * used by the scheduler on the sampling task.
+ */
+#define TRANSPORT_ACK_NOTIFY_INDEX  1
+
+/**
+ * Wire format, all integers big-endian:
+ *
+ * - Data: magic, version, 6-byte device ID (the Wi-Fi station MAC), u32
+ *   sequence number, u32 window base, then the encoded batch. The base is
+ *   the oldest sequence the device still has in flight: the collector stops
+ *   waiting for anything before it, which is how it learns about datagrams
+ *   the device gave up on.
+ * - ACK:  magic, version, device ID, u32 sequence of the datagram being
+ *   answered, u32 cumulative sequence (every datagram before it has
+ *   arrived), u32 selective-ACK bitmap (bit i set: cumulative + 1 + i has
+ *   arrived too).
+ *
+ * The collector answers every datagram, duplicates included, and stores a
+ * datagram only the first time it sees its (device ID, sequence): that is
+ * what makes resending safe. The first sequence number is random per boot,
+ * so a base far from the collector's cumulative sequence means the device
+ * restarted. Samples the device gave up on are stored and sent again later
+ * under a new sequence number; for exactly-once storage across that path
+ * the collector also keys samples by device, sensor and timestamp.
+ *
+ * The device drops ACKs with another device ID, a wrong length, or a
+ * sequence it has not sent yet. Without CONFIG_UPLINK_ARQ the window holds a
+ * single datagram.
+ */
+#define TRANSPORT_DATA_MAGIC        0xA7
+#define TRANSPORT_ACK_MAGIC         0xA8
+#define TRANSPORT_PROTOCOL_VERSION  2
+#define TRANSPORT_DEVICE_ID_SIZE    6
+#define TRANSPORT_DATA_HEADER_SIZE  16
+#define TRANSPORT_ACK_SIZE          20
+
+/**
+ * Pass as the ACK timeout to arm the retransmission timer from the measured
+ * round-trip time rather than a fixed value. The timer starts at the current
+ * RTO estimate and doubles, up to CONFIG_UPLINK_RTO_MAX_MS, every time it runs
+ * out.
+ */
+#define TRANSPORT_TIMEOUT_ADAPTIVE  0
+
+typedef struct {
+    uint32_t datagrams;             // Distinct datagrams handed to the transport
+    uint32_t attempts;              // Transmissions, retries included
+    uint32_t acked;
+    uint32_t lost;                  // Ran out of attempts
+    uint32_t rejected;              // ACKs dropped by validation
+    uint32_t last_cycles;           // Buffer acquisition plus first handoff to lwIP
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint32_t mean_cycles;           // EMA, alpha = 1/16
+} transport_stats_t;
+
+/**
+ * Called once a submitted datagram is acknowledged or runs out of attempts,
+ * from whichever transport call noticed it, with the samples, epoch offset
+ * and tag it was submitted with.
+ */
+typedef void (*transport_done_cb_t)(const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                                    uint32_t tag, bool acked);
+
+/**
+ * Datagram transport to the collector, one backend per build
+ * (CONFIG_UPLINK_TRANSPORT):
+ *
+ * - socket: BSD sockets. Datagrams are encoded into static buffers, and
+ *   sendto() copies them into a pbuf in the tcpip thread. With
+ *   CONFIG_UPLINK_DTLS every datagram and ACK travels as a DTLS record
+ *   (dtls_session.h), and the usable size shrinks by DTLS_SESSION_OVERHEAD.
+ * - lwIP raw: datagrams are encoded straight into the payload of a PBUF_RAM
+ *   pbuf allocated with room for the UDP/IP/link headers, and sent with
+ *   udp_send() inside the tcpip context, with no copy and no socket mailbox.
+ * - MQTT: each datagram, header included, is published with QoS 1 to
+ *   CONFIG_UPLINK_MQTT_TOPIC. The broker's PUBACK stands in for the
+ *   collector's ACK and the client does the resending, so every datagram gets
+ *   a single attempt whose timer (CONFIG_UPLINK_MQTT_ACK_TIMEOUT_MS) only
+ *   bounds how long it may wait. The outbox can keep the publishes in flash
+ *   across resets (CONFIG_UPLINK_MQTT_FLASH_OUTBOX).
+ *
+ * Usage per datagram: transport_buffer(), encode into it, then either
+ * transport_send() to wait for the acknowledgement, or, with
+ * CONFIG_UPLINK_ARQ, transport_submit() to leave it in the window while the
+ * next one is built. The window has one slot more than
+ * CONFIG_UPLINK_ARQ_WINDOW: callers keep submitted datagrams to that many in
+ * flight, so transport_send() always finds a free slot without waiting.
+ * Only the sender task calls into the transport.
+ */
+
+/**
+ * @brief Creates the endpoint and binds the local port.
+ *
+ * @param done_cb Receives the outcome of every submitted datagram. May be
+ *                NULL.
+ */
+esp_err_t transport_open(transport_done_cb_t done_cb);
+
+/**
+ * @brief Returns where to encode the next datagram.
+ *
+ * With a full window this services the transport until a datagram is
+ * acknowledged or given up on. If the previous buffer was never sent, for
+ * instance because encoding failed, it is handed out again.
+ *
+ * @param size_out Receives the usable size: the uplink MTU, less any DTLS
+ *                 record overhead, capped at MAX_CBOR_BUFFER_SIZE, less the
+ *                 sequence header.
+ * @return NULL if no buffer could be allocated.
+ */
+uint8_t *transport_buffer(size_t *size_out);
+
+/**
+ * @brief Sends the first @p len bytes of the buffer from transport_buffer()
+ * and waits for its acknowledgement, retrying up to @p max_attempts times.
+ * Submitted datagrams keep being serviced meanwhile. The buffer is released
+ * either way.
+ *
+ * @param sample_count Samples in the datagram, for logging.
+ * @param ack_timeout_ms Per attempt, or TRANSPORT_TIMEOUT_ADAPTIVE.
+ * @param attempts_out Optional; receives the number of transmissions.
+ * @return true if the datagram was acknowledged.
+ */
+bool transport_send(size_t len, size_t sample_count, int max_attempts, uint32_t ack_timeout_ms, int *attempts_out);
+
+#ifdef CONFIG_UPLINK_ARQ
+/**
+ * @brief Sends the first @p len bytes of the buffer from transport_buffer()
+ * and returns without waiting. The datagram is resent every
+ * @p ack_timeout_ms (or TRANSPORT_TIMEOUT_ADAPTIVE) until acknowledged, at
+ * most @p max_attempts times in all. Either way the done callback gets
+ * @p samples back.
+ *
+ * @param samples The samples the datagram carries; they are copied.
+ * @param epoch_offset_us What the encoder added to their acquired_us: 0 for
+ *                        samples that already carry wall-clock time.
+ * @param tag Handed back to the done callback as is.
+ */
+void transport_submit(size_t len, const sensor_sample_t *samples, size_t count, int64_t epoch_offset_us,
+                      uint32_t tag, int max_attempts, uint32_t ack_timeout_ms);
+#endif
+
+/**
+ * @brief Handles queued acknowledgements, waiting up to @p wait_ms (or the
+ * next retransmission timer, if sooner) for one, then resends or gives up on
+ * every datagram whose timer ran out.
+ */
+void transport_service(uint32_t wait_ms);
+
+/**
+ * @brief esp_timer time at which the next datagram in flight is resent or
+ * given up on, or 0 if none is in flight.
+ */
+int64_t transport_next_deadline_us(void);
+
+/**
+ * @brief Datagrams sent and not yet acknowledged or given up on.
+ */
+size_t transport_in_flight(void);
+
+/**
+ * @brief Whether the most recently resolved datagram was acknowledged.
+ */
+bool transport_link_up(void);
+
+/**
+ * @brief Copies the counters. Meant for periodic reports from any task.
+ */
+void transport_get_stats(transport_stats_t *stats_out);
+
+/**
+ * @brief Copies the round-trip time estimate and histogram. Every datagram
+ * acknowledged after a single transmission contributes a sample, whatever
+ * its timeout. With sockets that only counts ACKs that arrive while the
+ * sender is waiting for them: one found by a poll has no arrival time.
+ */
+void transport_get_rtt(rto_estimator_t *rtt_out);
+
+/**
+ * @brief Logs the counters, handoff cycle counts and the RTT estimate and
+ * histogram. It reads the live window and session state, so like the rest
+ * of the transport it is for the sender task only.
+ */
+void transport_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TRANSPORT_H
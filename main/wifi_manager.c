@@ -18,6 +18,9 @@
 
 // static const char *TAG = "Temp/Humidity Sensor";
 static EventGroupHandle_t wifi_event_group;
+#ifdef CONFIG_STATIC_MEMORY
+static StaticEventGroup_t wifi_event_group_storage;
+#endif
 static int wifi_connect_retries = 0;
 
 static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
@@ -51,7 +54,11 @@ static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_b
 
 esp_err_t wifi_manager_start(void)
 {
+#ifdef CONFIG_STATIC_MEMORY
+    wifi_event_group = xEventGroupCreateStatic(&wifi_event_group_storage);
+#else
     wifi_event_group = xEventGroupCreate();
+#endif
 
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
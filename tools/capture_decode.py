@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""Decode AHT20 raw-frame captures into a timestamped CSV series.
+
+The firmware's capture mode (CONFIG_CAPTURE_MODE) streams chunks of raw
+frames over UDP; see main/capture.h for the format. Either receive them
+directly:
+
+    tools/capture_decode.py --listen 9998 > run.csv
+
+or decode a file of chunks saved back to back (e.g. with --save):
+
+    tools/capture_decode.py capture.bin > run.csv
+"""
+
+import argparse
+import socket
+import struct
+import sys
+
+MAGIC = 0x31434841
+HEADER = struct.Struct("<IIqIHBB")
+RECORD_PREFIX = struct.Struct("<IB")
+OFFSET_WRAP = 1 << 32
+
+
+class Decoder:
+    def __init__(self, out):
+        self.out = out
+        self.expected_seq = None
+        self.last_offset = {}
+        self.wraps = {}
+        out.write("epoch_us,sensor_id,temperature_c,humidity_rh,status\n")
+
+    def chunk(self, data):
+        """Decodes one chunk; returns the bytes consumed."""
+        magic, seq, start_epoch_us, dropped, count, record_len, frame_len = HEADER.unpack_from(data)
+        if magic != MAGIC:
+            raise ValueError("bad chunk magic 0x%08x" % magic)
+
+        if self.expected_seq is not None and seq != self.expected_seq:
+            print("warning: chunks %d-%d missing" % (self.expected_seq, seq - 1), file=sys.stderr)
+        self.expected_seq = seq + 1
+        if dropped:
+            print("warning: %d records dropped on device so far" % dropped, file=sys.stderr)
+
+        pos = HEADER.size
+        for _ in range(count):
+            offset_us, sensor_id = RECORD_PREFIX.unpack_from(data, pos)
+            frame = data[pos + RECORD_PREFIX.size:pos + RECORD_PREFIX.size + frame_len]
+            pos += record_len
+            self.record(start_epoch_us, offset_us, sensor_id, frame)
+
+        return pos
+
+    def record(self, start_epoch_us, offset_us, sensor_id, frame):
+        # Offsets are 32-bit microseconds; unwrap per sensor since each
+        # sensor's frames arrive in order
+        if offset_us < self.last_offset.get(sensor_id, 0):
+            self.wraps[sensor_id] = self.wraps.get(sensor_id, 0) + 1
+        self.last_offset[sensor_id] = offset_us
+        epoch_us = start_epoch_us + self.wraps.get(sensor_id, 0) * OFFSET_WRAP + offset_us
+
+        raw_humidity = (frame[1] << 12) | (frame[2] << 4) | (frame[3] >> 4)
+        raw_temperature = ((frame[3] & 0x0F) << 16) | (frame[4] << 8) | frame[5]
+        temperature = raw_temperature * 200.0 / (1 << 20) - 50
+        humidity = raw_humidity * 100.0 / (1 << 20)
+
+        self.out.write("%d,%d,%.4f,%.4f,0x%02x\n" % (epoch_us, sensor_id, temperature, humidity, frame[0]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("file", nargs="?", help="file of concatenated capture chunks")
+    parser.add_argument("--listen", type=int, metavar="PORT", help="receive chunks over UDP instead")
+    parser.add_argument("--save", metavar="FILE", help="with --listen, also append raw chunks to FILE")
+    args = parser.parse_args()
+
+    decoder = Decoder(sys.stdout)
+
+    if args.listen:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind(("", args.listen))
+        save = open(args.save, "ab") if args.save else None
+        try:
+            while True:
+                data, _ = sock.recvfrom(65535)
+                if save:
+                    save.write(data)
+                decoder.chunk(data)
+                sys.stdout.flush()
+        except KeyboardInterrupt:
+            pass
+        return
+
+    if not args.file:
+        parser.error("give a capture file or --listen PORT")
+
+    with open(args.file, "rb") as f:
+        data = f.read()
+    pos = 0
+    while pos + HEADER.size <= len(data):
+        pos += decoder.chunk(data[pos:])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,717 @@
+/*
+ * DTLS 1.2 collector for local testing of the firmware's CONFIG_UPLINK_DTLS
+ * mode (main/dtls_session.h).
+ *
+ * It accepts PSK sessions, issues RFC 5077 tickets and caches session IDs so
+ * devices can resume, hands every device an RFC 9146 connection ID and
+ * follows it across address changes, and answers each datagram with the
+ * uplink ACK from main/transport.h: cumulative sequence plus selective-ACK
+ * bitmap, per device ID. Every record's decryption and every ACK's
+ * encryption is timed, socket calls excluded, and summarised every --report
+ * seconds and on exit.
+ *
+ * Build against the vendored mbedtls (3.x, stock configuration):
+ *
+ *   cmake -S components/components/mbedtls/mbedtls -B build/mbedtls \
+ *         -DENABLE_TESTING=OFF -DENABLE_PROGRAMS=OFF
+ *   cmake --build build/mbedtls
+ *   cc -O2 -o build/dtls_collector tools/dtls_collector.c \
+ *      -Icomponents/components/mbedtls/mbedtls/include \
+ *      -Lbuild/mbedtls/library -lmbedtls -lmbedx509 -lmbedcrypto
+ *
+ * and run it with the key from config.h and the port from UDP_SERVER_PORT:
+ *
+ *   build/dtls_collector --port 5683 --psk 000102030405060708090a0b0c0d0e0f
+ *
+ * Every identity shares the one key; a production collector looks the key up
+ * by identity ("sensor-" and the device ID in hex).
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_cache.h"
+#include "mbedtls/ssl_cookie.h"
+#include "mbedtls/ssl_ticket.h"
+
+#if !defined(MBEDTLS_SSL_PROTO_DTLS) || !defined(MBEDTLS_SSL_DTLS_CONNECTION_ID) || !defined(MBEDTLS_SSL_SESSION_TICKETS)
+#error "mbedtls needs DTLS, connection IDs and session tickets"
+#endif
+
+#define MAX_SESSIONS        64
+#define MAX_DEVICES         64
+#define CID_SIZE            4
+#define DATAGRAM_MAX        2048
+#define IDLE_TIMEOUT_S      600
+
+/* Wire format, see main/transport.h */
+#define DATA_MAGIC          0xA7
+#define ACK_MAGIC           0xA8
+#define PROTOCOL_VERSION    2
+#define DEVICE_ID_SIZE      6
+#define DATA_HEADER_SIZE    16
+#define ACK_SIZE            20
+#define SACK_BITS           32
+
+#define RECORD_TYPE_CID     25
+#define RECORD_CID_OFFSET   11
+
+typedef struct {
+    int64_t intermediate_ns;
+    int64_t final_ns;
+} dtls_timer_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t bytes;
+} cost_t;
+
+typedef struct {
+    bool used;
+    bool established;
+    bool full;                      /* The PSK callback ran: not a resumption */
+    mbedtls_ssl_context ssl;
+    dtls_timer_t timer;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    unsigned char cid[CID_SIZE];
+    const unsigned char *pending;   /* The datagram being handed to mbedtls */
+    size_t pending_len;
+    int64_t last_ns;
+} session_t;
+
+typedef struct {
+    bool used;
+    uint8_t id[DEVICE_ID_SIZE];
+    uint32_t cumulative;            /* Every sequence before it has arrived */
+    uint32_t received;              /* Bit i: cumulative + 1 + i has arrived */
+    uint64_t datagrams;
+    uint64_t duplicates;
+} device_t;
+
+static int sock = -1;
+static unsigned char psk[32];
+static size_t psk_len;
+static bool verbose;
+static volatile sig_atomic_t stop;
+
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context drbg;
+static mbedtls_ssl_config conf;
+static mbedtls_ssl_cookie_ctx cookies;
+static mbedtls_ssl_ticket_context tickets;
+static mbedtls_ssl_cache_context cache;
+
+static session_t sessions[MAX_SESSIONS];
+static device_t devices[MAX_DEVICES];
+static uint64_t io_ns;              /* Spent in socket calls since the last reset */
+static cost_t decrypt_cost;
+static cost_t encrypt_cost;
+static uint64_t full_handshakes;
+static uint64_t resumed_handshakes;
+static uint64_t rebinds;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cost_add(cost_t *cost, uint64_t ns, size_t bytes)
+{
+    if (cost->count == 0 || ns < cost->min_ns) {
+        cost->min_ns = ns;
+    }
+    if (ns > cost->max_ns) {
+        cost->max_ns = ns;
+    }
+    cost->count++;
+    cost->total_ns += ns;
+    cost->bytes += bytes;
+}
+
+static void cost_print(const char *name, const cost_t *cost)
+{
+    if (cost->count == 0) {
+        printf("  %s: no records\n", name);
+        return;
+    }
+    printf("  %s: %" PRIu64 " records, mean %.1f us (min %.1f, max %.1f), %.1f plaintext bytes each\n",
+           name, cost->count, cost->total_ns / 1000.0 / cost->count, cost->min_ns / 1000.0, cost->max_ns / 1000.0,
+           (double) cost->bytes / cost->count);
+}
+
+static void report(void)
+{
+    int active = 0;
+
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        active += sessions[i].used && sessions[i].established;
+    }
+    printf("%d session(s), %" PRIu64 " full / %" PRIu64 " resumed handshakes, %" PRIu64 " address change(s)\n",
+           active, full_handshakes, resumed_handshakes, rebinds);
+    cost_print("decrypt", &decrypt_cost);
+    cost_print("encrypt", &encrypt_cost);
+    for (int i = 0; i < MAX_DEVICES; i++) {
+        if (devices[i].used) {
+            printf("  device %02x%02x%02x%02x%02x%02x: %" PRIu64 " datagrams, %" PRIu64 " duplicates, cumulative %" PRIu32 "\n",
+                   devices[i].id[0], devices[i].id[1], devices[i].id[2], devices[i].id[3], devices[i].id[4], devices[i].id[5],
+                   devices[i].datagrams, devices[i].duplicates, devices[i].cumulative);
+        }
+    }
+    fflush(stdout);
+}
+
+/* mbedtls callbacks */
+
+static void set_timer(void *ctx, uint32_t intermediate_ms, uint32_t final_ms)
+{
+    dtls_timer_t *t = ctx;
+    int64_t now = now_ns();
+
+    t->intermediate_ns = now + (int64_t) intermediate_ms * 1000000;
+    t->final_ns = final_ms == 0 ? 0 : now + (int64_t) final_ms * 1000000;
+}
+
+static int get_timer(void *ctx)
+{
+    dtls_timer_t *t = ctx;
+    int64_t now;
+
+    if (t->final_ns == 0) {
+        return -1;
+    }
+    now = now_ns();
+    if (now >= t->final_ns) {
+        return 2;
+    }
+    return now >= t->intermediate_ns ? 1 : 0;
+}
+
+static int bio_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    session_t *s = ctx;
+    int64_t start = now_ns();
+
+    sendto(sock, buf, len, 0, (const struct sockaddr *) &s->peer, s->peer_len);
+    io_ns += now_ns() - start;
+    return (int) len;
+}
+
+static int bio_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    session_t *s = ctx;
+    size_t n = s->pending_len;
+
+    if (s->pending == NULL) {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, s->pending, n);
+    s->pending = NULL;
+    return (int) n;
+}
+
+static int psk_callback(void *ctx, mbedtls_ssl_context *ssl, const unsigned char *identity, size_t len)
+{
+    session_t *s = mbedtls_ssl_get_user_data_p(ssl);
+
+    s->full = true;
+    if (verbose) {
+        printf("PSK identity %.*s\n", (int) len, identity);
+    }
+    return mbedtls_ssl_set_hs_psk(ssl, psk, psk_len);
+}
+
+/* Sessions */
+
+static bool same_peer(const session_t *s, const struct sockaddr_storage *addr, socklen_t len)
+{
+    return s->peer_len == len && memcmp(&s->peer, addr, len) == 0;
+}
+
+static void session_free(session_t *s)
+{
+    mbedtls_ssl_free(&s->ssl);
+    memset(s, 0, sizeof(*s));
+}
+
+static session_t *session_by_cid(const unsigned char *cid)
+{
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].used && memcmp(sessions[i].cid, cid, CID_SIZE) == 0) {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+static session_t *session_by_peer(const struct sockaddr_storage *addr, socklen_t len)
+{
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].used && same_peer(&sessions[i], addr, len)) {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+static int session_reset(session_t *s)
+{
+    int ret = mbedtls_ssl_session_reset(&s->ssl);
+
+    s->full = false;
+    s->established = false;
+    if (ret == 0) {
+        /* Cookies are bound to the client's address */
+        ret = mbedtls_ssl_set_client_transport_id(&s->ssl, (const unsigned char *) &s->peer, s->peer_len);
+    }
+    return ret;
+}
+
+static session_t *session_new(const struct sockaddr_storage *addr, socklen_t len)
+{
+    session_t *s = NULL;
+
+    for (int i = 0; i < MAX_SESSIONS && s == NULL; i++) {
+        if (!sessions[i].used) {
+            s = &sessions[i];
+        }
+    }
+    if (s == NULL) {
+        return NULL;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->used = true;
+    memcpy(&s->peer, addr, len);
+    s->peer_len = len;
+    do {
+        mbedtls_ctr_drbg_random(&drbg, s->cid, CID_SIZE);
+    } while (session_by_cid(s->cid) != s);
+
+    mbedtls_ssl_init(&s->ssl);
+    if (mbedtls_ssl_setup(&s->ssl, &conf) != 0
+        || mbedtls_ssl_set_cid(&s->ssl, MBEDTLS_SSL_CID_ENABLED, s->cid, CID_SIZE) != 0
+        || session_reset(s) != 0) {
+        session_free(s);
+        return NULL;
+    }
+    mbedtls_ssl_set_user_data_p(&s->ssl, s);
+    mbedtls_ssl_set_bio(&s->ssl, s, bio_send, bio_recv, NULL);
+    mbedtls_ssl_set_timer_cb(&s->ssl, &s->timer, set_timer, get_timer);
+    return s;
+}
+
+/* Collector */
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static bool seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+static device_t *device_find(const uint8_t *id, uint32_t base)
+{
+    device_t *free_slot = NULL;
+
+    for (int i = 0; i < MAX_DEVICES; i++) {
+        if (devices[i].used && memcmp(devices[i].id, id, DEVICE_ID_SIZE) == 0) {
+            return &devices[i];
+        }
+        if (!devices[i].used && free_slot == NULL) {
+            free_slot = &devices[i];
+        }
+    }
+    if (free_slot != NULL) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        free_slot->used = true;
+        memcpy(free_slot->id, id, DEVICE_ID_SIZE);
+        free_slot->cumulative = base;
+    }
+    return free_slot;
+}
+
+/* Records seq, returns false for a duplicate */
+static bool device_receive(device_t *d, uint32_t seq, uint32_t base)
+{
+    uint32_t offset;
+    bool fresh;
+
+    /* A base far ahead means a restart or datagrams given up on */
+    if (seq_before(d->cumulative, base)) {
+        offset = base - d->cumulative;
+        d->received = offset > SACK_BITS ? 0 : (uint32_t) ((uint64_t) d->received >> offset);
+        d->cumulative = base;
+    }
+
+    if (seq_before(seq, d->cumulative)) {
+        return false;
+    }
+    if (seq == d->cumulative) {
+        fresh = true;
+        d->cumulative++;
+    } else {
+        offset = seq - d->cumulative - 1;
+        if (offset >= SACK_BITS) {
+            return true;            /* Beyond the bitmap: store it, the resend will be a duplicate */
+        }
+        fresh = (d->received & (1u << offset)) == 0;
+        d->received |= 1u << offset;
+    }
+
+    while (d->received & 1) {
+        d->received >>= 1;
+        d->cumulative++;
+    }
+    return fresh;
+}
+
+static void handle_datagram(session_t *s, const uint8_t *data, size_t len)
+{
+    uint8_t ack[ACK_SIZE];
+    device_t *d;
+    uint32_t seq;
+    uint32_t base;
+    int64_t start;
+    int ret;
+
+    if (len < DATA_HEADER_SIZE || data[0] != DATA_MAGIC || data[1] != PROTOCOL_VERSION) {
+        if (verbose) {
+            printf("Dropped %zu bytes that are not an uplink datagram\n", len);
+        }
+        return;
+    }
+
+    seq = get_be32(&data[8]);
+    base = get_be32(&data[12]);
+    d = device_find(&data[2], base);
+    if (d == NULL) {
+        return;
+    }
+
+    d->datagrams++;
+    if (!device_receive(d, seq, base)) {
+        d->duplicates++;
+    }
+    if (verbose) {
+        printf("Datagram %" PRIu32 ", %zu bytes, cumulative %" PRIu32 "\n", seq, len, d->cumulative);
+    }
+
+    ack[0] = ACK_MAGIC;
+    ack[1] = PROTOCOL_VERSION;
+    memcpy(&ack[2], d->id, DEVICE_ID_SIZE);
+    put_be32(&ack[8], seq);
+    put_be32(&ack[12], d->cumulative);
+    put_be32(&ack[16], d->received);
+
+    io_ns = 0;
+    start = now_ns();
+    ret = mbedtls_ssl_write(&s->ssl, ack, sizeof(ack));
+    if (ret > 0) {
+        cost_add(&encrypt_cost, now_ns() - start - io_ns, sizeof(ack));
+    }
+}
+
+static void session_step(session_t *s)
+{
+    unsigned char buf[DATAGRAM_MAX];
+    int64_t start;
+    int ret;
+
+    if (!s->established) {
+        ret = mbedtls_ssl_handshake(&s->ssl);
+        if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+            session_reset(s);
+            return;
+        }
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return;
+        }
+        if (ret != 0) {
+            if (verbose) {
+                printf("Handshake failed: -0x%04x\n", (unsigned) -ret);
+            }
+            session_free(s);
+            return;
+        }
+
+        s->established = true;
+        if (s->full) {
+            full_handshakes++;
+        } else {
+            resumed_handshakes++;
+        }
+        printf("%s handshake, %s, CID %02x%02x%02x%02x\n", s->full ? "Full" : "Abbreviated",
+               mbedtls_ssl_get_ciphersuite(&s->ssl), s->cid[0], s->cid[1], s->cid[2], s->cid[3]);
+    }
+
+    for (;;) {
+        io_ns = 0;
+        start = now_ns();
+        ret = mbedtls_ssl_read(&s->ssl, buf, sizeof(buf));
+        if (ret <= 0) {
+            break;
+        }
+        cost_add(&decrypt_cost, now_ns() - start - io_ns, (size_t) ret);
+        handle_datagram(s, buf, (size_t) ret);
+    }
+
+    /* A new ClientHello from the same address: the device lost its session
+     * or is resuming it, and mbedtls has already reset this one */
+    if (ret == MBEDTLS_ERR_SSL_CLIENT_RECONNECT) {
+        s->established = false;
+        s->full = false;
+        session_step(s);
+    } else if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE) {
+        printf("Session closed by the peer\n");
+        session_free(s);
+    }
+}
+
+static void on_datagram(const unsigned char *buf, size_t len, const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    session_t *s = NULL;
+    bool moved;
+
+    if (len > RECORD_CID_OFFSET + CID_SIZE && buf[0] == RECORD_TYPE_CID) {
+        s = session_by_cid(&buf[RECORD_CID_OFFSET]);
+    }
+    if (s == NULL) {
+        s = session_by_peer(addr, addr_len);
+    }
+    if (s == NULL) {
+        s = session_new(addr, addr_len);
+    }
+    if (s == NULL) {
+        return;
+    }
+
+    /* Replies follow the newest authenticated record, which may come from a
+     * new address after a NAT rebinding or reconnect */
+    moved = !same_peer(s, addr, addr_len);
+    s->pending = buf;
+    s->pending_len = len;
+    if (moved && s->established) {
+        struct sockaddr_storage old = s->peer;
+        socklen_t old_len = s->peer_len;
+        uint64_t before = decrypt_cost.count;
+
+        memcpy(&s->peer, addr, addr_len);
+        s->peer_len = addr_len;
+        session_step(s);
+        if (s->used && decrypt_cost.count == before) {
+            s->peer = old;
+            s->peer_len = old_len;
+        } else if (s->used) {
+            rebinds++;
+            printf("Session %02x%02x%02x%02x moved\n", s->cid[0], s->cid[1], s->cid[2], s->cid[3]);
+        }
+    } else {
+        session_step(s);
+    }
+    if (s->used) {
+        s->pending = NULL;
+        s->last_ns = now_ns();
+    }
+}
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static bool parse_hex(const char *hex, unsigned char *out, size_t size, size_t *len)
+{
+    size_t digits = strlen(hex);
+    unsigned int byte;
+
+    if (digits == 0 || digits % 2 != 0 || digits / 2 > size) {
+        return false;
+    }
+    for (*len = 0; *len < digits / 2; (*len)++) {
+        if (sscanf(&hex[2 * *len], "%2x", &byte) != 1) {
+            return false;
+        }
+        out[*len] = (unsigned char) byte;
+    }
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s --psk HEX [--port N] [--report SECONDS] [--ticket-lifetime SECONDS] [--verbose]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "psk", required_argument, NULL, 'k' },
+        { "report", required_argument, NULL, 'r' },
+        { "ticket-lifetime", required_argument, NULL, 't' },
+        { "verbose", no_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 },
+    };
+    static const int ciphersuites[] = {
+        MBEDTLS_TLS_PSK_WITH_AES_128_CCM_8,
+        MBEDTLS_TLS_PSK_WITH_AES_128_GCM_SHA256,
+        0,
+    };
+    struct sockaddr_in local = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY };
+    unsigned char buf[DATAGRAM_MAX];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    struct timeval tv;
+    fd_set fds;
+    int port = 5683;
+    int report_s = 10;
+    int ticket_lifetime_s = 86400;
+    int64_t next_report;
+    ssize_t len;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "p:k:r:t:v", options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'k':
+            if (!parse_hex(optarg, psk, sizeof(psk), &psk_len)) {
+                fprintf(stderr, "--psk takes 1 to %zu bytes in hex\n", sizeof(psk));
+                return 2;
+            }
+            break;
+        case 'r':
+            report_s = atoi(optarg);
+            break;
+        case 't':
+            ticket_lifetime_s = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (psk_len == 0) {
+        usage(argv[0]);
+    }
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_ssl_cookie_init(&cookies);
+    mbedtls_ssl_ticket_init(&tickets);
+    mbedtls_ssl_cache_init(&cache);
+
+    if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char *) "dtls_collector", 14) != 0
+        || mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_DATAGRAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0
+        || mbedtls_ssl_cookie_setup(&cookies, mbedtls_ctr_drbg_random, &drbg) != 0
+        || mbedtls_ssl_ticket_setup(&tickets, mbedtls_ctr_drbg_random, &drbg, MBEDTLS_CIPHER_AES_256_GCM, ticket_lifetime_s) != 0
+        || mbedtls_ssl_conf_cid(&conf, CID_SIZE, MBEDTLS_SSL_UNEXPECTED_CID_IGNORE) != 0) {
+        fprintf(stderr, "Unable to set up mbedtls\n");
+        return 1;
+    }
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+    mbedtls_ssl_conf_ciphersuites(&conf, ciphersuites);
+    mbedtls_ssl_conf_psk_cb(&conf, psk_callback, NULL);
+    mbedtls_ssl_conf_dtls_cookies(&conf, mbedtls_ssl_cookie_write, mbedtls_ssl_cookie_check, &cookies);
+    mbedtls_ssl_conf_session_tickets_cb(&conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &tickets);
+    mbedtls_ssl_conf_session_cache(&conf, &cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    local.sin_port = htons(port);
+    if (sock < 0 || bind(sock, (struct sockaddr *) &local, sizeof(local)) < 0) {
+        perror("bind");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("Listening on UDP port %d\n", port);
+    fflush(stdout);
+
+    next_report = now_ns() + (int64_t) report_s * 1000000000;
+    while (!stop) {
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 50000;
+
+        if (select(sock + 1, &fds, NULL, NULL, &tv) > 0) {
+            addr_len = sizeof(addr);
+            len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &addr, &addr_len);
+            if (len > 0) {
+                on_datagram(buf, (size_t) len, &addr, addr_len);
+            }
+        }
+
+        /* Retransmit handshake flights whose timer ran out; drop idle sessions */
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            if (!sessions[i].used) {
+                continue;
+            }
+            if (now_ns() - sessions[i].last_ns > (int64_t) IDLE_TIMEOUT_S * 1000000000) {
+                session_free(&sessions[i]);
+            } else if (!sessions[i].established && get_timer(&sessions[i].timer) == 2) {
+                session_step(&sessions[i]);
+            }
+        }
+
+        if (report_s > 0 && now_ns() >= next_report) {
+            report();
+            next_report += (int64_t) report_s * 1000000000;
+        }
+    }
+
+    report();
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].used) {
+            session_free(&sessions[i]);
+        }
+    }
+    mbedtls_ssl_cache_free(&cache);
+    mbedtls_ssl_ticket_free(&tickets);
+    mbedtls_ssl_cookie_free(&cookies);
+    mbedtls_ssl_config_free(&conf);
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Round-trip check and benchmark for the columnar batch format
+ * (main/sample_codec.h), built from the firmware's own sample_codec.c.
+ *
+ * It generates readings the way the firmware batches them: several sensors
+ * read every period, rows in acquisition order, values from a slow random
+ * walk of AHT20 codes. Each value representation is encoded, decoded and
+ * compared row by row. The report covers bytes per sample against the
+ * original one-map-per-sample CBOR payload, and encode and decode time per
+ * row. A last pass decodes corrupted copies of every batch, which must fail
+ * cleanly; build with -fsanitize=address,undefined to check that too.
+ *
+ *   cc -O2 -Wall -Wextra -Imain -o build/sample_codec_bench \
+ *      tools/sample_codec_bench.c main/sample_codec.c
+ *   build/sample_codec_bench [--sensors N] [--rows N] [--batches N] [--period-ms N]
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sample_codec.h"
+
+#define MAX_SENSORS         16
+#define MAX_ROWS            256
+#define TIME_RESOLUTION_US  1000        /* PAYLOAD_COLUMNAR_TIME_RESOLUTION_US */
+#define EPOCH_START_US      1760000000000000LL
+#define FUZZ_ROUNDS         2000
+
+/*
+ * The payload before batching: {"temp_c": float, "hmd": float, "time": uint}
+ * per datagram, time in epoch seconds. Map header 1, keys 7 + 4 + 5, floats
+ * 5 + 5, a 32-bit uint 5.
+ */
+#define CBOR_MAP_BYTES      32
+
+typedef enum {
+    REPR_CENTI,
+    REPR_CENTI_SPREAD,
+    REPR_RAW,
+    REPR_FLOAT,
+    REPR_COUNT,
+} repr_t;
+
+static const char *const REPR_NAMES[REPR_COUNT] = {
+    [REPR_CENTI]        = "centi-units",
+    [REPR_CENTI_SPREAD] = "centi-units + spread",
+    [REPR_RAW]          = "raw codes",
+    [REPR_FLOAT]        = "float (XOR)",
+};
+
+typedef struct {
+    int32_t temperature;    /* 20-bit AHT20 codes */
+    int32_t humidity;
+    int64_t next_us;
+} sensor_t;
+
+static sample_codec_row_t rows[MAX_ROWS];
+static sample_codec_row_t decoded[MAX_ROWS];
+static uint8_t buf[SAMPLE_CODEC_MAX_SIZE(MAX_ROWS)];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* sensor_code_to_centi() with the AHT20's constants */
+static int32_t centi(int32_t code, int32_t mul, int32_t offset)
+{
+    return (int32_t) (((int64_t) code * mul + (1 << 19)) >> 20) + offset;
+}
+
+static uint32_t float_bits(float f)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static int rand_between(int lo, int hi)
+{
+    return lo + rand() % (hi - lo + 1);
+}
+
+static void make_row(repr_t repr, sensor_t *sensor, uint8_t id, sample_codec_row_t *row)
+{
+    int32_t t_spread = rand_between(0, 300);
+    int32_t h_spread = rand_between(0, 600);
+
+    sensor->temperature += rand_between(-128, 128);
+    sensor->humidity += rand_between(-256, 256);
+
+    memset(row, 0, sizeof(*row));
+    row->sensor_id = id;
+    row->time_us = sensor->next_us;
+
+    switch (repr) {
+    case REPR_CENTI_SPREAD:
+        row->values[2] = (uint32_t) centi(t_spread, 20000, 0);
+        row->values[3] = (uint32_t) centi(h_spread, 10000, 0);
+        /* fall through */
+    case REPR_CENTI:
+        row->values[0] = (uint32_t) centi(sensor->temperature, 20000, -5000);
+        row->values[1] = (uint32_t) centi(sensor->humidity, 10000, 0);
+        break;
+    case REPR_RAW:
+        row->values[0] = (uint32_t) sensor->temperature;
+        row->values[1] = (uint32_t) sensor->humidity;
+        break;
+    default:
+        row->values[0] = float_bits((float) sensor->temperature * 0.000190735f - 50.0f);
+        row->values[1] = float_bits((float) sensor->humidity * 0.000095367f);
+        break;
+    }
+}
+
+/* The next `count` rows, in acquisition order across all sensors */
+static void make_batch(repr_t repr, sensor_t *sensors, int sensor_count, int period_ms, size_t count)
+{
+    int next;
+
+    for (size_t i = 0; i < count; i++) {
+        next = 0;
+        for (int s = 1; s < sensor_count; s++) {
+            if (sensors[s].next_us < sensors[next].next_us) {
+                next = s;
+            }
+        }
+        make_row(repr, &sensors[next], (uint8_t) next, &rows[i]);
+        sensors[next].next_us += (int64_t) period_ms * 1000 + rand_between(-2000, 2000);
+    }
+}
+
+static bool same_rows(const sample_codec_params_t *params, size_t count)
+{
+    int64_t expected;
+
+    for (size_t i = 0; i < count; i++) {
+        expected = rows[i].time_us - rows[i].time_us % TIME_RESOLUTION_US;
+        if (decoded[i].time_us != expected || decoded[i].sensor_id != rows[i].sensor_id
+                || memcmp(decoded[i].values, rows[i].values, params->channel_count * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "row %zu differs after the round trip\n", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Corrupted copies of one batch: flipped bytes, truncations, random tails */
+static void fuzz(const uint8_t *batch, size_t len, unsigned *outcomes)
+{
+    static uint8_t copy[sizeof(buf)];
+    sample_codec_params_t params;
+    size_t copy_len;
+    size_t count;
+
+    for (int round = 0; round < FUZZ_ROUNDS; round++) {
+        memcpy(copy, batch, len);
+        copy_len = len;
+
+        switch (round % 3) {
+        case 0:
+            for (int flips = rand_between(1, 4); flips > 0; flips--) {
+                copy[rand_between(0, (int) len - 1)] ^= (uint8_t) rand_between(1, 255);
+            }
+            break;
+        case 1:
+            copy_len = (size_t) rand_between(0, (int) len - 1);
+            break;
+        default:
+            for (size_t i = (size_t) rand_between(2, (int) len - 1); i < len; i++) {
+                copy[i] = (uint8_t) rand();
+            }
+            break;
+        }
+
+        outcomes[sample_codec_decode(copy, copy_len, &params, decoded, MAX_ROWS, &count)]++;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "sensors", required_argument, NULL, 's' },
+        { "rows", required_argument, NULL, 'r' },
+        { "batches", required_argument, NULL, 'b' },
+        { "period-ms", required_argument, NULL, 'p' },
+        { NULL, 0, NULL, 0 },
+    };
+    sensor_t sensors[MAX_SENSORS];
+    sample_codec_params_t params;
+    sample_codec_params_t params_in;
+    unsigned outcomes[SAMPLE_CODEC_ERR_ARG + 1] = { 0 };
+    int sensor_count = 4;
+    int batch_rows = 32;
+    int batches = 2000;
+    int period_ms = 1000;
+    uint64_t bytes;
+    int64_t encode_ns;
+    int64_t decode_ns;
+    int64_t start;
+    size_t len;
+    size_t count;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:r:b:p:", options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            sensor_count = atoi(optarg);
+            break;
+        case 'r':
+            batch_rows = atoi(optarg);
+            break;
+        case 'b':
+            batches = atoi(optarg);
+            break;
+        case 'p':
+            period_ms = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--sensors N] [--rows N] [--batches N] [--period-ms N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (sensor_count < 1 || sensor_count > MAX_SENSORS || batch_rows < 1 || batch_rows > MAX_ROWS || batches < 1) {
+        fprintf(stderr, "--sensors takes 1 to %d, --rows 1 to %d\n", MAX_SENSORS, MAX_ROWS);
+        return 2;
+    }
+
+    printf("%d sensors every %d ms, %d rows per batch, %d batches; one CBOR map per sample was %d bytes\n",
+           sensor_count, period_ms, batch_rows, batches, CBOR_MAP_BYTES);
+    printf("%-22s %10s %8s %12s %12s\n", "representation", "B/sample", "ratio", "encode ns/row", "decode ns/row");
+
+    for (repr_t repr = 0; repr < REPR_COUNT; repr++) {
+        srand(1);
+        for (int s = 0; s < sensor_count; s++) {
+            sensors[s] = (sensor_t) {
+                .temperature = 377487 + rand_between(-5000, 5000),
+                .humidity = 471859 + rand_between(-20000, 20000),
+                .next_us = EPOCH_START_US + (int64_t) s * period_ms * 1000 / sensor_count,
+            };
+        }
+
+        params = (sample_codec_params_t) {
+            .flags = repr == REPR_FLOAT ? SAMPLE_CODEC_FLAG_XOR : 0,
+            .channel_count = repr == REPR_CENTI_SPREAD ? 4 : 2,
+            .time_resolution_us = TIME_RESOLUTION_US,
+        };
+        bytes = 0;
+        encode_ns = 0;
+        decode_ns = 0;
+
+        for (int b = 0; b < batches; b++) {
+            make_batch(repr, sensors, sensor_count, period_ms, (size_t) batch_rows);
+
+            start = now_ns();
+            if (sample_codec_encode(&params, rows, (size_t) batch_rows, buf, sizeof(buf), &len) != SAMPLE_CODEC_OK) {
+                fprintf(stderr, "%s: encode failed\n", REPR_NAMES[repr]);
+                return 1;
+            }
+            encode_ns += now_ns() - start;
+
+            start = now_ns();
+            if (sample_codec_decode(buf, len, &params_in, decoded, MAX_ROWS, &count) != SAMPLE_CODEC_OK
+                    || count != (size_t) batch_rows || params_in.flags != params.flags
+                    || params_in.channel_count != params.channel_count) {
+                fprintf(stderr, "%s: decode failed\n", REPR_NAMES[repr]);
+                return 1;
+            }
+            decode_ns += now_ns() - start;
+
+            if (!same_rows(&params, count)) {
+                fprintf(stderr, "%s: batch %d\n", REPR_NAMES[repr], b);
+                return 1;
+            }
+            bytes += len;
+
+            if (b < 8) {
+                fuzz(buf, len, outcomes);
+            }
+        }
+
+        printf("%-22s %10.2f %7.1fx %12.1f %12.1f\n", REPR_NAMES[repr],
+               (double) bytes / ((double) batches * batch_rows),
+               CBOR_MAP_BYTES / ((double) bytes / ((double) batches * batch_rows)),
+               (double) encode_ns / ((double) batches * batch_rows),
+               (double) decode_ns / ((double) batches * batch_rows));
+    }
+
+    printf("Corrupted batches: %u decoded, %u rejected as corrupt, %u as too long\n",
+           outcomes[SAMPLE_CODEC_OK], outcomes[SAMPLE_CODEC_ERR_CORRUPT], outcomes[SAMPLE_CODEC_ERR_NO_SPACE]);
+
+    return 0;
+}
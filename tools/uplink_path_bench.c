@@ -0,0 +1,643 @@
+/*
+ * Throughput and latency of the two uplink paths on a host: datagrams in the
+ * wire format of main/transport.h against a UDP collector, and QoS 1
+ * publishes against an MQTT broker, the way CONFIG_UPLINK_TRANSPORT_MQTT
+ * sends them. Both keep --window messages in flight, like CONFIG_UPLINK_ARQ,
+ * and time every message from its write to the ACK or PUBACK that answers
+ * it.
+ *
+ * Without --collector or --broker the tool answers itself on loopback: a
+ * collector thread that ACKs every datagram like tools/dtls_collector.c
+ * does (without DTLS), and a stub broker thread that PUBACKs every publish
+ * and neither routes nor stores anything. Those runs measure the protocols
+ * and the host's network stack only. For broker numbers, start one and
+ * point the tool at it:
+ *
+ *   cc -O2 -Wall -Wextra -pthread -o build/uplink_path_bench tools/uplink_path_bench.c
+ *   mosquitto -p 1883 &
+ *   build/uplink_path_bench --broker 127.0.0.1:1883 [--collector HOST:PORT]
+ *                           [--count N] [--size BYTES] [--window N] [--topic T]
+ */
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Wire format, see main/transport.h */
+#define DATA_MAGIC          0xA7
+#define ACK_MAGIC           0xA8
+#define PROTOCOL_VERSION    2
+#define DEVICE_ID_SIZE      6
+#define DATA_HEADER_SIZE    16
+#define ACK_SIZE            20
+#define SACK_BITS           32
+
+#define MAX_WINDOW          32
+#define MAX_PAYLOAD         1400
+#define MQTT_BUF_SIZE       4096
+#define RESEND_NS           200000000   /* UDP only; loopback loses nothing unless flooded */
+
+#define MQTT_CONNECT        0x10
+#define MQTT_CONNACK        0x20
+#define MQTT_PUBLISH_QOS1   0x32
+#define MQTT_PUBACK         0x40
+#define MQTT_PINGREQ        0xC0
+#define MQTT_DISCONNECT     0xE0
+
+typedef struct {
+    bool busy;
+    uint32_t id;                    /* Sequence, or MQTT packet identifier */
+    int64_t first_ns;               /* First write: what the latency counts from */
+    int64_t sent_ns;                /* Latest write */
+    bool resent;
+} flight_t;
+
+typedef struct {
+    const char *name;
+    int64_t elapsed_ns;
+    int64_t *latency_ns;            /* Messages answered after a single write */
+    size_t latencies;
+    size_t messages;
+    size_t resends;
+} result_t;
+
+static const uint8_t DEVICE_ID[DEVICE_ID_SIZE] = { 0x02, 0x00, 0x00, 0x00, 0xbe, 0x01 };
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static bool seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+static bool parse_addr(const char *text, struct sockaddr_in *addr)
+{
+    char host[64];
+    const char *colon = strrchr(text, ':');
+
+    if (colon == NULL || (size_t) (colon - text) >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, text, colon - text);
+    host[colon - text] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+/* Binds to an ephemeral loopback port and reports it in addr */
+static int listen_loopback(int type, struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, type, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0
+        || getsockname(fd, (struct sockaddr *) addr, &len) < 0
+        || (type == SOCK_STREAM && listen(fd, 1) < 0)) {
+        perror("loopback socket");
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+ * Built-in peers
+ */
+
+/* ACKs every datagram with the cumulative sequence and selective-ACK bitmap */
+static void *collector_thread(void *arg)
+{
+    int fd = *(int *) arg;
+    uint8_t buf[DATA_HEADER_SIZE + MAX_PAYLOAD];
+    uint8_t ack[ACK_SIZE];
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    uint32_t cumulative = 0;
+    uint32_t received = 0;
+    uint32_t seq;
+    uint32_t base;
+    uint32_t offset;
+    bool started = false;
+    ssize_t len;
+
+    for (;;) {
+        peer_len = sizeof(peer);
+        len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &peer, &peer_len);
+        if (len < DATA_HEADER_SIZE || buf[0] != DATA_MAGIC || buf[1] != PROTOCOL_VERSION) {
+            continue;
+        }
+
+        seq = get_be32(&buf[8]);
+        base = get_be32(&buf[12]);
+        if (!started || seq_before(cumulative, base)) {
+            offset = base - cumulative;
+            received = !started || offset > SACK_BITS ? 0 : (uint32_t) ((uint64_t) received >> offset);
+            cumulative = base;
+            started = true;
+        }
+        if (seq == cumulative) {
+            cumulative++;
+        } else if (seq_before(cumulative, seq) && seq - cumulative - 1 < SACK_BITS) {
+            received |= 1u << (seq - cumulative - 1);
+        }
+        while (received & 1) {
+            received >>= 1;
+            cumulative++;
+        }
+
+        ack[0] = ACK_MAGIC;
+        ack[1] = PROTOCOL_VERSION;
+        memcpy(&ack[2], &buf[2], DEVICE_ID_SIZE);
+        put_be32(&ack[8], seq);
+        put_be32(&ack[12], cumulative);
+        put_be32(&ack[16], received);
+        sendto(fd, ack, sizeof(ack), 0, (struct sockaddr *) &peer, peer_len);
+    }
+    return NULL;
+}
+
+static bool read_full(int fd, uint8_t *buf, size_t len)
+{
+    ssize_t got;
+
+    while (len > 0) {
+        got = read(fd, buf, len);
+        if (got <= 0) {
+            return false;
+        }
+        buf += got;
+        len -= (size_t) got;
+    }
+    return true;
+}
+
+/* Reads one MQTT packet: fixed header byte, then up to size bytes of body */
+static bool mqtt_read_packet(int fd, uint8_t *type, uint8_t *body, size_t size, size_t *len)
+{
+    uint8_t byte;
+    size_t remaining = 0;
+
+    if (!read_full(fd, type, 1)) {
+        return false;
+    }
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (!read_full(fd, &byte, 1)) {
+            return false;
+        }
+        remaining |= (size_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    if (remaining > size) {
+        return false;
+    }
+    *len = remaining;
+    return read_full(fd, body, remaining);
+}
+
+/* Accepts one client and PUBACKs its publishes; no routing, no storage */
+static void *broker_thread(void *arg)
+{
+    int listener = *(int *) arg;
+    static uint8_t body[MQTT_BUF_SIZE];
+    uint8_t reply[4];
+    uint8_t type;
+    size_t len;
+    size_t topic_len;
+    int one = 1;
+    int fd;
+
+    for (;;) {
+        fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        while (mqtt_read_packet(fd, &type, body, sizeof(body), &len)) {
+            switch (type & 0xf0) {
+            case MQTT_CONNECT:
+                reply[0] = MQTT_CONNACK;
+                reply[1] = 2;
+                reply[2] = 0;
+                reply[3] = 0;
+                write(fd, reply, 4);
+                break;
+            case MQTT_PUBLISH_QOS1 & 0xf0:
+                topic_len = (size_t) body[0] << 8 | body[1];
+                if ((type & 0x06) == 0x02 && len >= topic_len + 4) {
+                    reply[0] = MQTT_PUBACK;
+                    reply[1] = 2;
+                    reply[2] = body[topic_len + 2];
+                    reply[3] = body[topic_len + 3];
+                    write(fd, reply, 4);
+                }
+                break;
+            case MQTT_PINGREQ:
+                reply[0] = 0xD0;
+                reply[1] = 0;
+                write(fd, reply, 2);
+                break;
+            default:
+                break;
+            }
+            if ((type & 0xf0) == MQTT_DISCONNECT) {
+                break;
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Clients
+ */
+
+static flight_t *flight_find(flight_t *flights, int window, uint32_t id)
+{
+    for (int i = 0; i < window; i++) {
+        if (flights[i].busy && flights[i].id == id) {
+            return &flights[i];
+        }
+    }
+    return NULL;
+}
+
+static flight_t *flight_free(flight_t *flights, int window)
+{
+    for (int i = 0; i < window; i++) {
+        if (!flights[i].busy) {
+            return &flights[i];
+        }
+    }
+    return NULL;
+}
+
+static void flight_done(flight_t *f, int64_t at_ns, result_t *result)
+{
+    /* Karn's rule, as in the firmware: a resent message gives no sample */
+    if (!f->resent) {
+        result->latency_ns[result->latencies++] = at_ns - f->first_ns;
+    }
+    f->busy = false;
+    result->messages++;
+}
+
+static uint32_t udp_window_base(const flight_t *flights, int window, uint32_t next_seq)
+{
+    uint32_t base = next_seq;
+
+    for (int i = 0; i < window; i++) {
+        if (flights[i].busy && seq_before(flights[i].id, base)) {
+            base = flights[i].id;
+        }
+    }
+    return base;
+}
+
+static void udp_transmit(int fd, uint8_t *datagram, size_t len, flight_t *f, const flight_t *flights, int window,
+                         uint32_t next_seq)
+{
+    put_be32(&datagram[8], f->id);
+    put_be32(&datagram[12], udp_window_base(flights, window, next_seq));
+    f->sent_ns = now_ns();
+    send(fd, datagram, len, 0);
+}
+
+static void run_udp(const struct sockaddr_in *collector, int count, size_t size, int window, result_t *result)
+{
+    static uint8_t datagram[DATA_HEADER_SIZE + MAX_PAYLOAD];
+    flight_t flights[MAX_WINDOW] = { 0 };
+    uint8_t ack[ACK_SIZE + 1];
+    struct pollfd pfd;
+    flight_t *f;
+    uint32_t next_seq = 1;
+    uint32_t echoed;
+    uint32_t cumulative;
+    uint32_t sack;
+    uint32_t offset;
+    int64_t start;
+    int64_t at;
+    int sent = 0;
+    int in_flight = 0;
+    ssize_t len;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0 || connect(fd, (const struct sockaddr *) collector, sizeof(*collector)) < 0) {
+        perror("collector");
+        exit(1);
+    }
+
+    datagram[0] = DATA_MAGIC;
+    datagram[1] = PROTOCOL_VERSION;
+    memcpy(&datagram[2], DEVICE_ID, DEVICE_ID_SIZE);
+    for (size_t i = 0; i < size; i++) {
+        datagram[DATA_HEADER_SIZE + i] = (uint8_t) i;
+    }
+
+    start = now_ns();
+    while (sent < count || in_flight > 0) {
+        while (sent < count && in_flight < window) {
+            f = flight_free(flights, window);
+            *f = (flight_t) { .busy = true, .id = next_seq++ };
+            f->first_ns = now_ns();
+            udp_transmit(fd, datagram, DATA_HEADER_SIZE + size, f, flights, window, next_seq);
+            sent++;
+            in_flight++;
+        }
+
+        pfd = (struct pollfd) { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, RESEND_NS / 1000000) > 0 && (len = recv(fd, ack, sizeof(ack), 0)) == ACK_SIZE
+            && ack[0] == ACK_MAGIC && memcmp(&ack[2], DEVICE_ID, DEVICE_ID_SIZE) == 0) {
+            at = now_ns();
+            echoed = get_be32(&ack[8]);
+            cumulative = get_be32(&ack[12]);
+            sack = get_be32(&ack[16]);
+            for (int i = 0; i < window; i++) {
+                offset = flights[i].id - cumulative - 1;
+                if (flights[i].busy && (flights[i].id == echoed || seq_before(flights[i].id, cumulative)
+                                        || (offset < SACK_BITS && (sack & (1u << offset))))) {
+                    /* Only the datagram the ACK answers is timed; the
+                       others it covers were answered earlier */
+                    if (flights[i].id != echoed) {
+                        flights[i].resent = true;
+                    }
+                    flight_done(&flights[i], at, result);
+                    in_flight--;
+                }
+            }
+        }
+
+        for (int i = 0; i < window; i++) {
+            if (flights[i].busy && now_ns() - flights[i].sent_ns > RESEND_NS) {
+                flights[i].resent = true;
+                result->resends++;
+                udp_transmit(fd, datagram, DATA_HEADER_SIZE + size, &flights[i], flights, window, next_seq);
+            }
+        }
+    }
+    result->elapsed_ns = now_ns() - start;
+    close(fd);
+}
+
+static size_t mqtt_put_length(uint8_t *out, size_t len)
+{
+    size_t n = 0;
+
+    do {
+        out[n] = len % 128;
+        len /= 128;
+        if (len > 0) {
+            out[n] |= 0x80;
+        }
+        n++;
+    } while (len > 0);
+    return n;
+}
+
+static void run_mqtt(const struct sockaddr_in *broker, const char *topic, int count, size_t size, int window,
+                     result_t *result)
+{
+    static const uint8_t connect_body[] = {
+        0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 0x3c,     /* 3.1.1, clean session, 60 s keepalive */
+        0x00, 0x0c, 'u', 'p', 'l', 'i', 'n', 'k', '-', 'b', 'e', 'n', 'c', 'h',
+    };
+    static uint8_t packet[8 + 2 + 256 + 2 + DATA_HEADER_SIZE + MAX_PAYLOAD];
+    flight_t flights[MAX_WINDOW] = { 0 };
+    uint8_t body[MQTT_BUF_SIZE];
+    uint8_t type;
+    size_t topic_len = strlen(topic);
+    size_t header_len;
+    size_t id_at;
+    size_t len;
+    flight_t *f;
+    uint16_t next_id = 1;
+    int64_t start;
+    int sent = 0;
+    int in_flight = 0;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    /* esp-mqtt writes each packet at once; Nagle would only add delay here */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fd < 0 || connect(fd, (const struct sockaddr *) broker, sizeof(*broker)) < 0) {
+        perror("broker");
+        exit(1);
+    }
+
+    packet[0] = MQTT_CONNECT;
+    header_len = 1 + mqtt_put_length(&packet[1], sizeof(connect_body));
+    memcpy(&packet[header_len], connect_body, sizeof(connect_body));
+    write(fd, packet, header_len + sizeof(connect_body));
+    if (!mqtt_read_packet(fd, &type, body, sizeof(body), &len) || type != MQTT_CONNACK || len != 2 || body[1] != 0) {
+        fprintf(stderr, "broker refused the connection\n");
+        exit(1);
+    }
+
+    /* The payload keeps the sequence header, as the firmware's does */
+    packet[0] = MQTT_PUBLISH_QOS1;
+    header_len = 1 + mqtt_put_length(&packet[1], 2 + topic_len + 2 + DATA_HEADER_SIZE + size);
+    packet[header_len] = topic_len >> 8;
+    packet[header_len + 1] = topic_len & 0xff;
+    memcpy(&packet[header_len + 2], topic, topic_len);
+    id_at = header_len + 2 + topic_len;
+    packet[id_at + 2] = DATA_MAGIC;
+    packet[id_at + 3] = PROTOCOL_VERSION;
+    memcpy(&packet[id_at + 4], DEVICE_ID, DEVICE_ID_SIZE);
+    for (size_t i = 0; i < size; i++) {
+        packet[id_at + 2 + DATA_HEADER_SIZE + i] = (uint8_t) i;
+    }
+
+    start = now_ns();
+    while (sent < count || in_flight > 0) {
+        while (sent < count && in_flight < window) {
+            f = flight_free(flights, window);
+            *f = (flight_t) { .busy = true, .id = next_id };
+            packet[id_at] = next_id >> 8;
+            packet[id_at + 1] = next_id & 0xff;
+            put_be32(&packet[id_at + 2 + 8], (uint32_t) sent);
+            put_be32(&packet[id_at + 2 + 12], (uint32_t) sent);
+            next_id = next_id == UINT16_MAX ? 1 : next_id + 1;
+
+            f->first_ns = now_ns();
+            f->sent_ns = f->first_ns;
+            write(fd, packet, id_at + 2 + DATA_HEADER_SIZE + size);
+            sent++;
+            in_flight++;
+        }
+
+        if (!mqtt_read_packet(fd, &type, body, sizeof(body), &len)) {
+            fprintf(stderr, "broker closed the connection\n");
+            exit(1);
+        }
+        if (type == MQTT_PUBACK && len >= 2 && (f = flight_find(flights, window, (uint32_t) body[0] << 8 | body[1])) != NULL) {
+            flight_done(f, now_ns(), result);
+            in_flight--;
+        }
+    }
+    result->elapsed_ns = now_ns() - start;
+
+    packet[0] = MQTT_DISCONNECT;
+    packet[1] = 0;
+    write(fd, packet, 2);
+    close(fd);
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_result(const result_t *r, size_t size)
+{
+    double seconds = (double) r->elapsed_ns / 1e9;
+
+    qsort(r->latency_ns, r->latencies, sizeof(r->latency_ns[0]), compare_ns);
+    printf("%-30s %10.0f %10.1f %8.1f %8.1f %8.1f %8.1f %8zu\n", r->name,
+           (double) r->messages / seconds,
+           (double) r->messages * (double) size / seconds / 1024,
+           r->latencies ? (double) r->latency_ns[0] / 1000 : 0.0,
+           r->latencies ? (double) r->latency_ns[r->latencies / 2] / 1000 : 0.0,
+           r->latencies ? (double) r->latency_ns[r->latencies * 99 / 100] / 1000 : 0.0,
+           r->latencies ? (double) r->latency_ns[r->latencies - 1] / 1000 : 0.0,
+           r->resends);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--broker HOST:PORT] [--collector HOST:PORT] [--count N] [--size BYTES] [--window N] [--topic T]\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "broker", required_argument, NULL, 'b' },
+        { "collector", required_argument, NULL, 'c' },
+        { "count", required_argument, NULL, 'n' },
+        { "size", required_argument, NULL, 's' },
+        { "window", required_argument, NULL, 'w' },
+        { "topic", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct sockaddr_in broker;
+    struct sockaddr_in collector;
+    bool own_broker = true;
+    bool own_collector = true;
+    const char *topic = "sensors/uplink";
+    int count = 20000;
+    int size = 120;
+    int window = 4;
+    int collector_fd;
+    int broker_fd;
+    pthread_t thread;
+    result_t udp = { 0 };
+    result_t mqtt = { 0 };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:c:n:s:w:t:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            if (!parse_addr(optarg, &broker)) {
+                usage(argv[0]);
+            }
+            own_broker = false;
+            break;
+        case 'c':
+            if (!parse_addr(optarg, &collector)) {
+                usage(argv[0]);
+            }
+            own_collector = false;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 't':
+            topic = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (count < 1 || size < 0 || size > MAX_PAYLOAD || window < 1 || window > MAX_WINDOW || strlen(topic) > 256) {
+        fprintf(stderr, "--count takes at least 1, --size 0 to %d, --window 1 to %d, --topic up to 256 bytes\n",
+                MAX_PAYLOAD, MAX_WINDOW);
+        return 2;
+    }
+
+    if (own_collector) {
+        collector_fd = listen_loopback(SOCK_DGRAM, &collector);
+        pthread_create(&thread, NULL, collector_thread, &collector_fd);
+    }
+    if (own_broker) {
+        broker_fd = listen_loopback(SOCK_STREAM, &broker);
+        pthread_create(&thread, NULL, broker_thread, &broker_fd);
+    }
+
+    udp.name = own_collector ? "UDP, built-in collector" : "UDP";
+    udp.latency_ns = calloc((size_t) count, sizeof(int64_t));
+    mqtt.name = own_broker ? "MQTT QoS 1, stub broker" : "MQTT QoS 1";
+    mqtt.latency_ns = calloc((size_t) count, sizeof(int64_t));
+
+    run_udp(&collector, count, (size_t) size, window, &udp);
+    run_mqtt(&broker, topic, count, (size_t) size, window, &mqtt);
+
+    printf("%d messages of %d bytes plus the %d-byte sequence header, %d in flight\n",
+           count, size, DATA_HEADER_SIZE, window);
+    printf("%-30s %10s %10s %8s %8s %8s %8s %8s\n", "path", "msgs/s", "KB/s", "min us", "p50 us", "p99 us", "max us",
+           "resends");
+    print_result(&udp, (size_t) size);
+    print_result(&mqtt, (size_t) size);
+
+    free(udp.latency_ns);
+    free(mqtt.latency_ns);
+    return 0;
+}
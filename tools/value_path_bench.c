@@ -0,0 +1,283 @@
+/*
+ * Host microbenchmark for the AHT20 value path (main/aht.c,
+ * main/sensor_driver.c, CONFIG_SENSOR_VALUE_FORMAT): the table-driven CRC-8
+ * against the bit loop it replaced, and the float conversion against the
+ * fixed-point centi-unit one, with the CBOR bytes each representation costs
+ * on the wire.
+ *
+ * The firmware functions below are copies, since their headers pull in
+ * FreeRTOS; the CRC table is checked against the bit loop and the centi-unit
+ * conversion against the float one before anything is timed.
+ *
+ *   cc -O2 -Wall -Wextra -o build/value_path_bench tools/value_path_bench.c -lm
+ *   build/value_path_bench [--samples N]
+ *
+ * Host times only rank the paths; the ESP32-S3's single-precision FPU and
+ * 240 MHz core scale them differently.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define AHT20_DATA_LEN  6
+#define FRAMES          4096
+
+typedef struct {
+    float   scale;
+    float   offset;
+    int32_t centi_mul;
+    uint8_t centi_shift;
+    int32_t centi_offset;
+} raw_channel_t;
+
+/* aht20_raw_channels in main/aht.c: temperature, then humidity */
+static const raw_channel_t channels[2] = {
+    { .scale = 0.000190735f, .offset = -50.0f, .centi_mul = 20000, .centi_shift = 20, .centi_offset = -5000 },
+    { .scale = 0.000095367f, .offset = 0.0f, .centi_mul = 10000, .centi_shift = 20, .centi_offset = 0 },
+};
+
+/* aht20_crc_table in main/aht.c */
+static const uint8_t crc_table[256] = {
+    0x00, 0x31, 0x62, 0x53, 0xC4, 0xF5, 0xA6, 0x97, 0xB9, 0x88, 0xDB, 0xEA, 0x7D, 0x4C, 0x1F, 0x2E,
+    0x43, 0x72, 0x21, 0x10, 0x87, 0xB6, 0xE5, 0xD4, 0xFA, 0xCB, 0x98, 0xA9, 0x3E, 0x0F, 0x5C, 0x6D,
+    0x86, 0xB7, 0xE4, 0xD5, 0x42, 0x73, 0x20, 0x11, 0x3F, 0x0E, 0x5D, 0x6C, 0xFB, 0xCA, 0x99, 0xA8,
+    0xC5, 0xF4, 0xA7, 0x96, 0x01, 0x30, 0x63, 0x52, 0x7C, 0x4D, 0x1E, 0x2F, 0xB8, 0x89, 0xDA, 0xEB,
+    0x3D, 0x0C, 0x5F, 0x6E, 0xF9, 0xC8, 0x9B, 0xAA, 0x84, 0xB5, 0xE6, 0xD7, 0x40, 0x71, 0x22, 0x13,
+    0x7E, 0x4F, 0x1C, 0x2D, 0xBA, 0x8B, 0xD8, 0xE9, 0xC7, 0xF6, 0xA5, 0x94, 0x03, 0x32, 0x61, 0x50,
+    0xBB, 0x8A, 0xD9, 0xE8, 0x7F, 0x4E, 0x1D, 0x2C, 0x02, 0x33, 0x60, 0x51, 0xC6, 0xF7, 0xA4, 0x95,
+    0xF8, 0xC9, 0x9A, 0xAB, 0x3C, 0x0D, 0x5E, 0x6F, 0x41, 0x70, 0x23, 0x12, 0x85, 0xB4, 0xE7, 0xD6,
+    0x7A, 0x4B, 0x18, 0x29, 0xBE, 0x8F, 0xDC, 0xED, 0xC3, 0xF2, 0xA1, 0x90, 0x07, 0x36, 0x65, 0x54,
+    0x39, 0x08, 0x5B, 0x6A, 0xFD, 0xCC, 0x9F, 0xAE, 0x80, 0xB1, 0xE2, 0xD3, 0x44, 0x75, 0x26, 0x17,
+    0xFC, 0xCD, 0x9E, 0xAF, 0x38, 0x09, 0x5A, 0x6B, 0x45, 0x74, 0x27, 0x16, 0x81, 0xB0, 0xE3, 0xD2,
+    0xBF, 0x8E, 0xDD, 0xEC, 0x7B, 0x4A, 0x19, 0x28, 0x06, 0x37, 0x64, 0x55, 0xC2, 0xF3, 0xA0, 0x91,
+    0x47, 0x76, 0x25, 0x14, 0x83, 0xB2, 0xE1, 0xD0, 0xFE, 0xCF, 0x9C, 0xAD, 0x3A, 0x0B, 0x58, 0x69,
+    0x04, 0x35, 0x66, 0x57, 0xC0, 0xF1, 0xA2, 0x93, 0xBD, 0x8C, 0xDF, 0xEE, 0x79, 0x48, 0x1B, 0x2A,
+    0xC1, 0xF0, 0xA3, 0x92, 0x05, 0x34, 0x67, 0x56, 0x78, 0x49, 0x1A, 0x2B, 0xBC, 0x8D, 0xDE, 0xEF,
+    0x82, 0xB3, 0xE0, 0xD1, 0x46, 0x77, 0x24, 0x15, 0x3B, 0x0A, 0x59, 0x68, 0xFF, 0xCE, 0x9D, 0xAC,
+};
+
+static uint8_t frames[FRAMES][AHT20_DATA_LEN];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* aht20_calc_crc() before the table */
+static uint8_t crc_bitwise(const uint8_t *data, uint8_t len)
+{
+    uint8_t crc = 0xFF;
+
+    for (uint8_t byte = 0; byte < len; byte++) {
+        crc ^= data[byte];
+        for (uint8_t i = 8; i > 0; --i) {
+            if ((crc & 0x80) != 0) {
+                crc = (crc << 1) ^ 0x31;
+            } else {
+                crc = crc << 1;
+            }
+        }
+    }
+
+    return crc;
+}
+
+/* aht20_calc_crc() */
+static uint8_t crc_table_driven(const uint8_t *data, uint8_t len)
+{
+    uint8_t crc = 0xFF;
+
+    for (uint8_t byte = 0; byte < len; byte++) {
+        crc = crc_table[crc ^ data[byte]];
+    }
+
+    return crc;
+}
+
+/* aht20_extract_raw(): temperature into codes[0], humidity into codes[1] */
+static void extract_raw(const uint8_t *buf, int32_t *codes)
+{
+    codes[0] = (int32_t) ((((uint32_t) buf[3] & 0x0F) << 16) | ((uint32_t) buf[4] << 8) | buf[5]);
+    codes[1] = (int32_t) (((uint32_t) buf[1] << 12) | ((uint32_t) buf[2] << 4) | (buf[3] >> 4));
+}
+
+/* sensor_code_to_centi() */
+static int32_t code_to_centi(const raw_channel_t *raw, int32_t code)
+{
+    int64_t scaled = (int64_t) code * raw->centi_mul;
+
+    if (raw->centi_shift > 0) {
+        scaled = (scaled + ((int64_t) 1 << (raw->centi_shift - 1))) >> raw->centi_shift;
+    }
+
+    return (int32_t) scaled + raw->centi_offset;
+}
+
+static float code_to_float(const raw_channel_t *raw, int32_t code)
+{
+    return (float) code * raw->scale + raw->offset;
+}
+
+/* Bytes cbor_encode_int() spends on the value */
+static size_t cbor_int_size(int32_t value)
+{
+    uint32_t magnitude = value < 0 ? (uint32_t) -(value + 1) : (uint32_t) value;
+
+    if (magnitude < 24) {
+        return 1;
+    }
+    if (magnitude <= 0xFF) {
+        return 2;
+    }
+    if (magnitude <= 0xFFFF) {
+        return 3;
+    }
+    return 5;
+}
+
+/* A slow drift around 22 degC and 45 %RH, the way a room reads */
+static void make_frames(void)
+{
+    uint32_t temperature = 377487;
+    uint32_t humidity = 471859;
+
+    srand(1);
+    for (int i = 0; i < FRAMES; i++) {
+        temperature += (uint32_t) (rand() % 257) - 128;
+        humidity += (uint32_t) (rand() % 513) - 256;
+
+        frames[i][0] = 0x18;
+        frames[i][1] = (uint8_t) (humidity >> 12);
+        frames[i][2] = (uint8_t) (humidity >> 4);
+        frames[i][3] = (uint8_t) (((humidity & 0x0F) << 4) | ((temperature >> 16) & 0x0F));
+        frames[i][4] = (uint8_t) (temperature >> 8);
+        frames[i][5] = (uint8_t) temperature;
+    }
+}
+
+static int check(void)
+{
+    uint8_t byte;
+    int32_t worst = 0;
+    int32_t diff;
+
+    for (int i = 0; i < 256; i++) {
+        byte = (uint8_t) i;
+        if (crc_table_driven(&byte, 1) != crc_bitwise(&byte, 1)) {
+            fprintf(stderr, "CRC table differs from the bit loop at 0x%02x\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < FRAMES; i++) {
+        if (crc_table_driven(frames[i], AHT20_DATA_LEN) != crc_bitwise(frames[i], AHT20_DATA_LEN)) {
+            fprintf(stderr, "CRC table differs from the bit loop on frame %d\n", i);
+            return 1;
+        }
+    }
+
+    /* Every 20-bit code, both channels */
+    for (int32_t code = 0; code < (1 << 20); code++) {
+        for (int ch = 0; ch < 2; ch++) {
+            diff = code_to_centi(&channels[ch], code) - (int32_t) lround(code_to_float(&channels[ch], code) * 100.0);
+            diff = diff < 0 ? -diff : diff;
+            worst = diff > worst ? diff : worst;
+        }
+    }
+    printf("centi-unit conversion: at most %" PRId32 " centi-unit from the float path over all 2^20 codes\n", worst);
+
+    return worst > 1;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "samples", required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 },
+    };
+    long samples = 20000000;
+    int32_t codes[2];
+    uint32_t sink = 0;
+    float sink_f = 0.0f;
+    size_t bytes_float = 0;
+    size_t bytes_centi = 0;
+    size_t bytes_raw = 0;
+    int64_t start;
+    double crc_bitwise_ns;
+    double crc_table_ns;
+    double float_ns;
+    double centi_ns;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "n:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            samples = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--samples N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (samples <= 0) {
+        samples = 1;
+    }
+
+    make_frames();
+    if (check() != 0) {
+        return 1;
+    }
+
+    start = now_ns();
+    for (long i = 0; i < samples; i++) {
+        sink += crc_bitwise(frames[i % FRAMES], AHT20_DATA_LEN);
+    }
+    crc_bitwise_ns = (double) (now_ns() - start) / samples;
+
+    start = now_ns();
+    for (long i = 0; i < samples; i++) {
+        sink += crc_table_driven(frames[i % FRAMES], AHT20_DATA_LEN);
+    }
+    crc_table_ns = (double) (now_ns() - start) / samples;
+
+    start = now_ns();
+    for (long i = 0; i < samples; i++) {
+        extract_raw(frames[i % FRAMES], codes);
+        sink_f += code_to_float(&channels[0], codes[0]) + code_to_float(&channels[1], codes[1]);
+    }
+    float_ns = (double) (now_ns() - start) / samples;
+
+    start = now_ns();
+    for (long i = 0; i < samples; i++) {
+        extract_raw(frames[i % FRAMES], codes);
+        sink += (uint32_t) (code_to_centi(&channels[0], codes[0]) + code_to_centi(&channels[1], codes[1]));
+    }
+    centi_ns = (double) (now_ns() - start) / samples;
+
+    /* cbor_encode_float() always writes a 32-bit float: 1 + 4 bytes */
+    for (int i = 0; i < FRAMES; i++) {
+        extract_raw(frames[i], codes);
+        for (int ch = 0; ch < 2; ch++) {
+            bytes_float += 5;
+            bytes_centi += cbor_int_size(code_to_centi(&channels[ch], codes[ch]));
+            bytes_raw += cbor_int_size(codes[ch]);
+        }
+    }
+
+    printf("CRC-8 over a %d-byte frame: bit loop %.1f ns, table %.1f ns (%.1fx)\n",
+           AHT20_DATA_LEN, crc_bitwise_ns, crc_table_ns, crc_bitwise_ns / crc_table_ns);
+    printf("Conversion per sample (2 channels, frame parse included): float %.1f ns, centi-units %.1f ns\n",
+           float_ns, centi_ns);
+    printf("CBOR value bytes per sample: float %.1f, centi-units %.1f, raw codes %.1f\n",
+           (double) bytes_float / FRAMES, (double) bytes_centi / FRAMES, (double) bytes_raw / FRAMES);
+    printf("(checksum %" PRIu32 " %.0f)\n", sink, (double) sink_f);
+
+    return 0;
+}